@@ -0,0 +1,1021 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Benchmark harness. Measures every device command on its own, followed by a
+ * few scenarios that resemble real applications, and writes the results to
+ * standard output as JSON.
+ *
+ * Runs against the device emulator unless a device path is given.
+ *
+ * Usage: ulcd-bench [-b baud_rate] [-c command_cost_usec] [-f filter] [-n iterations] [device]
+ */
+
+struct bench_t {
+    const char *name;
+    int (*run)(struct ulcd_t *ulcd, unsigned long i);
+    unsigned long iterations;
+};
+
+struct bench_result_t {
+    unsigned long ops;
+    unsigned long errors;
+    unsigned long long elapsed;
+    unsigned long long p50;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long tx_bytes;
+    unsigned long long rx_bytes;
+    unsigned long read_calls;
+    unsigned long write_calls;
+    unsigned long poll_calls;
+};
+
+static struct ulcd_emu_t *emu;
+static char *pixels;
+static char *rgba;
+static char *frame;
+static struct shadow_t *shadow;
+static struct sprite_cache_t *sprites;
+
+
+/*******************
+ * Microbenchmarks *
+ *******************/
+
+static int
+bench_move_cursor(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_move_cursor(ulcd, i % 20, i % 60);
+}
+
+static int
+bench_txt_putch(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_txt_putch(ulcd, 'a' + i % 26);
+}
+
+static int
+bench_txt_putstr(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t len;
+    return ulcd_txt_putstr(ulcd, "The quick brown fox", &len);
+}
+
+static int
+bench_txt_charwidth(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t width;
+    return ulcd_txt_charwidth(ulcd, 'a' + i % 26, &width);
+}
+
+static int
+bench_txt_charheight(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t height;
+    return ulcd_txt_charheight(ulcd, 'a' + i % 26, &height);
+}
+
+static int
+bench_txt_set_color_fg(struct ulcd_t *ulcd, unsigned long i)
+{
+    color_t prev;
+    return ulcd_txt_set_color_fg(ulcd, i & 1 ? 0xffff : 0xf800, &prev);
+}
+
+static int
+bench_txt_set_color_bg(struct ulcd_t *ulcd, unsigned long i)
+{
+    color_t prev;
+    return ulcd_txt_set_color_bg(ulcd, i & 1 ? 0x0000 : 0x001f, &prev);
+}
+
+static int
+bench_txt_set_font(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_font(ulcd, i % 3, &prev);
+}
+
+static int
+bench_txt_set_width(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_width(ulcd, 1 + i % 2, &prev);
+}
+
+static int
+bench_txt_set_height(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_height(ulcd, 1 + i % 2, &prev);
+}
+
+static int
+bench_txt_set_xgap(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_xgap(ulcd, i % 4, &prev);
+}
+
+static int
+bench_txt_set_ygap(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_ygap(ulcd, i % 4, &prev);
+}
+
+static int
+bench_txt_set_bold(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_bold(ulcd, i & 1, &prev);
+}
+
+static int
+bench_txt_set_inverse(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_inverse(ulcd, i & 1, &prev);
+}
+
+static int
+bench_txt_set_italic(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_italic(ulcd, i & 1, &prev);
+}
+
+static int
+bench_txt_set_underline(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_underline(ulcd, i & 1, &prev);
+}
+
+static int
+bench_txt_set_opacity(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_opacity(ulcd, i & 1, &prev);
+}
+
+static int
+bench_txt_set_attributes(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t prev;
+    return ulcd_txt_set_attributes(ulcd, i & 1 ? TXT_ATTRIBUTE_BOLD : 0, &prev);
+}
+
+static int
+bench_txt_reset(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_txt_reset(ulcd);
+}
+
+static int
+bench_touch_set_detect_region(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1 = {0, 0};
+    struct point_t p2 = {479, 271};
+    return ulcd_touch_set_detect_region(ulcd, &p1, &p2);
+}
+
+static int
+bench_touch_set(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_touch_set(ulcd, TOUCH_SET_MODE_INIT);
+}
+
+static int
+bench_touch_disable(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_touch_disable(ulcd);
+}
+
+static int
+bench_touch_reset(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_touch_reset(ulcd);
+}
+
+static int
+bench_touch_init(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_touch_init(ulcd);
+}
+
+static int
+bench_touch_get(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t status;
+    return ulcd_touch_get(ulcd, TOUCH_GET_MODE_STATUS, &status);
+}
+
+static int
+bench_touch_get_event(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct touch_event_t ev;
+    return ulcd_touch_get_event(ulcd, &ev);
+}
+
+static int
+bench_gfx_cls(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_gfx_cls(ulcd);
+}
+
+static int
+bench_gfx_rectangle(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1 = {10, 10};
+    struct point_t p2 = {110, 60};
+    return ulcd_gfx_rectangle(ulcd, &p1, &p2, i);
+}
+
+static int
+bench_gfx_filled_rectangle(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1 = {10, 10};
+    struct point_t p2 = {110, 60};
+    return ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, i);
+}
+
+static int
+bench_gfx_circle(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {240, 136};
+    return ulcd_gfx_circle(ulcd, &p, 50, i);
+}
+
+static int
+bench_gfx_filled_circle(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {240, 136};
+    return ulcd_gfx_filled_circle(ulcd, &p, 50, i);
+}
+
+static int
+bench_gfx_polygon(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1 = {100, 100};
+    struct point_t p2 = {200, 250};
+    struct point_t p3 = {150, 50};
+    struct point_t *points[3] = {&p1, &p2, &p3};
+    struct polygon_t poly = {3, points};
+    return ulcd_gfx_polygon(ulcd, &poly, i);
+}
+
+static int
+bench_gfx_filled_polygon(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1 = {100, 100};
+    struct point_t p2 = {200, 250};
+    struct point_t p3 = {150, 50};
+    struct point_t *points[3] = {&p1, &p2, &p3};
+    struct polygon_t poly = {3, points};
+    return ulcd_gfx_filled_polygon(ulcd, &poly, i);
+}
+
+static int
+bench_gfx_contrast(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_gfx_contrast(ulcd, CONTRAST_MAX);
+}
+
+static int
+bench_gfx_move_to(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {240, 136};
+    return ulcd_gfx_move_to(ulcd, &p);
+}
+
+static int
+bench_gfx_clipping(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_gfx_clipping(ulcd, 0);
+}
+
+static int
+bench_gfx_clip_window(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1 = {0, 0};
+    struct point_t p2 = {479, 271};
+    return ulcd_gfx_clip_window(ulcd, &p1, &p2);
+}
+
+static int
+bench_gfx_screen_copy_paste(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t src = {0, 0};
+    struct point_t dest = {100, 100};
+    return ulcd_gfx_screen_copy_paste(ulcd, &src, &dest, 16, 16);
+}
+
+static int
+bench_gfx_set(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_gfx_set(ulcd, GFX_SET_OBJECT_COLOUR, i & 0xffff);
+}
+
+static int
+bench_gfx_set_page_display(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_gfx_set_page_display(ulcd, 0);
+}
+
+static int
+bench_gfx_set_page_read(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_gfx_set_page_read(ulcd, 0);
+}
+
+static int
+bench_gfx_set_page_write(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_gfx_set_page_write(ulcd, 0);
+}
+
+static int
+bench_frame(struct ulcd_t *ulcd, unsigned long i)
+{
+    if (ulcd_frame_begin(ulcd)) {
+        return ulcd->error;
+    }
+    return ulcd_frame_end(ulcd);
+}
+
+static int
+bench_display_off(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_display_off(ulcd);
+}
+
+static int
+bench_display_on(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_display_on(ulcd);
+}
+
+static int
+bench_image_bitblt(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {0, 0};
+    return ulcd_image_bitblt(ulcd, &p, 16, 16, pixels);
+}
+
+static int
+bench_get_display_model(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_get_display_model(ulcd);
+}
+
+static int
+bench_get_spe_version(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_get_spe_version(ulcd);
+}
+
+static int
+bench_get_pmmc_version(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_get_pmmc_version(ulcd);
+}
+
+
+/*******************
+ * Macrobenchmarks *
+ *******************/
+
+/**
+ * Draw a full screen image.
+ */
+static int
+bench_fullscreen_bitblt(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {0, 0};
+    return ulcd_image_bitblt(ulcd, &p, EMU_WIDTH, EMU_HEIGHT, pixels);
+}
+
+static int
+bench_pixel_source(struct ulcd_t *ulcd, char *buffer, int size, void *arg)
+{
+    unsigned long *offset = arg;
+
+    memcpy(buffer, pixels + *offset, size);
+    *offset += size;
+
+    return size;
+}
+
+/**
+ * Draw a full screen image in bands, with the next band produced while the
+ * previous one is drawn.
+ */
+static int
+bench_fullscreen_bitblt_stream(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {0, 0};
+    unsigned long offset = 0;
+    int err;
+
+    if (ulcd_pipeline_begin(ulcd, PIPELINE_DEPTH_MAX, NULL, NULL)) {
+        return ulcd->error;
+    }
+    err = ulcd_image_bitblt_stream(ulcd, &p, EMU_WIDTH, EMU_HEIGHT, bench_pixel_source, NULL, &offset);
+    if (ulcd_pipeline_flush(ulcd) && err == ERROK) {
+        err = ulcd->error;
+    }
+    ulcd_pipeline_end(ulcd);
+
+    return err;
+}
+
+/**
+ * Convert a full screen of RGBA pixels with dithering, without sending it,
+ * to show what the conversion costs on its own.
+ */
+static int
+bench_fullscreen_convert(struct ulcd_t *ulcd, unsigned long i)
+{
+    int y;
+
+    for (y = 0; y < EMU_HEIGHT; y++) {
+        ulcd_pixels_convert(pixels + y * EMU_WIDTH * 2, rgba + y * EMU_WIDTH * 4, EMU_WIDTH,
+                            PIXEL_RGBA8888 | PIXEL_DITHER, 0, y);
+    }
+
+    return ERROK;
+}
+
+/**
+ * Draw a full screen of RGBA pixels, converted while it is sent.
+ */
+static int
+bench_fullscreen_bitblt_rgba(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {0, 0};
+    return ulcd_image_bitblt_convert(ulcd, &p, EMU_WIDTH, EMU_HEIGHT, rgba, EMU_WIDTH * 4,
+                                     PIXEL_RGBA8888 | PIXEL_DITHER);
+}
+
+/**
+ * Draw a full screen image of noise with the encoder, which should find
+ * nothing to fill and cost no more than a plain blit.
+ */
+static int
+bench_fullscreen_encode(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p = {0, 0};
+    return ulcd_image_encode(ulcd, &p, pixels, EMU_WIDTH * 2, 0, 0, EMU_WIDTH, EMU_HEIGHT);
+}
+
+/**
+ * Update a full screen dashboard image through the shadow framebuffer. Three
+ * 48x16 value fields change each time.
+ */
+static int
+bench_shadow_dashboard(struct ulcd_t *ulcd, unsigned long i)
+{
+    int f, x, y;
+
+    for (f = 0; f < 3; f++) {
+        for (y = 0; y < 16; y++) {
+            for (x = 0; x < 48; x++) {
+                pack_uint(frame + ((40 + f * 80 + y) * EMU_WIDTH + 200 + x) * 2, i * 31 + f + (x ^ y));
+            }
+        }
+    }
+
+    return ulcd_shadow_update(ulcd, shadow, frame);
+}
+
+/**
+ * Draw a row of twelve 32x32 icons, picked from a set of eight, through the
+ * sprite cache. After the first run, every icon is already on the display.
+ */
+static int
+bench_sprite_icons(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p;
+    int k;
+
+    for (k = 0; k < 12; k++) {
+        p.x = k * 40;
+        p.y = 200;
+        if (ulcd_sprite_draw(ulcd, sprites, &p, pixels + ((i + k) % 8) * 32 * 2, EMU_WIDTH * 2, 32, 32)) {
+            return ulcd->error;
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * Append a line to a full screen log, scrolling the rest up by one line of
+ * the default font.
+ */
+static int
+bench_scroll_log(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1 = { 0, 0 }, p2 = { EMU_WIDTH - 1, EMU_HEIGHT - 1 };
+    char line[64];
+    param_t len;
+
+    snprintf(line, sizeof(line), "%8lu: the quick brown fox jumps over the lazy dog", i);
+    if (ulcd_gfx_scroll(ulcd, &p1, &p2, 8, 0x0000) ||
+        ulcd_move_cursor(ulcd, EMU_HEIGHT / 8 - 1, 0)) {
+        return ulcd->error;
+    }
+
+    return ulcd_txt_putstr(ulcd, line, &len);
+}
+
+/**
+ * Pass a line of log output through character by character, as it would
+ * arrive from a serial port.
+ */
+static int
+bench_term_tail(struct ulcd_t *ulcd, unsigned long i)
+{
+    static struct term_t *term = NULL;
+    struct point_t origin = { 0, 0 };
+    char line[80];
+    int len;
+
+    /* The terminal measures its cells with the font and gaps known */
+    if (i == 0) {
+        if (term != NULL) {
+            ulcd_term_free(term);
+        }
+        term = ulcd_term_new(&origin, EMU_WIDTH / 8, EMU_HEIGHT / 8);
+        if (ulcd_txt_reset(ulcd)) {
+            return ulcd->error;
+        }
+    }
+
+    len = snprintf(line, sizeof(line), "%08lu \033[3%lum%s\033[0m the quick brown fox\n",
+                   i, 1 + i % 3, i % 3 == 0 ? "ERROR" : i % 3 == 1 ? "OK" : "WARN");
+    ulcd_term_write(term, line, len);
+
+    return ulcd_term_refresh(ulcd, term);
+}
+
+static int
+bench_txt_stream(struct ulcd_t *ulcd, unsigned long i)
+{
+    char line[80];
+    int len;
+
+    len = snprintf(line, sizeof(line), "%08lu the quick brown fox jumps over the lazy dog\n", i);
+
+    if (i == 0 && ulcd_txt_stream_begin(ulcd, 0, 20000)) {
+        return ulcd->error;
+    }
+
+    return ulcd_txt_stream_write(ulcd, line, len);
+}
+
+/**
+ * The same line, with one PUT_CH command per character.
+ */
+static int
+bench_txt_putch_line(struct ulcd_t *ulcd, unsigned long i)
+{
+    char line[80];
+    int len, k;
+
+    len = snprintf(line, sizeof(line), "%08lu the quick brown fox jumps over the lazy dog\n", i);
+    for (k = 0; k < len; k++) {
+        if (ulcd_txt_putch(ulcd, line[k])) {
+            return ulcd->error;
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * Lay out a paragraph of wrapped, centred text in a box.
+ */
+static int
+bench_text_paragraph(struct ulcd_t *ulcd, unsigned long i)
+{
+    static const char *text =
+        "The quick brown fox jumps over the lazy dog. Pack my box with five dozen "
+        "liquor jugs. How vexingly quick daft zebras jump! Sphinx of black quartz, "
+        "judge my vow. The five boxing wizards jump quickly.";
+    struct point_t p1 = { 20, 20 }, p2 = { 299, 251 };
+    param_t height;
+
+    /* Layout needs the font, size and gaps to be known */
+    if (i == 0 && ulcd_txt_reset(ulcd)) {
+        return ulcd->error;
+    }
+
+    return ulcd_txt_layout(ulcd, &p1, &p2, text, TXT_LAYOUT_WRAP | TXT_LAYOUT_CENTER | TXT_LAYOUT_CLIP, &height);
+}
+
+/**
+ * Redraw a dashboard of ten labelled values, each in its own colours.
+ */
+static int
+bench_text_dashboard(struct ulcd_t *ulcd, unsigned long i)
+{
+    char label[32];
+    int row;
+
+    /* No replies are kept: pipelined, they would arrive after returning */
+    for (row = 0; row < 10; row++) {
+        snprintf(label, sizeof(label), "Sensor %2d: %8lu", row, i * 10 + row);
+        if (ulcd_txt_set_color_fg(ulcd, row & 1 ? 0xffe0 : 0x07ff, NULL) ||
+            ulcd_txt_set_color_bg(ulcd, 0x0000, NULL) ||
+            ulcd_move_cursor(ulcd, row, 0) ||
+            ulcd_txt_putstr(ulcd, label, NULL)) {
+            return ulcd->error;
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * The dashboard again, with the commands pipelined.
+ */
+static int
+bench_text_dashboard_pipelined(struct ulcd_t *ulcd, unsigned long i)
+{
+    int err, e;
+
+    if (ulcd_pipeline_begin(ulcd, PIPELINE_DEPTH_MAX, NULL, NULL)) {
+        return ulcd->error;
+    }
+    err = bench_text_dashboard(ulcd, i);
+    if ((e = ulcd_pipeline_end(ulcd)) && err == ERROK) {
+        err = e;
+    }
+
+    return err;
+}
+
+/**
+ * Draw while the touch service polls every 10 ms, from its thread when the
+ * link is free and ahead of the drawing otherwise. On the emulator, the
+ * screen is touched every other frame.
+ */
+static int
+bench_touch_service(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct point_t p1, p2;
+    struct touch_event_t ev;
+
+    if (i == 0) {
+        ulcd_touch_service_stop(ulcd);
+        if (ulcd_touch_service_start(ulcd, 10000, TOUCH_SERVICE_THREAD)) {
+            return ulcd->error;
+        }
+    }
+    if (emu != NULL && i % 2 == 0) {
+        ulcd_emu_touch(emu, TOUCH_STATUS_PRESS, i % EMU_WIDTH, i % EMU_HEIGHT);
+    }
+
+    while (ulcd_touch_service_read(ulcd, &ev));
+
+    p1.x = i % 400;
+    p1.y = i % 200;
+    p2.x = p1.x + 63;
+    p2.y = p1.y + 63;
+
+    return ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, i & 0xffff);
+}
+
+/**
+ * Poll for touch events. On the emulator, every other poll finds the screen
+ * pressed, so that the coordinates are read too.
+ */
+static int
+bench_touch_polling(struct ulcd_t *ulcd, unsigned long i)
+{
+    struct touch_event_t ev;
+
+    if (emu != NULL && i % 2 == 0) {
+        ulcd_emu_touch(emu, TOUCH_STATUS_PRESS, i % EMU_WIDTH, i % EMU_HEIGHT);
+    }
+
+    return ulcd_touch_get_event(ulcd, &ev);
+}
+
+
+static int
+bench_get_info(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_get_info(ulcd);
+}
+
+/**
+ * Measured on the host once the font metrics are cached.
+ */
+static int
+bench_txt_measure(struct ulcd_t *ulcd, unsigned long i)
+{
+    param_t w, h;
+
+    if (i == 0 && ulcd_txt_reset(ulcd)) {
+        return ulcd->error;
+    }
+
+    return ulcd_txt_measure(ulcd, "Sensor 12: 00001234", &w, &h);
+}
+
+/**
+ * Re-select the current rate. Each change waits 200 ms for the device.
+ */
+static int
+bench_set_baud_rate(struct ulcd_t *ulcd, unsigned long i)
+{
+    return ulcd_set_baud_rate(ulcd, ulcd->baud_rate);
+}
+
+static struct bench_t micro[] = {
+    {"move_cursor", bench_move_cursor, 0},
+    {"txt_putch", bench_txt_putch, 0},
+    {"txt_putstr", bench_txt_putstr, 0},
+    {"txt_charwidth", bench_txt_charwidth, 0},
+    {"txt_charheight", bench_txt_charheight, 0},
+    {"txt_set_color_fg", bench_txt_set_color_fg, 0},
+    {"txt_set_color_bg", bench_txt_set_color_bg, 0},
+    {"txt_set_font", bench_txt_set_font, 0},
+    {"txt_set_width", bench_txt_set_width, 0},
+    {"txt_set_height", bench_txt_set_height, 0},
+    {"txt_set_xgap", bench_txt_set_xgap, 0},
+    {"txt_set_ygap", bench_txt_set_ygap, 0},
+    {"txt_set_bold", bench_txt_set_bold, 0},
+    {"txt_set_inverse", bench_txt_set_inverse, 0},
+    {"txt_set_italic", bench_txt_set_italic, 0},
+    {"txt_set_underline", bench_txt_set_underline, 0},
+    {"txt_set_opacity", bench_txt_set_opacity, 0},
+    {"txt_set_attributes", bench_txt_set_attributes, 0},
+    {"txt_reset", bench_txt_reset, 0},
+    {"txt_measure", bench_txt_measure, 0},
+    {"touch_set_detect_region", bench_touch_set_detect_region, 0},
+    {"touch_set", bench_touch_set, 0},
+    {"touch_disable", bench_touch_disable, 0},
+    {"touch_reset", bench_touch_reset, 0},
+    {"touch_init", bench_touch_init, 0},
+    {"touch_get", bench_touch_get, 0},
+    {"touch_get_event", bench_touch_get_event, 0},
+    {"gfx_cls", bench_gfx_cls, 0},
+    {"gfx_rectangle", bench_gfx_rectangle, 0},
+    {"gfx_filled_rectangle", bench_gfx_filled_rectangle, 0},
+    {"gfx_circle", bench_gfx_circle, 0},
+    {"gfx_filled_circle", bench_gfx_filled_circle, 0},
+    {"gfx_polygon", bench_gfx_polygon, 0},
+    {"gfx_filled_polygon", bench_gfx_filled_polygon, 0},
+    {"gfx_contrast", bench_gfx_contrast, 0},
+    {"gfx_move_to", bench_gfx_move_to, 0},
+    {"gfx_clipping", bench_gfx_clipping, 0},
+    {"gfx_clip_window", bench_gfx_clip_window, 0},
+    {"gfx_screen_copy_paste", bench_gfx_screen_copy_paste, 0},
+    {"gfx_set", bench_gfx_set, 0},
+    {"gfx_set_page_display", bench_gfx_set_page_display, 0},
+    {"gfx_set_page_read", bench_gfx_set_page_read, 0},
+    {"gfx_set_page_write", bench_gfx_set_page_write, 0},
+    {"frame", bench_frame, 0},
+    {"display_off", bench_display_off, 0},
+    {"display_on", bench_display_on, 0},
+    {"image_bitblt_16x16", bench_image_bitblt, 0},
+    {"get_display_model", bench_get_display_model, 0},
+    {"get_spe_version", bench_get_spe_version, 0},
+    {"get_pmmc_version", bench_get_pmmc_version, 0},
+    {"get_info", bench_get_info, 0},
+    {"set_baud_rate", bench_set_baud_rate, 5},
+    {NULL, NULL, 0}
+};
+
+static struct bench_t macro[] = {
+    {"fullscreen_bitblt", bench_fullscreen_bitblt, 2},
+    {"fullscreen_bitblt_stream", bench_fullscreen_bitblt_stream, 2},
+    {"fullscreen_convert", bench_fullscreen_convert, 200},
+    {"fullscreen_bitblt_rgba", bench_fullscreen_bitblt_rgba, 2},
+    {"fullscreen_encode", bench_fullscreen_encode, 2},
+    {"shadow_dashboard", bench_shadow_dashboard, 20},
+    {"sprite_icons", bench_sprite_icons, 20},
+    {"scroll_log", bench_scroll_log, 20},
+    {"text_dashboard", bench_text_dashboard, 20},
+    {"text_dashboard_pipelined", bench_text_dashboard_pipelined, 20},
+    {"text_paragraph", bench_text_paragraph, 20},
+    {"txt_putch_line", bench_txt_putch_line, 20},
+    {"txt_stream", bench_txt_stream, 20},
+    {"term_tail", bench_term_tail, 20},
+    {"touch_polling", bench_touch_polling, 200},
+    {"touch_service", bench_touch_service, 200},
+    {NULL, NULL, 0}
+};
+
+
+static int
+compare_latency(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long
+percentile(const unsigned long long *sorted, unsigned long n, unsigned long permille)
+{
+    unsigned long i = (n * permille + 999) / 1000;
+    return sorted[i > 0 ? i - 1 : 0];
+}
+
+/**
+ * Run a benchmark `iterations' times, timing each run on the wall clock.
+ */
+static void
+bench_run(struct ulcd_t *ulcd, struct bench_t *b, unsigned long iterations, struct bench_result_t *r)
+{
+    unsigned long long *latency;
+    unsigned long long start, t;
+    unsigned long long tx, rx;
+    unsigned long i;
+
+    latency = malloc(sizeof(unsigned long long) * iterations);
+    memset(r, 0, sizeof(struct bench_result_t));
+
+    tx = ulcd->tx_bytes;
+    rx = ulcd->rx_bytes;
+    r->read_calls = ulcd->read_calls;
+    r->write_calls = ulcd->write_calls;
+    r->poll_calls = ulcd->poll_calls;
+    start = ulcd_now();
+
+    for (i = 0; i < iterations; i++) {
+        t = ulcd_now();
+        if (b->run(ulcd, i)) {
+            if (r->errors++ == 0) {
+                fprintf(stderr, "%s: %s\n", b->name, ulcd->err);
+            }
+        }
+        latency[i] = ulcd_now() - t;
+    }
+
+    r->elapsed = ulcd_now() - start;
+    r->ops = iterations;
+    r->tx_bytes = ulcd->tx_bytes - tx;
+    r->rx_bytes = ulcd->rx_bytes - rx;
+    r->read_calls = ulcd->read_calls - r->read_calls;
+    r->write_calls = ulcd->write_calls - r->write_calls;
+    r->poll_calls = ulcd->poll_calls - r->poll_calls;
+
+    qsort(latency, iterations, sizeof(unsigned long long), compare_latency);
+    r->p50 = percentile(latency, iterations, 500);
+    r->p99 = percentile(latency, iterations, 990);
+    r->p999 = percentile(latency, iterations, 999);
+
+    free(latency);
+}
+
+static void
+print_result(const char *name, struct bench_result_t *r, int first)
+{
+    printf("%s    {\"name\": \"%s\", \"ops\": %lu, \"errors\": %lu, \"elapsed_us\": %llu, "
+           "\"ops_per_sec\": %.1f, \"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, "
+           "\"tx_bytes_per_op\": %.1f, \"rx_bytes_per_op\": %.1f, "
+           "\"reads_per_op\": %.2f, \"writes_per_op\": %.2f, \"polls_per_op\": %.2f}",
+           first ? "" : ",\n", name, r->ops, r->errors, r->elapsed,
+           r->elapsed > 0 ? r->ops * 1000000.0 / r->elapsed : 0.0,
+           r->p50, r->p99, r->p999,
+           (double)r->tx_bytes / r->ops, (double)r->rx_bytes / r->ops,
+           (double)r->read_calls / r->ops, (double)r->write_calls / r->ops,
+           (double)r->poll_calls / r->ops);
+}
+
+/**
+ * Run the benchmarks in `table' whose names contain `filter'.
+ */
+static void
+run_all(struct ulcd_t *ulcd, const char *section, struct bench_t *table, unsigned long iterations, const char *filter)
+{
+    struct bench_result_t r;
+    struct bench_t *b;
+    int first = 1;
+
+    printf("  \"%s\": [\n", section);
+    for (b = table; b->name != NULL; b++) {
+        if (filter != NULL && strstr(b->name, filter) == NULL) {
+            continue;
+        }
+        bench_run(ulcd, b, b->iterations ? b->iterations : iterations, &r);
+        print_result(b->name, &r, first);
+        fflush(stdout);
+        first = 0;
+    }
+    printf("\n  ]");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct ulcd_t *ulcd;
+    unsigned long baud_rate = 115200;
+    unsigned long cmd_cost = 0;
+    unsigned long iterations = 100;
+    const char *filter = NULL;
+    unsigned long i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:f:n:")) != -1) {
+        switch (opt) {
+        case 'b':
+            baud_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cmd_cost = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b baud_rate] [-c command_cost_usec] [-f filter] [-n iterations] [device]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (iterations == 0) {
+        iterations = 1;
+    }
+
+    ulcd = ulcd_new();
+
+    if (optind < argc) {
+        strncpy(ulcd->device, argv[optind], STRBUFSIZE-1);
+    } else {
+        emu = ulcd_emu_new();
+        emu->baud_rate = baud_rate;
+        emu->cmd_cost = cmd_cost;
+        if (ulcd_emu_start(emu)) {
+            fprintf(stderr, "Unable to create pseudo-terminal.\n");
+            return EXIT_FAILURE;
+        }
+        strcpy(ulcd->device, emu->device);
+        ulcd_set_baud_rate(ulcd, baud_rate);
+    }
+
+    if (ulcd_open_serial_device(ulcd)) {
+        fprintf(stderr, "%s\n", ulcd->err);
+        return EXIT_FAILURE;
+    }
+    ulcd_set_serial_parameters(ulcd);
+
+    if (emu == NULL && ulcd_set_baud_rate(ulcd, baud_rate)) {
+        fprintf(stderr, "%s\n", ulcd->err);
+        return EXIT_FAILURE;
+    }
+
+    pixels = malloc(EMU_WIDTH * EMU_HEIGHT * 2);
+    for (i = 0; i < EMU_WIDTH * EMU_HEIGHT * 2; i++) {
+        pixels[i] = i * 7;
+    }
+    /* The shadow starts out in sync, so that only the changes are timed */
+    frame = malloc(EMU_WIDTH * EMU_HEIGHT * 2);
+    memcpy(frame, pixels, EMU_WIDTH * EMU_HEIGHT * 2);
+    shadow = ulcd_shadow_new(EMU_WIDTH, EMU_HEIGHT);
+    sprites = ulcd_sprite_cache_new(2, 2, EMU_WIDTH, EMU_HEIGHT);
+    if (filter == NULL || strstr("shadow_dashboard", filter) != NULL) {
+        ulcd_shadow_update(ulcd, shadow, frame);
+    }
+    rgba = malloc(EMU_WIDTH * EMU_HEIGHT * 4);
+    for (i = 0; i < EMU_WIDTH * EMU_HEIGHT * 4; i++) {
+        rgba[i] = i * 13;
+    }
+
+    printf("{\n");
+    printf("  \"device\": \"%s\",\n", emu != NULL ? "emulator" : ulcd->device);
+    printf("  \"baud_rate\": %lu,\n", ulcd->baud_rate);
+    printf("  \"command_cost_us\": %lu,\n", emu != NULL ? cmd_cost : 0);
+    printf("  \"iterations\": %lu,\n", iterations);
+    run_all(ulcd, "micro", micro, iterations, filter);
+    printf(",\n");
+    run_all(ulcd, "macro", macro, 0, filter);
+    printf("\n}\n");
+
+    free(pixels);
+    free(rgba);
+    free(frame);
+    ulcd_shadow_free(shadow);
+    ulcd_sprite_cache_free(sprites);
+    ulcd_free(ulcd);
+    if (emu != NULL) {
+        ulcd_emu_free(emu);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1021 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <math.h>
+#include <termios.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * PICASO device emulator.
+ *
+ * The emulator listens on the master side of a pseudo-terminal, and the
+ * library connects to the slave side like it would to a real serial port.
+ * Every command in the serial protocol is parsed and answered, and drawing
+ * commands are rendered into an RGB565 framebuffer with one or more pages.
+ *
+ * Text is not rendered with real fonts. Each character cell is filled with
+ * the text background colour, and all characters except space get a block of
+ * the foreground colour in the middle of the cell.
+ *
+ * The timing model charges ten bit times per byte in both directions, plus a
+ * fixed processing cost per command. Bytes that were already waiting are
+ * assumed to have arrived back to back, so pipelined commands overlap
+ * transmission with processing like they would on a real link.
+ *
+ * A poor cable can be emulated with `max_baud_rate': while the device runs
+ * faster than that, every reply it sends is garbled.
+ */
+
+#define EMU_MODEL "uLCD-43PT"
+#define EMU_SPE_VERSION 0x0106
+#define EMU_PMMC_VERSION 0x0113
+
+#define fb_page(emu, page) ((emu)->fb + (page) * EMU_WIDTH * EMU_HEIGHT)
+#define reg(emu, opcode) ((emu)->regs[(opcode) & 0xff])
+
+/**
+ * Actual baud rates of the device, by index. See serial.c.
+ */
+static const unsigned long emu_baud_rates[] = {
+    110, 300, 600, 1200, 2402, 4808, 9632, 14423, 19264, 31250,
+    38527, 56250, 58594, 117188, 133929, 281250, 312500, 401786, 562500, 703125
+};
+
+/**
+ * Width and height of the built-in fonts.
+ */
+static const int emu_fonts[][2] = {
+    {7, 8},
+    {8, 8},
+    {8, 12}
+};
+
+
+/**
+ * Drawing primitives
+ */
+
+static void
+emu_pixel(struct ulcd_emu_t *emu, int x, int y, color_t color)
+{
+    if (x < 0 || y < 0 || x >= EMU_WIDTH || y >= EMU_HEIGHT) {
+        return;
+    }
+    if (emu->clipping && (x < emu->clip[0] || y < emu->clip[1] || x > emu->clip[2] || y > emu->clip[3])) {
+        return;
+    }
+    fb_page(emu, emu->page_write)[y * EMU_WIDTH + x] = color;
+}
+
+static void
+emu_fill(struct ulcd_emu_t *emu, int x1, int y1, int x2, int y2, color_t color)
+{
+    int x, y, t;
+
+    if (x1 > x2) {
+        t = x1; x1 = x2; x2 = t;
+    }
+    if (y1 > y2) {
+        t = y1; y1 = y2; y2 = t;
+    }
+    for (y = y1; y <= y2; y++) {
+        for (x = x1; x <= x2; x++) {
+            emu_pixel(emu, x, y, color);
+        }
+    }
+}
+
+static void
+emu_line(struct ulcd_emu_t *emu, int x1, int y1, int x2, int y2, color_t color)
+{
+    int dx = abs(x2 - x1);
+    int dy = -abs(y2 - y1);
+    int sx = x1 < x2 ? 1 : -1;
+    int sy = y1 < y2 ? 1 : -1;
+    int err = dx + dy;
+    int e2;
+
+    while (1) {
+        emu_pixel(emu, x1, y1, color);
+        if (x1 == x2 && y1 == y2) {
+            break;
+        }
+        e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x1 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y1 += sy;
+        }
+    }
+}
+
+static int
+emu_in_ellipse(long x, long y, long rx, long ry)
+{
+    return x * x * ry * ry + y * y * rx * rx <= rx * rx * ry * ry;
+}
+
+/**
+ * Draw an ellipse. The outline consists of the pixels inside the ellipse
+ * that have a neighbour outside of it.
+ */
+static void
+emu_ellipse(struct ulcd_emu_t *emu, int cx, int cy, int rx, int ry, color_t color, int filled)
+{
+    int x, y;
+
+    if (rx < 1 || ry < 1) {
+        emu_pixel(emu, cx, cy, color);
+        return;
+    }
+
+    for (y = -ry; y <= ry; y++) {
+        for (x = -rx; x <= rx; x++) {
+            if (!emu_in_ellipse(x, y, rx, ry)) {
+                continue;
+            }
+            if (filled || !emu_in_ellipse(x+1, y, rx, ry) || !emu_in_ellipse(x-1, y, rx, ry)
+                       || !emu_in_ellipse(x, y+1, rx, ry) || !emu_in_ellipse(x, y-1, rx, ry)) {
+                emu_pixel(emu, cx + x, cy + y, color);
+            }
+        }
+    }
+}
+
+/**
+ * Draw a polygon from `n' vertices, either as outline or filled using the
+ * even-odd rule.
+ */
+static void
+emu_polygon(struct ulcd_emu_t *emu, int n, const int *xs, const int *ys, color_t color, int filled, int closed)
+{
+    int i, j, x, y;
+    int ymin, ymax;
+    int inside;
+
+    for (i = 0; i < n - 1; i++) {
+        emu_line(emu, xs[i], ys[i], xs[i+1], ys[i+1], color);
+    }
+    if (closed && n > 2) {
+        emu_line(emu, xs[n-1], ys[n-1], xs[0], ys[0], color);
+    }
+    if (!filled || n < 3) {
+        return;
+    }
+
+    ymin = ymax = ys[0];
+    for (i = 1; i < n; i++) {
+        if (ys[i] < ymin) ymin = ys[i];
+        if (ys[i] > ymax) ymax = ys[i];
+    }
+
+    for (y = ymin; y <= ymax; y++) {
+        for (x = 0; x < EMU_WIDTH; x++) {
+            inside = 0;
+            for (i = 0, j = n - 1; i < n; j = i++) {
+                if ((ys[i] > y) != (ys[j] > y) &&
+                    x < (xs[j] - xs[i]) * (y - ys[i]) / (double)(ys[j] - ys[i]) + xs[i]) {
+                    inside = !inside;
+                }
+            }
+            if (inside) {
+                emu_pixel(emu, x, y, color);
+            }
+        }
+    }
+}
+
+static int
+emu_char_width(struct ulcd_emu_t *emu)
+{
+    param_t font = reg(emu, TXT_FONT_ID);
+    if (font >= sizeof(emu_fonts) / sizeof(emu_fonts[0])) {
+        font = 0;
+    }
+    return emu_fonts[font][0] * reg(emu, TXT_WIDTH);
+}
+
+static int
+emu_char_height(struct ulcd_emu_t *emu)
+{
+    param_t font = reg(emu, TXT_FONT_ID);
+    if (font >= sizeof(emu_fonts) / sizeof(emu_fonts[0])) {
+        font = 0;
+    }
+    return emu_fonts[font][1] * reg(emu, TXT_HEIGHT);
+}
+
+static void
+emu_putch(struct ulcd_emu_t *emu, char c)
+{
+    int w = emu_char_width(emu);
+    int h = emu_char_height(emu);
+    int x = emu->origin[0];
+    int y = emu->origin[1];
+    color_t fg = reg(emu, TEXT_FGCOLOUR);
+    color_t bg = reg(emu, TEXT_BGCOLOUR);
+    color_t t;
+
+    if (c == '\n') {
+        emu->origin[0] = 0;
+        emu->origin[1] += h + reg(emu, TXT_Y_GAP);
+        return;
+    } else if (c == '\r') {
+        emu->origin[0] = 0;
+        return;
+    }
+
+    if (reg(emu, TXT_ATTRIBUTES) & TXT_ATTRIBUTE_INVERSE) {
+        t = fg; fg = bg; bg = t;
+    }
+
+    if (reg(emu, TXT_OPACITY)) {
+        emu_fill(emu, x, y, x + w - 1, y + h - 1, bg);
+    }
+    if (c != ' ') {
+        emu_fill(emu, x + w / 4, y + h / 4, x + w - 1 - w / 4, y + h - 1 - h / 4, fg);
+    }
+    if (reg(emu, TXT_ATTRIBUTES) & TXT_ATTRIBUTE_UNDERLINED) {
+        emu_fill(emu, x, y + h - 1, x + w - 1, y + h - 1, fg);
+    }
+
+    emu->origin[0] += w + reg(emu, TXT_X_GAP);
+}
+
+/**
+ * Copy a rectangle from the read page to the write page.
+ */
+static void
+emu_copy_paste(struct ulcd_emu_t *emu, int xs, int ys, int xd, int yd, int w, int h)
+{
+    unsigned short *src = fb_page(emu, emu->page_read);
+    unsigned short *tmp;
+    int x, y;
+
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    tmp = malloc(sizeof(unsigned short) * w * h);
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            if (xs + x < EMU_WIDTH && ys + y < EMU_HEIGHT) {
+                tmp[y * w + x] = src[(ys + y) * EMU_WIDTH + xs + x];
+            } else {
+                tmp[y * w + x] = 0;
+            }
+        }
+    }
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            emu_pixel(emu, xd + x, yd + y, tmp[y * w + x]);
+        }
+    }
+    free(tmp);
+}
+
+/**
+ * Reset the settings that are reset by CLEAR_SCREEN.
+ */
+static void
+emu_reset_settings(struct ulcd_emu_t *emu)
+{
+    reg(emu, TRANSPARENCY) = 0;
+    reg(emu, OUTLINE_COLOUR) = 0;
+    reg(emu, TXT_OPACITY) = 1;
+    reg(emu, LINE_PATTERN) = 0;
+    reg(emu, TXT_WIDTH) = 1;
+    reg(emu, TXT_HEIGHT) = 1;
+    emu->origin[0] = 0;
+    emu->origin[1] = 0;
+}
+
+
+/**
+ * Serial link
+ */
+
+/**
+ * Read exactly `size' bytes from the host. Returns -1 when the emulator is
+ * stopped. Sets `*waited' if the emulator had to wait for the first byte.
+ */
+static int
+emu_read(struct ulcd_emu_t *emu, void *buffer, int size, int *waited)
+{
+    struct pollfd pfd;
+    int total = 0;
+    ssize_t n;
+
+    pfd.fd = emu->master;
+    pfd.events = POLLIN;
+
+    while (total < size) {
+        if (!emu->running) {
+            return -1;
+        }
+        n = read(emu->master, (char *)buffer + total, size - total);
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EINTR && errno != EIO) {
+            return -1;
+        }
+        if (waited != NULL && total == 0) {
+            *waited = 1;
+        }
+        poll(&pfd, 1, 100);
+    }
+
+    return total;
+}
+
+static int
+emu_read_words(struct ulcd_emu_t *emu, param_t *words, int num)
+{
+    char buffer[2];
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if (emu_read(emu, buffer, 2, NULL) < 0) {
+            return -1;
+        }
+        unpack_uint(&words[i], buffer);
+    }
+
+    return num * 2;
+}
+
+static int
+emu_read_string(struct ulcd_emu_t *emu, char *str, int size)
+{
+    int len = 0;
+    char c;
+
+    do {
+        if (emu_read(emu, &c, 1, NULL) < 0) {
+            return -1;
+        }
+        if (len < size - 1) {
+            str[len++] = c;
+        }
+    } while (c != '\0');
+
+    str[len] = '\0';
+
+    return len;
+}
+
+static void
+emu_write(struct ulcd_emu_t *emu, const char *data, int size)
+{
+    char garbled[4 + STRBUFSIZE];
+    int total = 0;
+    ssize_t n;
+
+    /* Replies are mangled while the link runs faster than the cable allows */
+    if (emu->max_baud_rate != 0 && emu_baud_rates[emu->baud_index] > emu->max_baud_rate &&
+        size <= (int)sizeof(garbled)) {
+        for (n = 0; n < size; n++) {
+            garbled[n] = data[n] ^ 0x5a;
+        }
+        data = garbled;
+    }
+
+    while (total < size && emu->running) {
+        n = write(emu->master, data + total, size - total);
+        if (n > 0) {
+            total += n;
+        } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            return;
+        } else {
+            usleep(1000);
+        }
+    }
+}
+
+static unsigned long long
+emu_link_time(struct ulcd_emu_t *emu, unsigned long bytes)
+{
+    if (emu->baud_rate == 0) {
+        return 0;
+    }
+    return bytes * 10ULL * 1000000 / emu->baud_rate;
+}
+
+/**
+ * Wait until the reply would have reached the host over the emulated link.
+ */
+static void
+emu_delay(struct ulcd_emu_t *emu, unsigned long long start, int waited, unsigned long rx_bytes, unsigned long tx_bytes)
+{
+    unsigned long long now;
+
+    if (waited || emu->rx_end == 0) {
+        emu->rx_end = start;
+    }
+    emu->rx_end += emu_link_time(emu, rx_bytes);
+
+    if (emu->busy_until < emu->rx_end) {
+        emu->busy_until = emu->rx_end;
+    }
+    emu->busy_until += emu->cmd_cost;
+
+    now = ulcd_now();
+    if (emu->busy_until + emu_link_time(emu, tx_bytes) > now) {
+        usleep(emu->busy_until + emu_link_time(emu, tx_bytes) - now);
+    }
+}
+
+
+/**
+ * Command interpreter
+ */
+
+/**
+ * Execute a parsed command. Returns the number of reply words written to
+ * `reply', or -1 if the command should be NAKed.
+ */
+static int
+emu_execute(struct ulcd_emu_t *emu, param_t opcode, param_t *a, int n, int *xs, int *ys, const char *str, param_t *reply)
+{
+    param_t prev;
+    param_t bit;
+    int x, y;
+    unsigned short *fb;
+    double angle;
+
+    switch (opcode) {
+
+    case MOVE_CURSOR:
+        emu->origin[0] = a[1] * (emu_char_width(emu) + reg(emu, TXT_X_GAP));
+        emu->origin[1] = a[0] * (emu_char_height(emu) + reg(emu, TXT_Y_GAP));
+        return 0;
+
+    case PUT_CH:
+        emu_putch(emu, a[0] & 0xff);
+        return 0;
+
+    case PUT_STR:
+        for (x = 0; str[x] != '\0'; x++) {
+            emu_putch(emu, str[x]);
+        }
+        reply[0] = x;
+        return 1;
+
+    case CHAR_WIDTH:
+        reply[0] = emu_char_width(emu);
+        return 1;
+
+    case CHAR_HEIGHT:
+        reply[0] = emu_char_height(emu);
+        return 1;
+
+    case TXT_BOLD:
+    case TXT_ITALIC:
+    case TXT_INVERSE:
+    case TXT_UNDERLINE:
+        bit = opcode == TXT_BOLD ? TXT_ATTRIBUTE_BOLD :
+              opcode == TXT_ITALIC ? TXT_ATTRIBUTE_ITALIC :
+              opcode == TXT_INVERSE ? TXT_ATTRIBUTE_INVERSE : TXT_ATTRIBUTE_UNDERLINED;
+        prev = reg(emu, TXT_ATTRIBUTES);
+        reg(emu, TXT_ATTRIBUTES) = a[0] ? (prev | bit) : (prev & ~bit);
+        reply[0] = (prev & bit) ? 1 : 0;
+        return 1;
+
+    case TEXT_FGCOLOUR:
+    case TEXT_BGCOLOUR:
+    case TXT_FONT_ID:
+    case TXT_WIDTH:
+    case TXT_HEIGHT:
+    case TXT_X_GAP:
+    case TXT_Y_GAP:
+    case TXT_OPACITY:
+    case TXT_ATTRIBUTES:
+    case BEVEL_SHADOW:
+    case BEVEL_WIDTH:
+    case BACKGROUND_COLOUR:
+    case OUTLINE_COLOUR:
+    case FRAME_DELAY:
+    case LINE_PATTERN:
+    case SCREEN_MODE:
+    case TRANSPARENCY:
+    case TRANSPARENT_COLOUR:
+        reply[0] = reg(emu, opcode);
+        reg(emu, opcode) = a[0];
+        return 1;
+
+    case CONTRAST:
+        if (a[0] > CONTRAST_MAX) {
+            return -1;
+        }
+        reply[0] = reg(emu, opcode);
+        reg(emu, opcode) = a[0];
+        return 1;
+
+    case CLEAR_SCREEN:
+        x = emu->clipping;
+        emu->clipping = 0;
+        emu_fill(emu, 0, 0, EMU_WIDTH - 1, EMU_HEIGHT - 1, reg(emu, BACKGROUND_COLOUR));
+        emu->clipping = x;
+        emu_reset_settings(emu);
+        return 0;
+
+    case CHANGE_COLOUR:
+        fb = fb_page(emu, emu->page_write);
+        for (y = 0; y < EMU_HEIGHT; y++) {
+            for (x = 0; x < EMU_WIDTH; x++) {
+                if (fb[y * EMU_WIDTH + x] == a[0]) {
+                    emu_pixel(emu, x, y, a[1]);
+                }
+            }
+        }
+        return 0;
+
+    case CIRCLE:
+    case CIRCLE_FILLED:
+        emu_ellipse(emu, a[0], a[1], a[2], a[2], a[3], opcode == CIRCLE_FILLED);
+        return 0;
+
+    case ELLIPSE:
+    case ELLIPSE_FILLED:
+        emu_ellipse(emu, a[0], a[1], a[2], a[3], a[4], opcode == ELLIPSE_FILLED);
+        return 0;
+
+    case LINE:
+        emu_line(emu, a[0], a[1], a[2], a[3], a[4]);
+        return 0;
+
+    case RECTANGLE:
+        emu_line(emu, a[0], a[1], a[2], a[1], a[4]);
+        emu_line(emu, a[2], a[1], a[2], a[3], a[4]);
+        emu_line(emu, a[2], a[3], a[0], a[3], a[4]);
+        emu_line(emu, a[0], a[3], a[0], a[1], a[4]);
+        return 0;
+
+    case RECTANGLE_FILLED:
+        emu_fill(emu, a[0], a[1], a[2], a[3], a[4]);
+        return 0;
+
+    case POLYLINE:
+    case POLYGON:
+    case POLYGON_FILLED:
+        emu_polygon(emu, n, xs, ys, a[0], opcode == POLYGON_FILLED, opcode != POLYLINE);
+        return 0;
+
+    case TRIANGLE:
+    case TRIANGLE_FILLED:
+        xs[0] = a[0]; ys[0] = a[1];
+        xs[1] = a[2]; ys[1] = a[3];
+        xs[2] = a[4]; ys[2] = a[5];
+        emu_polygon(emu, 3, xs, ys, a[6], opcode == TRIANGLE_FILLED, 1);
+        return 0;
+
+    case ORBIT:
+        angle = (double)a[0] * M_PI / 180.0;
+        reply[0] = (param_t)(emu->origin[0] + lround(a[1] * cos(angle))) & 0xffff;
+        reply[1] = (param_t)(emu->origin[1] + lround(a[1] * sin(angle))) & 0xffff;
+        return 2;
+
+    case PUT_PIXEL:
+        emu_pixel(emu, a[0], a[1], a[2]);
+        return 0;
+
+    case GET_PIXEL:
+        if (a[0] >= EMU_WIDTH || a[1] >= EMU_HEIGHT) {
+            reply[0] = 0;
+        } else {
+            reply[0] = fb_page(emu, emu->page_read)[a[1] * EMU_WIDTH + a[0]];
+        }
+        return 1;
+
+    case MOVE_TO:
+        emu->origin[0] = a[0];
+        emu->origin[1] = a[1];
+        return 0;
+
+    case LINE_TO:
+        emu_line(emu, emu->origin[0], emu->origin[1], a[0], a[1], reg(emu, OUTLINE_COLOUR));
+        emu->origin[0] = a[0];
+        emu->origin[1] = a[1];
+        return 0;
+
+    case CLIPPING:
+        emu->clipping = a[0] != 0;
+        return 0;
+
+    case CLIP_WINDOW:
+        emu->clip[0] = a[0];
+        emu->clip[1] = a[1];
+        emu->clip[2] = a[2];
+        emu->clip[3] = a[3];
+        return 0;
+
+    case SET_CLIP_REGION:
+        return 0;
+
+    case BUTTON:
+        x = strlen(str) * emu_fonts[0][0] * a[6] + 8;
+        y = emu_fonts[0][1] * a[7] + 8;
+        emu_fill(emu, a[1], a[2], a[1] + x - 1, a[2] + y - 1, a[3]);
+        return 0;
+
+    case PANEL:
+        emu_fill(emu, a[1], a[2], a[1] + a[3] - 1, a[2] + a[4] - 1, a[5]);
+        return 0;
+
+    case SLIDER:
+        emu_fill(emu, a[1], a[2], a[3], a[4], a[5]);
+        return 0;
+
+    case SCREEN_COPY_PASTE:
+        emu_copy_paste(emu, a[0], a[1], a[2], a[3], a[4], a[5]);
+        return 0;
+
+    case GFX_SET:
+        if (a[0] == GFX_SET_PAGE_DISPLAY || a[0] == GFX_SET_PAGE_READ || a[0] == GFX_SET_PAGE_WRITE) {
+            if (a[1] >= EMU_PAGES) {
+                return -1;
+            }
+            if (a[0] == GFX_SET_PAGE_DISPLAY) {
+                emu->page_display = a[1];
+            } else if (a[0] == GFX_SET_PAGE_READ) {
+                emu->page_read = a[1];
+            } else {
+                emu->page_write = a[1];
+            }
+        }
+        return 0;
+
+    case GFX_GET:
+        if (a[0] == GFX_GET_X_MAX) {
+            reply[0] = EMU_WIDTH - 1;
+        } else if (a[0] == GFX_GET_Y_MAX) {
+            reply[0] = EMU_HEIGHT - 1;
+        } else {
+            reply[0] = 0;
+        }
+        return 1;
+
+    case SET_BAUD_RATE:
+        if (a[0] >= sizeof(emu_baud_rates) / sizeof(emu_baud_rates[0])) {
+            return -1;
+        }
+        emu->baud_index = a[0];
+        if (emu->baud_rate != 0) {
+            emu->baud_rate = emu_baud_rates[a[0]];
+        }
+        return 0;
+
+    case SLEEP:
+        reply[0] = 0;
+        return 1;
+
+    case TOUCH_DETECT_REGION:
+    case TOUCH_SET:
+        return 0;
+
+    case TOUCH_GET:
+        if (a[0] == TOUCH_GET_MODE_STATUS) {
+            reply[0] = emu->touch.status;
+            if (emu->touch.status == TOUCH_STATUS_PRESS) {
+                emu->touch.status = TOUCH_STATUS_MOVING;
+            } else if (emu->touch.status == TOUCH_STATUS_RELEASE) {
+                emu->touch.status = TOUCH_STATUS_NOTOUCH;
+            }
+        } else if (a[0] == TOUCH_GET_MODE_GET_X) {
+            reply[0] = emu->touch.point.x;
+        } else if (a[0] == TOUCH_GET_MODE_GET_Y) {
+            reply[0] = emu->touch.point.y;
+        } else {
+            return -1;
+        }
+        return 1;
+
+    case GET_DISPLAY_MODEL:
+        /* The model string is added to the reply by the caller */
+        return 0;
+
+    case GET_SPE_VERSION:
+        reply[0] = EMU_SPE_VERSION;
+        return 1;
+
+    case GET_PMMC_VERSION:
+        reply[0] = EMU_PMMC_VERSION;
+        return 1;
+    }
+
+    return -1;
+}
+
+/**
+ * Read the arguments of a command. The coordinate arrays are allocated
+ * here, also when reading fails, and must be freed by the caller.
+ */
+static int
+emu_read_command(struct ulcd_emu_t *emu, const struct opcode_t *op, param_t *a, param_t *n,
+                 int **xs, int **ys, char *str, int strsize, unsigned long *rx)
+{
+    unsigned long i;
+    int r;
+
+    if (op->extra == OPARG_POLY) {
+        if (emu_read_words(emu, n, 1) < 0) {
+            return -1;
+        }
+        *xs = malloc(sizeof(int) * (*n + 3));
+        *ys = malloc(sizeof(int) * (*n + 3));
+        for (i = 0; i < *n; i++) {
+            if (emu_read_words(emu, a, 1) < 0) {
+                return -1;
+            }
+            (*xs)[i] = a[0];
+        }
+        for (i = 0; i < *n; i++) {
+            if (emu_read_words(emu, a, 1) < 0) {
+                return -1;
+            }
+            (*ys)[i] = a[0];
+        }
+        *rx += 2 + *n * 4;
+    } else {
+        *xs = malloc(sizeof(int) * 3);
+        *ys = malloc(sizeof(int) * 3);
+    }
+
+    if (emu_read_words(emu, a, op->args) < 0) {
+        return -1;
+    }
+    *rx += op->args * 2;
+
+    if (op->extra == OPARG_STRING) {
+        if ((r = emu_read_string(emu, str, strsize)) < 0) {
+            return -1;
+        }
+        *rx += r + 1;
+    } else if (op->extra == OPARG_CHAR) {
+        if (emu_read(emu, str, 1, NULL) < 0) {
+            return -1;
+        }
+        str[1] = '\0';
+        *rx += 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read, execute and answer one command. Returns -1 when the emulator is
+ * stopped.
+ */
+static int
+emu_step(struct ulcd_emu_t *emu)
+{
+    const struct opcode_t *op;
+    param_t opcode;
+    param_t a[16];
+    param_t reply[2];
+    param_t n = 0;
+    int *xs = NULL, *ys = NULL;
+    char str[CMDBUFSIZE];
+    char buffer[4 + STRBUFSIZE];
+    unsigned long long start;
+    unsigned long rx = 2;
+    unsigned long i;
+    int waited = 0;
+    int size = 0;
+    int r;
+    param_t x, y;
+
+    if (emu_read(emu, buffer, 2, &waited) < 0) {
+        return -1;
+    }
+    start = ulcd_now();
+    unpack_uint(&opcode, buffer);
+
+    op = ulcd_opcode_lookup(opcode);
+    if (op == NULL) {
+        buffer[0] = NAK;
+        emu_write(emu, buffer, 1);
+        ++(emu->naks);
+        return 0;
+    }
+
+    str[0] = '\0';
+
+    r = emu_read_command(emu, op, a, &n, &xs, &ys, str, sizeof(str), &rx);
+    if (r < 0) {
+        free(xs);
+        free(ys);
+        return -1;
+    }
+
+    pthread_mutex_lock(&emu->lock);
+
+    if (op->extra == OPARG_PIXELS) {
+        /* Pixels are rendered as they arrive */
+        for (y = 0; y < a[3]; y++) {
+            for (x = 0; x < a[2]; x++) {
+                pthread_mutex_unlock(&emu->lock);
+                r = emu_read(emu, buffer, 2, NULL);
+                pthread_mutex_lock(&emu->lock);
+                if (r < 0) {
+                    pthread_mutex_unlock(&emu->lock);
+                    free(xs);
+                    free(ys);
+                    return -1;
+                }
+                unpack_uint(&reply[0], buffer);
+                emu_pixel(emu, a[0] + x, a[1] + y, reply[0]);
+            }
+        }
+        rx += a[2] * a[3] * 2;
+        r = 0;
+    } else {
+        r = emu_execute(emu, opcode, a, n, xs, ys, str, reply);
+    }
+
+    ++(emu->commands);
+    pthread_mutex_unlock(&emu->lock);
+
+    free(xs);
+    free(ys);
+
+    if (r < 0) {
+        emu_delay(emu, start, waited, rx, 1);
+        buffer[0] = NAK;
+        emu_write(emu, buffer, 1);
+        ++(emu->naks);
+        return 0;
+    }
+
+    buffer[size++] = ACK;
+    if (op->reply == REPLY_STRING) {
+        r = strlen(EMU_MODEL);
+        size += pack_uint(buffer + size, r);
+        memcpy(buffer + size, EMU_MODEL, r);
+        size += r;
+    } else {
+        for (i = 0; i < r; i++) {
+            size += pack_uint(buffer + size, reply[i]);
+        }
+    }
+
+    emu_delay(emu, start, waited, rx, size);
+    emu_write(emu, buffer, size);
+
+    return 0;
+}
+
+static void *
+emu_thread(void *arg)
+{
+    struct ulcd_emu_t *emu = arg;
+
+    while (emu_step(emu) == 0);
+
+    return NULL;
+}
+
+
+/**
+ * Public API
+ */
+
+/**
+ * Create a new emulator with default settings and a black screen. Link
+ * timing is disabled until `baud_rate' is set.
+ */
+struct ulcd_emu_t *
+ulcd_emu_new(void)
+{
+    struct ulcd_emu_t *emu;
+
+    emu = malloc(sizeof(struct ulcd_emu_t));
+    memset(emu, 0, sizeof(struct ulcd_emu_t));
+    emu->master = -1;
+    emu->slave = -1;
+    emu->baud_index = 6;
+    emu->fb = malloc(sizeof(unsigned short) * EMU_PAGES * EMU_WIDTH * EMU_HEIGHT);
+    memset(emu->fb, 0, sizeof(unsigned short) * EMU_PAGES * EMU_WIDTH * EMU_HEIGHT);
+    pthread_mutex_init(&emu->lock, NULL);
+
+    reg(emu, TEXT_FGCOLOUR) = 0xffff;
+    reg(emu, CONTRAST) = CONTRAST_MAX;
+    emu_reset_settings(emu);
+
+    return emu;
+}
+
+/**
+ * Create a pseudo-terminal and start answering commands on it. The path of
+ * the device to connect to is stored in `emu->device'.
+ */
+int
+ulcd_emu_start(struct ulcd_emu_t *emu)
+{
+    struct termios options;
+
+    emu->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (emu->master == -1) {
+        return errno;
+    }
+    if (grantpt(emu->master) || unlockpt(emu->master) || ptsname_r(emu->master, emu->device, STRBUFSIZE)) {
+        close(emu->master);
+        emu->master = -1;
+        return errno;
+    }
+    fcntl(emu->master, F_SETFL, fcntl(emu->master, F_GETFL) | O_NONBLOCK);
+
+    /* Keep the slave open, so that the master does not hang up between
+     * connections, and put it in raw mode right away. */
+    emu->slave = open(emu->device, O_RDWR | O_NOCTTY);
+    if (emu->slave != -1) {
+        tcgetattr(emu->slave, &options);
+        cfmakeraw(&options);
+        tcsetattr(emu->slave, TCSANOW, &options);
+    }
+
+    emu->running = 1;
+    if (pthread_create(&emu->thread, NULL, emu_thread, emu)) {
+        emu->running = 0;
+        return ERRUNKNOWN;
+    }
+
+    return ERROK;
+}
+
+/**
+ * Stop the emulator and close the pseudo-terminal.
+ */
+void
+ulcd_emu_stop(struct ulcd_emu_t *emu)
+{
+    if (!emu->running) {
+        return;
+    }
+
+    emu->running = 0;
+    pthread_join(emu->thread, NULL);
+
+    close(emu->master);
+    if (emu->slave != -1) {
+        close(emu->slave);
+    }
+    emu->master = -1;
+    emu->slave = -1;
+}
+
+void
+ulcd_emu_free(struct ulcd_emu_t *emu)
+{
+    ulcd_emu_stop(emu);
+    pthread_mutex_destroy(&emu->lock);
+    free(emu->fb);
+    free(emu);
+}
+
+/**
+ * Read a pixel from a framebuffer page.
+ */
+color_t
+ulcd_emu_pixel(struct ulcd_emu_t *emu, int page, int x, int y)
+{
+    color_t color;
+
+    if (page < 0 || page >= EMU_PAGES || x < 0 || y < 0 || x >= EMU_WIDTH || y >= EMU_HEIGHT) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&emu->lock);
+    color = fb_page(emu, page)[y * EMU_WIDTH + x];
+    pthread_mutex_unlock(&emu->lock);
+
+    return color;
+}
+
+/**
+ * Simulate a touch event, to be picked up by TOUCH_GET.
+ */
+void
+ulcd_emu_touch(struct ulcd_emu_t *emu, param_t status, param_t x, param_t y)
+{
+    pthread_mutex_lock(&emu->lock);
+    emu->touch.status = status;
+    emu->touch.point.x = x;
+    emu->touch.point.y = y;
+    pthread_mutex_unlock(&emu->lock);
+}
@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Image encoder. The link has no compression, but flat areas are much
+ * cheaper to draw as filled rectangles than pixel by pixel. The image is
+ * divided into tiles, and each tile is either blitted, or filled with its
+ * most common colour and the pixels that differ blitted on top, whichever
+ * sends fewer bytes. Fills of the same colour are joined across tiles, and
+ * the blits are merged like the rectangles of the shadow framebuffer.
+ */
+
+#define ENCODE_TILE 16
+
+/* Command sizes, without the ACK */
+#define FILL_BYTES 12
+#define BLIT_BYTES 10
+
+struct fill_t {
+    struct rect_t r;
+    color_t color;
+};
+
+static inline color_t
+pixel_at(const char *base, int stride, int x, int y)
+{
+    const unsigned char *p = (const unsigned char *)base + y * stride + x * 2;
+    return (p[0] << 8) | p[1];
+}
+
+/**
+ * Find the most common colour of a tile, or at least a colour that covers
+ * half of it if there is one, and bound the pixels that have another colour.
+ * Returns zero if the tile is solid.
+ */
+static int
+tile_analyze(const char *base, int stride, const struct rect_t *t, color_t *color, struct rect_t *residual)
+{
+    color_t c, candidate = 0;
+    int x, y, votes = 0;
+
+    /* Boyer-Moore majority vote */
+    for (y = t->y0; y < t->y1; y++) {
+        for (x = t->x0; x < t->x1; x++) {
+            c = pixel_at(base, stride, x, y);
+            if (votes == 0) {
+                candidate = c;
+                votes = 1;
+            } else if (c == candidate) {
+                ++votes;
+            } else {
+                --votes;
+            }
+        }
+    }
+
+    *color = candidate;
+    residual->x0 = t->x1;
+    residual->y0 = t->y1;
+    residual->x1 = t->x0;
+    residual->y1 = t->y0;
+
+    for (y = t->y0; y < t->y1; y++) {
+        for (x = t->x0; x < t->x1; x++) {
+            if (pixel_at(base, stride, x, y) == candidate) {
+                continue;
+            }
+            if (x < residual->x0) {
+                residual->x0 = x;
+            }
+            if (x + 1 > residual->x1) {
+                residual->x1 = x + 1;
+            }
+            if (y < residual->y0) {
+                residual->y0 = y;
+            }
+            residual->y1 = y + 1;
+        }
+    }
+
+    return residual->x1 > residual->x0;
+}
+
+static unsigned long
+blit_cost(const struct rect_t *r, unsigned long overhead)
+{
+    return BLIT_BYTES + overhead + (unsigned long)(r->x1 - r->x0) * (r->y1 - r->y0) * 2;
+}
+
+/**
+ * Add a run of tiles filled with `color' to the fills, joining it to the
+ * fill above if they line up.
+ */
+static int
+fill_add(struct fill_t *fills, int n, const struct rect_t *run, color_t color)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (fills[i].color == color && fills[i].r.y1 == run->y0 &&
+            fills[i].r.x0 == run->x0 && fills[i].r.x1 == run->x1) {
+            fills[i].r.y1 = run->y1;
+            return n;
+        }
+    }
+
+    fills[n].r = *run;
+    fills[n].color = color;
+
+    return n + 1;
+}
+
+/**
+ * Draw a rectangle out of a larger image, like ulcd_image_bitblt_rect(), but
+ * with the cheapest mix of filled rectangles and blits.
+ */
+int
+ulcd_image_encode(struct ulcd_t *ulcd, struct point_t *point, const char *base, int stride,
+                  param_t x, param_t y, param_t width, param_t height)
+{
+    struct fill_t *fills;
+    struct rect_t *blits;
+    struct rect_t t, residual, run;
+    struct point_t p1, p2;
+    unsigned long overhead;
+    color_t color, run_color = 0;
+    int tiles, nfills = 0, nblits = 0;
+    int i, row, tx, ty, solid, fill;
+    int err = ERROK;
+
+    if (width == 0 || height == 0) {
+        return ERROK;
+    }
+
+    overhead = ulcd_command_overhead(ulcd);
+    tiles = ((width + ENCODE_TILE - 1) / ENCODE_TILE) * ((height + ENCODE_TILE - 1) / ENCODE_TILE);
+    fills = malloc(sizeof(struct fill_t) * tiles);
+    blits = malloc(sizeof(struct rect_t) * tiles);
+
+    /* Rectangles are in image coordinates until they are sent */
+    for (ty = y; ty < (int)(y + height); ty += ENCODE_TILE) {
+        run.x1 = run.x0 = x;
+        row = nblits;
+        for (tx = x; tx < (int)(x + width); tx += ENCODE_TILE) {
+            t.x0 = tx;
+            t.y0 = ty;
+            t.x1 = tx + ENCODE_TILE < (int)(x + width) ? tx + ENCODE_TILE : (int)(x + width);
+            t.y1 = ty + ENCODE_TILE < (int)(y + height) ? ty + ENCODE_TILE : (int)(y + height);
+
+            solid = !tile_analyze(base, stride, &t, &color, &residual);
+
+            if (solid) {
+                fill = FILL_BYTES + overhead < blit_cost(&t, overhead);
+            } else {
+                fill = FILL_BYTES + overhead + blit_cost(&residual, overhead) < blit_cost(&t, overhead);
+            }
+
+            /* Tiles filled with the same colour are joined into runs */
+            if (run.x1 > run.x0 && (!fill || color != run_color)) {
+                nfills = fill_add(fills, nfills, &run, run_color);
+                run.x1 = run.x0;
+            }
+            if (fill) {
+                if (run.x1 == run.x0) {
+                    run = t;
+                    run_color = color;
+                } else {
+                    run.x1 = t.x1;
+                }
+                if (!solid) {
+                    blits[nblits++] = residual;
+                }
+            } else {
+                blits[nblits++] = t;
+            }
+        }
+        if (run.x1 > run.x0) {
+            nfills = fill_add(fills, nfills, &run, run_color);
+        }
+
+        /* Merge each row of tiles first, so that there are fewer pairs to try */
+        nblits = row + ulcd_rects_merge(blits + row, nblits - row, BLIT_BYTES + overhead);
+    }
+
+    nblits = ulcd_rects_merge(blits, nblits, BLIT_BYTES + overhead);
+
+    /* Fills go first, as blits may be drawn on top of them */
+    for (i = 0; i < nfills && err == ERROK; i++) {
+        p1.x = point->x + fills[i].r.x0 - x;
+        p1.y = point->y + fills[i].r.y0 - y;
+        p2.x = point->x + fills[i].r.x1 - x - 1;
+        p2.y = point->y + fills[i].r.y1 - y - 1;
+        err = ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, fills[i].color);
+    }
+
+    for (i = 0; i < nblits && err == ERROK; i++) {
+        p1.x = point->x + blits[i].x0 - x;
+        p1.y = point->y + blits[i].y0 - y;
+        err = ulcd_image_bitblt_rect(ulcd, &p1, base, stride, blits[i].x0, blits[i].y0,
+                                     blits[i].x1 - blits[i].x0, blits[i].y1 - blits[i].y0);
+    }
+
+    free(fills);
+    free(blits);
+
+    return err;
+}
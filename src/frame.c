@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Double buffered drawing. The display has several pages of memory; one is
+ * shown while a frame is drawn on another, and the two swap roles when the
+ * frame is done, so partial redraws are never visible.
+ *
+ * Pages 0 and 1 take turns. After a flip, the next frame is drawn on the
+ * page that was shown until then, right away: nothing needs to be copied
+ * or waited for. That page holds the frame before last, so a frame must
+ * either be drawn in full, or keep one shadow framebuffer per page and
+ * update the one of `ulcd->page_write'.
+ */
+
+/**
+ * Start a frame. Drawing commands go to the hidden page until the frame is
+ * ended.
+ */
+int
+ulcd_frame_begin(struct ulcd_t *ulcd)
+{
+    param_t back;
+
+    assert(!ulcd->in_frame);
+
+    back = ulcd->page_display == 0 ? 1 : 0;
+    if (ulcd->page_write != back && ulcd_gfx_set_page_write(ulcd, back)) {
+        return ulcd->error;
+    }
+    ulcd->in_frame = 1;
+
+    return ERROK;
+}
+
+/**
+ * Show the frame that was drawn since ulcd_frame_begin(). The page is
+ * switched by a single command, so the whole frame appears at once. Until
+ * the next frame is started, drawing commands go to the page that is shown.
+ */
+int
+ulcd_frame_end(struct ulcd_t *ulcd)
+{
+    assert(ulcd->in_frame);
+
+    ulcd->in_frame = 0;
+
+    return ulcd_gfx_set_page_display(ulcd, ulcd->page_write);
+}
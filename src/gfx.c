@@ -4,9 +4,6 @@
 #include "ulcd43.h"
 #include "util.h"
 
-extern char cmdbuf[4096];
-extern char recvbuf[2];
-
 /**
  * 5.2.1
  *
@@ -27,36 +24,40 @@ extern char recvbuf[2];
 int
 ulcd_gfx_cls(struct ulcd_t *ulcd)
 {
-    int s = pack_uints(cmdbuf, 1, CLEAR_SCREEN);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 1, CLEAR_SCREEN);
+
+    /* Clearing the screen resets the text size and opacity */
+    ulcd->txt.valid &= ~((1 << TXT_STATE_WIDTH) | (1 << TXT_STATE_HEIGHT) | (1 << TXT_STATE_OPACITY));
+
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_gfx_circle(struct ulcd_t *ulcd, struct point_t *point, param_t radius, color_t color)
 {
-    int s = pack_uints(cmdbuf, 5, CIRCLE, point->x, point->y, radius, color);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 5, CIRCLE, point->x, point->y, radius, color);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_gfx_filled_circle(struct ulcd_t *ulcd, struct point_t *point, param_t radius, color_t color)
 {
-    int s = pack_uints(cmdbuf, 5, CIRCLE_FILLED, point->x, point->y, radius, color);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 5, CIRCLE_FILLED, point->x, point->y, radius, color);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_gfx_rectangle(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2, color_t color)
 {
-    int s = pack_uints(cmdbuf, 6, RECTANGLE, p1->x, p1->y, p2->x, p2->y, color);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 6, RECTANGLE, p1->x, p1->y, p2->x, p2->y, color);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_gfx_filled_rectangle(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2, color_t color)
 {
-    int s = pack_uints(cmdbuf, 6, RECTANGLE_FILLED, p1->x, p1->y, p2->x, p2->y, color);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 6, RECTANGLE_FILLED, p1->x, p1->y, p2->x, p2->y, color);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
@@ -64,11 +65,11 @@ ulcd_gfx_polygon(struct ulcd_t *ulcd, struct polygon_t *poly, color_t color)
 {
     int s;
 
-    s = pack_uint(cmdbuf, POLYGON);
-    s += pack_polygon(cmdbuf+s, poly);
-    s += pack_uint(cmdbuf+s, color);
+    s = pack_uint(ulcd->cmdbuf, POLYGON);
+    s += pack_polygon(ulcd->cmdbuf+s, poly);
+    s += pack_uint(ulcd->cmdbuf+s, color);
 
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
@@ -76,11 +77,11 @@ ulcd_gfx_filled_polygon(struct ulcd_t *ulcd, struct polygon_t *poly, color_t col
 {
     int s;
 
-    s = pack_uint(cmdbuf, POLYGON_FILLED);
-    s += pack_polygon(cmdbuf+s, poly);
-    s += pack_uint(cmdbuf+s, color);
+    s = pack_uint(ulcd->cmdbuf, POLYGON_FILLED);
+    s += pack_polygon(ulcd->cmdbuf+s, poly);
+    s += pack_uint(ulcd->cmdbuf+s, color);
 
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 /**
@@ -93,8 +94,114 @@ int
 ulcd_gfx_contrast(struct ulcd_t *ulcd, param_t contrast)
 {
     assert(contrast < 16 && contrast >= 0);
-    int s = pack_uints(cmdbuf, 2, CONTRAST, contrast);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, NULL);
+    int s = pack_uints(ulcd->cmdbuf, 2, CONTRAST, contrast);
+    return ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s, NULL);
+}
+
+/**
+ * Move the graphics origin, where text is drawn too.
+ */
+int
+ulcd_gfx_move_to(struct ulcd_t *ulcd, struct point_t *point)
+{
+    int s = pack_uints(ulcd->cmdbuf, 3, MOVE_TO, point->x, point->y);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
+}
+
+/**
+ * Turn clipping to the clip window on or off.
+ */
+int
+ulcd_gfx_clipping(struct ulcd_t *ulcd, int on)
+{
+    int s = pack_uints(ulcd->cmdbuf, 2, CLIPPING, on ? 1 : 0);
+    if (ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s)) {
+        return ulcd->error;
+    }
+    ulcd->clipping = on ? 1 : 0;
+    return ERROK;
+}
+
+/**
+ * Set the clip window, from `p1' to `p2' inclusive. Drawing outside of it is
+ * discarded while clipping is on.
+ */
+int
+ulcd_gfx_clip_window(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2)
+{
+    int s = pack_uints(ulcd->cmdbuf, 5, CLIP_WINDOW, p1->x, p1->y, p2->x, p2->y);
+    if (ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s)) {
+        return ulcd->error;
+    }
+    ulcd->clip[0] = p1->x;
+    ulcd->clip[1] = p1->y;
+    ulcd->clip[2] = p2->x;
+    ulcd->clip[3] = p2->y;
+    return ERROK;
+}
+
+/**
+ * Copy a rectangle of the read page to `dest' on the write page. The pages
+ * may be the same.
+ */
+int
+ulcd_gfx_screen_copy_paste(struct ulcd_t *ulcd, struct point_t *src, struct point_t *dest,
+                           param_t width, param_t height)
+{
+    int s = pack_uints(ulcd->cmdbuf, 7, SCREEN_COPY_PASTE, src->x, src->y, dest->x, dest->y, width, height);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
+}
+
+/**
+ * 5.2.39 Graphics Parameters
+ *
+ * Set a graphics parameter, such as the pages that are shown, read from and
+ * drawn on.
+ */
+int
+ulcd_gfx_set(struct ulcd_t *ulcd, param_t function, param_t value)
+{
+    int s = pack_uints(ulcd->cmdbuf, 3, GFX_SET, function, value);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
+}
+
+/**
+ * Show a page of display memory.
+ */
+int
+ulcd_gfx_set_page_display(struct ulcd_t *ulcd, param_t page)
+{
+    if (ulcd_gfx_set(ulcd, GFX_SET_PAGE_DISPLAY, page)) {
+        return ulcd->error;
+    }
+    ulcd->page_display = page;
+    return ERROK;
+}
+
+/**
+ * Select the page that is read from, e.g. by screen copy and paste.
+ */
+int
+ulcd_gfx_set_page_read(struct ulcd_t *ulcd, param_t page)
+{
+    if (ulcd_gfx_set(ulcd, GFX_SET_PAGE_READ, page)) {
+        return ulcd->error;
+    }
+    ulcd->page_read = page;
+    return ERROK;
+}
+
+/**
+ * Select the page that drawing commands go to.
+ */
+int
+ulcd_gfx_set_page_write(struct ulcd_t *ulcd, param_t page)
+{
+    if (ulcd_gfx_set(ulcd, GFX_SET_PAGE_WRITE, page)) {
+        return ulcd->error;
+    }
+    ulcd->page_write = page;
+    return ERROK;
 }
 
 /**
@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Display groups drive many connections in asynchronous mode from a single
+ * thread. Each display keeps its own command queue; the group multiplexes the
+ * file descriptors with epoll and services ready displays round-robin, so a
+ * busy panel cannot starve the others.
+ */
+
+#define GROUP_EVENTS_MAX 64
+
+
+/**
+ * Reply callback installed on every member. Keeps statistics, then passes the
+ * reply on to the application.
+ */
+static void
+ulcd_group_reply(struct ulcd_t *ulcd, unsigned long seq, param_t opcode, int error, param_t value, void *arg)
+{
+    struct group_member_t *m = arg;
+
+    ++(m->stats.completed);
+    if (error != ERROK) {
+        ++(m->stats.errors);
+    }
+
+    if (m->callback != NULL) {
+        m->callback(ulcd, seq, opcode, error, value, m->arg);
+    }
+}
+
+/**
+ * Register interest in the events the display currently wants.
+ */
+static int
+ulcd_group_update_events(struct ulcd_group_t *group, struct group_member_t *m)
+{
+    struct epoll_event ev;
+    int wants;
+
+    wants = ulcd_io_wants(m->ulcd);
+    if (wants == m->wants) {
+        return ERROK;
+    }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.ptr = m;
+    if (wants & IO_WANT_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (wants & IO_WANT_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+
+    if (epoll_ctl(group->epfd, EPOLL_CTL_MOD, m->ulcd->fd, &ev) == -1) {
+        return errno;
+    }
+
+    m->wants = wants;
+
+    return ERROK;
+}
+
+/**
+ * Create a new, empty display group.
+ */
+struct ulcd_group_t *
+ulcd_group_new(void)
+{
+    struct ulcd_group_t *group;
+
+    group = malloc(sizeof(struct ulcd_group_t));
+    memset(group, 0, sizeof(struct ulcd_group_t));
+
+    group->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (group->epfd == -1) {
+        free(group);
+        return NULL;
+    }
+
+    return group;
+}
+
+/**
+ * Delete a display group, along with all of its displays.
+ */
+void
+ulcd_group_free(struct ulcd_group_t *group)
+{
+    int i;
+
+    for (i = 0; i < group->num; i++) {
+        ulcd_free(group->members[i]->ulcd);
+        free(group->members[i]);
+    }
+
+    close(group->epfd);
+    free(group->members);
+    free(group);
+}
+
+/**
+ * Add an open display to the group. The group takes ownership of the display
+ * and puts it in asynchronous mode; replies are passed on to `callback'.
+ * Returns the display's index in the group, or -1 on error.
+ */
+int
+ulcd_group_add(struct ulcd_group_t *group, struct ulcd_t *ulcd, int window, reply_cb_t callback, void *arg)
+{
+    struct group_member_t *m;
+    struct group_member_t **members;
+    struct epoll_event ev;
+
+    if (group->num == group->size) {
+        members = realloc(group->members, sizeof(struct group_member_t *) * (group->size + 16));
+        if (members == NULL) {
+            return -1;
+        }
+        group->members = members;
+        group->size += 16;
+    }
+
+    m = malloc(sizeof(struct group_member_t));
+    memset(m, 0, sizeof(struct group_member_t));
+    m->ulcd = ulcd;
+    m->callback = callback;
+    m->arg = arg;
+    m->sampled_at = ulcd_now();
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.ptr = m;
+    if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, ulcd->fd, &ev) == -1) {
+        free(m);
+        return -1;
+    }
+
+    if (ulcd_async_begin(ulcd, window, ulcd_group_reply, m)) {
+        epoll_ctl(group->epfd, EPOLL_CTL_DEL, ulcd->fd, &ev);
+        free(m);
+        return -1;
+    }
+
+    group->members[group->num] = m;
+
+    return group->num++;
+}
+
+/**
+ * Remove the display at `index' from the group and hand it back to the
+ * caller, after completing its queued commands. The last display takes over
+ * the removed index. Reply callbacks may remove displays; the member is then
+ * freed once ulcd_group_process() has finished dispatching events.
+ */
+struct ulcd_t *
+ulcd_group_remove(struct ulcd_group_t *group, int index)
+{
+    struct group_member_t *m;
+    struct ulcd_t *ulcd;
+
+    if (index < 0 || index >= group->num) {
+        return NULL;
+    }
+
+    m = group->members[index];
+    ulcd = m->ulcd;
+
+    ulcd_async_end(ulcd);
+    epoll_ctl(group->epfd, EPOLL_CTL_DEL, ulcd->fd, NULL);
+
+    group->members[index] = group->members[--(group->num)];
+    if (group->dispatching) {
+        m->ulcd = NULL;
+        m->next = group->removed;
+        group->removed = m;
+    } else {
+        free(m);
+    }
+
+    return ulcd;
+}
+
+/**
+ * Returns the display at `index'.
+ */
+struct ulcd_t *
+ulcd_group_get(struct ulcd_group_t *group, int index)
+{
+    if (index < 0 || index >= group->num) {
+        return NULL;
+    }
+    return group->members[index]->ulcd;
+}
+
+/**
+ * Wait up to `timeout' milliseconds for any display to become ready, then
+ * advance the queues of all ready displays. A negative timeout waits until
+ * something happens. The wait is cut short when a display has a reply
+ * deadline coming up. Returns the number of displays serviced, or -1 if
+ * epoll failed or a display's events could not be updated.
+ */
+int
+ulcd_group_process(struct ulcd_group_t *group, int timeout)
+{
+    struct epoll_event events[GROUP_EVENTS_MAX];
+    struct group_member_t *m;
+    int i, n, t;
+
+    for (i = 0; i < group->num; i++) {
+        m = group->members[i];
+        if (ulcd_group_update_events(group, m)) {
+            return -1;
+        }
+        t = ulcd_io_timeout(m->ulcd);
+        if (t >= 0 && (timeout < 0 || t < timeout)) {
+            timeout = t;
+        }
+    }
+
+    n = epoll_wait(group->epfd, events, GROUP_EVENTS_MAX, timeout);
+    if (n == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    /* Start at a different display each time, so none is favoured when more
+     * displays are ready than fit in one batch of events. Members removed by
+     * a callback stay allocated until the end, as later events point to them. */
+    group->dispatching = 1;
+    for (i = 0; i < n; i++) {
+        m = events[(i + group->next) % n].data.ptr;
+        if (m->ulcd != NULL) {
+            ulcd_process_io(m->ulcd);
+        }
+    }
+    if (n > 0) {
+        group->next = (group->next + 1) % n;
+    }
+
+    /* Expire timed out commands on displays that are not responding at all */
+    for (i = 0; i < group->num; i++) {
+        m = group->members[i];
+        if (ulcd_io_timeout(m->ulcd) == 0) {
+            ulcd_process_io(m->ulcd);
+        }
+    }
+    group->dispatching = 0;
+
+    while (group->removed != NULL) {
+        m = group->removed;
+        group->removed = m->next;
+        free(m);
+    }
+
+    return n;
+}
+
+/**
+ * Fill in statistics for the display at `index'. The throughput is measured
+ * over the interval since the previous call for the same display.
+ */
+int
+ulcd_group_stats(struct ulcd_group_t *group, int index, struct group_stats_t *stats)
+{
+    struct group_member_t *m;
+    unsigned long long now;
+
+    if (index < 0 || index >= group->num) {
+        return -1;
+    }
+
+    m = group->members[index];
+    now = ulcd_now();
+
+    m->stats.queued = m->ulcd->pipeline.count;
+    m->stats.in_flight = m->ulcd->pipeline.sent;
+    if (now > m->sampled_at) {
+        m->stats.rate = (m->stats.completed - m->sampled) * 1000000.0 / (now - m->sampled_at);
+    }
+    m->sampled = m->stats.completed;
+    m->sampled_at = now;
+
+    memcpy(stats, &m->stats, sizeof(struct group_stats_t));
+
+    return ERROK;
+}
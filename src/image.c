@@ -1,17 +1,266 @@
 #include <stdlib.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "ulcd43.h"
 #include "util.h"
 
-extern char cmdbuf[4096];
-extern char recvbuf[2];
+/**
+ * Streamed images are sent in horizontal bands of about this many bytes.
+ */
+#define BLIT_BAND_BYTES 8192
+
+/**
+ * Most rows gathered into a single blit of a sub-rectangle.
+ */
+#define BLIT_BAND_ROWS 64
 
 int
 ulcd_image_bitblt(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height, const char *buffer)
 {
-    int s = pack_uints(cmdbuf, 5, BLIT_COM_TO_DISPLAY, point->x, point->y, width, height);
-    if (ulcd_send(ulcd, cmdbuf, s)) {
-        return -1;
+    int s = pack_uints(ulcd->cmdbuf, 5, BLIT_COM_TO_DISPLAY, point->x, point->y, width, height);
+    return ulcd_send_recv_ack_payload(ulcd, ulcd->cmdbuf, s, buffer, width*height*2);
+}
+
+/**
+ * Draw a rectangle out of a larger image in memory. `base' points to the
+ * first pixel of the image, and `stride' is the distance between its rows in
+ * bytes. The rows are written straight from the image, without copying.
+ *
+ * Rows that are not contiguous cannot be queued, so in pipelined mode the
+ * pipeline is flushed first, and in asynchronous mode only rectangles as wide
+ * as the image can be drawn.
+ */
+int
+ulcd_image_bitblt_rect(struct ulcd_t *ulcd, struct point_t *point, const char *base, int stride,
+                       param_t x, param_t y, param_t width, param_t height)
+{
+    struct iovec iov[1 + BLIT_BAND_ROWS];
+    const char *row;
+    param_t rows, i, j;
+
+    row = base + (size_t)y * stride + x * 2;
+
+    if (stride == width * 2) {
+        return ulcd_image_bitblt(ulcd, point, width, height, row);
+    }
+
+    for (i = 0; i < height; i += rows) {
+        rows = height - i < BLIT_BAND_ROWS ? height - i : BLIT_BAND_ROWS;
+
+        iov[0].iov_base = ulcd->cmdbuf;
+        iov[0].iov_len = pack_uints(ulcd->cmdbuf, 5, BLIT_COM_TO_DISPLAY, point->x, point->y + i, width, rows);
+        for (j = 0; j < rows; j++) {
+            iov[1 + j].iov_base = (void *)row;
+            iov[1 + j].iov_len = width * 2;
+            row += stride;
+        }
+
+        if (ulcd_send_recv_ack_iov(ulcd, iov, 1 + rows)) {
+            return ulcd->error;
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * Map a file of big endian RGB565 pixels, stored row after row, that is
+ * `width' pixels wide. The height follows from the size of the file. Returns
+ * NULL with errno set if the file cannot be mapped.
+ */
+struct asset_t *
+ulcd_asset_open(const char *path, param_t width)
+{
+    struct asset_t *asset;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (width == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size < width * 2) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    asset = malloc(sizeof(struct asset_t));
+    asset->pixels = map;
+    asset->size = st.st_size;
+    asset->width = width;
+    asset->height = st.st_size / (width * 2);
+    asset->stride = width * 2;
+
+    return asset;
+}
+
+void
+ulcd_asset_close(struct asset_t *asset)
+{
+    munmap((void *)asset->pixels, asset->size);
+    free(asset);
+}
+
+/**
+ * Draw a rectangle out of a mapped image. See ulcd_image_bitblt_rect().
+ */
+int
+ulcd_asset_blit(struct ulcd_t *ulcd, struct point_t *point, const struct asset_t *asset,
+                param_t x, param_t y, param_t width, param_t height)
+{
+    if (x + width > asset->width || y + height > asset->height) {
+        return ulcd_error(ulcd, ERRRANGE, "Rectangle %ux%u+%u+%u is outside the %ux%u image",
+                          width, height, x, y, asset->width, asset->height);
+    }
+
+    return ulcd_image_bitblt_rect(ulcd, point, asset->pixels, asset->stride, x, y, width, height);
+}
+
+/**
+ * Draw an image whose pixels are produced while it is sent. The image is
+ * sent as a series of horizontal bands, each a command of its own, so only
+ * one band is held in memory. `source' is asked to fill each band with big
+ * endian RGB565 pixels; `progress', if given, is called after each band with
+ * the number of bytes sent so far and may return non-zero to cancel.
+ *
+ * Each band waits for the display to acknowledge it before the next one is
+ * produced, unless pipelining is enabled, in which case the next band is
+ * produced while the display draws the previous one.
+ */
+int
+ulcd_image_bitblt_stream(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height,
+                         pixel_source_t source, progress_cb_t progress, void *arg)
+{
+    unsigned long done = 0;
+    unsigned long total;
+    param_t rows, y;
+    char *band;
+    int s, size;
+
+    if (ulcd->pipeline.async) {
+        return ulcd_error(ulcd, ERRASYNC, "Cannot stream images in asynchronous mode");
+    }
+    if (width == 0 || height == 0) {
+        return ERROK;
+    }
+
+    total = (unsigned long)width * height * 2;
+    rows = BLIT_BAND_BYTES / (width * 2);
+    if (rows == 0) {
+        rows = 1;
+    }
+    if (rows > height) {
+        rows = height;
+    }
+
+    band = malloc(rows * width * 2);
+    if (band == NULL) {
+        return ulcd_error(ulcd, ERRUNKNOWN, "Unable to allocate %d bytes", rows * width * 2);
+    }
+
+    for (y = 0; y < height; y += rows) {
+        if (rows > height - y) {
+            rows = height - y;
+        }
+        size = rows * width * 2;
+
+        if (source(ulcd, band, size, arg) != size) {
+            free(band);
+            return ulcd_error(ulcd, ERRREAD, "Image source ended after %lu of %lu bytes", done, total);
+        }
+
+        s = pack_uints(ulcd->cmdbuf, 5, BLIT_COM_TO_DISPLAY, point->x, point->y + y, width, rows);
+        if (ulcd_send_recv_ack_payload(ulcd, ulcd->cmdbuf, s, band, size)) {
+            free(band);
+            return ulcd->error;
+        }
+
+        done += size;
+        if (progress != NULL && done < total && progress(ulcd, done, total, arg)) {
+            free(band);
+            return ulcd_error(ulcd, ERRCANCELED, "Image canceled after %lu of %lu bytes", done, total);
+        }
+    }
+
+    free(band);
+
+    if (progress != NULL) {
+        progress(ulcd, done, total, arg);
+    }
+
+    return ERROK;
+}
+
+struct fd_source_t {
+    int fd;
+    progress_cb_t progress;
+    void *arg;
+};
+
+static int
+fd_source(struct ulcd_t *ulcd, char *buffer, int size, void *arg)
+{
+    struct fd_source_t *src = arg;
+    int total = 0;
+    ssize_t n;
+
+    while (total < size) {
+        n = read(src->fd, buffer + total, size - total);
+        if (n > 0) {
+            total += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
     }
-    return ulcd_send_recv_ack(ulcd, buffer, width*height*2);
+
+    return total;
+}
+
+static int
+fd_progress(struct ulcd_t *ulcd, unsigned long done, unsigned long total, void *arg)
+{
+    struct fd_source_t *src = arg;
+
+    return src->progress(ulcd, done, total, src->arg);
+}
+
+/**
+ * Draw an image read from a file descriptor, e.g. a raw RGB565 file or a
+ * pipe, as it is read. See ulcd_image_bitblt_stream().
+ */
+int
+ulcd_image_bitblt_fd(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height,
+                     int fd, progress_cb_t progress, void *arg)
+{
+    struct fd_source_t src;
+
+    src.fd = fd;
+    src.progress = progress;
+    src.arg = arg;
+
+    return ulcd_image_bitblt_stream(ulcd, point, width, height, fd_source,
+                                    progress != NULL ? fd_progress : NULL, &src);
 }
@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <assert.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Command queue and non-blocking I/O state machine.
+ *
+ * Both pipelined and asynchronous mode queue commands here. In pipelined mode,
+ * each command blocks until it has been written. In asynchronous mode,
+ * nothing blocks, and the caller advances the queue with ulcd_process_io()
+ * whenever the file descriptor is ready.
+ */
+
+#define pending_at(p, i) (&(p)->queue[((p)->head + (i)) % PIPELINE_DEPTH_MAX])
+
+
+/**
+ * Make sure a command has its full processing time from now on, unless the
+ * caller gave it a fixed timeout.
+ */
+static void
+ulcd_io_extend_deadline(struct ulcd_t *ulcd, struct pending_cmd_t *cmd)
+{
+    unsigned long long deadline;
+
+    if (cmd->timeout > 0) {
+        return;
+    }
+
+    deadline = ulcd_now() + ulcd_budget(ulcd, cmd->opcode, 1 + cmd->reply);
+    if (deadline > cmd->deadline) {
+        cmd->deadline = deadline;
+    }
+}
+
+/**
+ * Pop the oldest command from the queue and report its result.
+ */
+static void
+ulcd_io_complete(struct ulcd_t *ulcd, int error, param_t value)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    struct pending_cmd_t *cmd;
+
+    assert(p->sent > 0);
+
+    cmd = pending_at(p, 0);
+    p->head = (p->head + 1) % PIPELINE_DEPTH_MAX;
+    --(p->count);
+    --(p->sent);
+    p->bytes -= cmd->size + cmd->psize;
+    p->rxlen = 0;
+
+    ulcd_stats_record(ulcd, cmd->opcode, cmd->started,
+                      cmd->started ? cmd->size + cmd->psize : 0,
+                      error == ERROK ? 1 + cmd->reply : error == ERRNAK, error);
+
+    if (error == ERROK && cmd->reply && cmd->result != NULL) {
+        *cmd->result = value;
+    }
+
+    if (error != ERROK && p->error == ERROK) {
+        p->error = error;
+    }
+
+    /* A setting that failed may have been cached as if it had not */
+    if (error != ERROK) {
+        ulcd_txt_invalidate(ulcd);
+    }
+
+    /* The device starts on the next command only now */
+    if (p->sent > 0) {
+        ulcd_io_extend_deadline(ulcd, pending_at(p, 0));
+    }
+
+    ulcd_touch_service_complete(ulcd, cmd->seq, error);
+
+    if (p->callback != NULL) {
+        p->callback(ulcd, cmd->seq, cmd->opcode, error, value, p->arg);
+    }
+}
+
+/**
+ * Fail every queued command. Used when replies can no longer be matched to
+ * their commands, e.g. after a timeout or a garbled reply.
+ */
+static void
+ulcd_io_fail(struct ulcd_t *ulcd, int error)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+
+    p->sent = p->count;
+    while (p->count > 0) {
+        ulcd_io_complete(ulcd, error, 0);
+    }
+    ulcd_io_discard(ulcd);
+}
+
+/**
+ * Forget every queued command without reporting it.
+ */
+void
+ulcd_io_discard(struct ulcd_t *ulcd)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+
+    p->count = 0;
+    p->sent = 0;
+    p->bytes = 0;
+    p->txoff = 0;
+    p->txstart = 0;
+    p->txend = 0;
+    p->rxlen = 0;
+    ulcd->rxpos = 0;
+    ulcd->rxend = 0;
+    ulcd_touch_service_discard(ulcd);
+}
+
+/**
+ * Returns true if the next queued command may be written: either it has
+ * already been partially written, or it fits in both the window and the
+ * device's input buffer.
+ */
+static int
+ulcd_io_can_write(struct ulcd_t *ulcd)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    struct pending_cmd_t *cmd;
+
+    if (p->sent == p->count) {
+        return 0;
+    }
+    if (p->txoff > 0 || p->sent == 0) {
+        return 1;
+    }
+
+    cmd = pending_at(p, p->sent);
+
+    return p->sent < p->window && p->bytes + cmd->size + cmd->psize <= p->max_bytes;
+}
+
+static int
+ulcd_io_write(struct ulcd_t *ulcd)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    struct pending_cmd_t *cmd;
+    const char *buf;
+    ssize_t len;
+
+    while (ulcd_io_can_write(ulcd)) {
+        cmd = pending_at(p, p->sent);
+
+        if (p->txoff < cmd->size) {
+            buf = p->txbuf + p->txstart + p->txoff;
+            len = cmd->size - p->txoff;
+        } else {
+            buf = cmd->payload + p->txoff - cmd->size;
+            len = cmd->size + cmd->psize - p->txoff;
+        }
+
+        ++(ulcd->write_calls);
+        len = write(ulcd->fd, buf, len);
+        if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return ERROK;
+        } else if (len <= 0) {
+            ulcd_error(ulcd, ERRWRITE, "Unable to send data to device: %s", strerror(errno));
+            ulcd_io_fail(ulcd, ERRWRITE);
+            return ERRWRITE;
+        }
+
+        if (p->txoff == 0) {
+            cmd->started = ulcd_now();
+            ulcd_trace_command(ulcd, buf);
+        }
+        ulcd_trace(ulcd, TRACE_TX, buf, len);
+
+        ulcd->tx_bytes += len;
+        p->txoff += len;
+        if (p->txoff == cmd->size + cmd->psize) {
+            p->txstart += cmd->size;
+            if (p->txstart == p->txend) {
+                p->txstart = p->txend = 0;
+            }
+            p->txoff = 0;
+            p->bytes += cmd->size + cmd->psize;
+            ++(p->sent);
+            if (cmd->timeout > 0) {
+                cmd->deadline = ulcd_now() + cmd->timeout;
+            } else {
+                /* Everything in flight may still be in transit ahead of the reply */
+                cmd->deadline = ulcd_now() + ulcd_budget(ulcd, cmd->opcode, p->bytes + 1 + cmd->reply);
+            }
+        }
+    }
+
+    return ERROK;
+}
+
+static int
+ulcd_io_read(struct ulcd_t *ulcd)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    struct pending_cmd_t *cmd;
+    param_t value;
+    ssize_t len;
+    int drained = 0;
+    char c;
+
+    while (p->sent > 0) {
+        if (ulcd->rxpos == ulcd->rxend) {
+            if (drained) {
+                return ERROK;
+            }
+            len = ulcd_rx_fill(ulcd);
+            if (len == -1) {
+                ulcd_io_fail(ulcd, ERRREAD);
+                return ERRREAD;
+            } else if (len == 0) {
+                return ERROK;
+            }
+            /* A short read means there is nothing more to read for now */
+            drained = ulcd->rxend < RXBUFSIZE;
+        }
+
+        c = ulcd->rxbuf[ulcd->rxpos++];
+        cmd = pending_at(p, 0);
+
+        if (p->rxlen == 0) {
+            if (c == NAK) {
+                ulcd_io_complete(ulcd, ulcd_error(ulcd, ERRNAK, "Device sent NAK, expected ACK"), 0);
+            } else if (c != ACK) {
+                ulcd_error(ulcd, ERRUNKNOWN, "Device sent unknown reply `%x' instead of ACK", c);
+                ulcd_io_fail(ulcd, ERRUNKNOWN);
+                return ERRUNKNOWN;
+            } else if (cmd->reply == 0) {
+                ulcd_io_complete(ulcd, ERROK, 0);
+            } else {
+                p->rxlen = 1;
+            }
+            continue;
+        }
+
+        p->rxword[p->rxlen-1] = c;
+        if (++(p->rxlen) > cmd->reply) {
+            unpack_uint(&value, p->rxword);
+            ulcd_io_complete(ulcd, ERROK, value);
+        }
+    }
+
+    if (ulcd->rxpos < ulcd->rxend) {
+        ulcd_error(ulcd, ERRUNKNOWN, "Device sent unexpected byte `%x'", ulcd->rxbuf[ulcd->rxpos]);
+        ulcd_io_fail(ulcd, ERRUNKNOWN);
+        return ERRUNKNOWN;
+    }
+
+    return ERROK;
+}
+
+/**
+ * Fail the queue if the oldest command has waited too long for its reply.
+ */
+static int
+ulcd_io_check_timeout(struct ulcd_t *ulcd)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+
+    if (p->sent == 0 || ulcd_now() < pending_at(p, 0)->deadline) {
+        return ERROK;
+    }
+
+    ulcd_error(ulcd, ERRTIMEOUT, "Timed out while reading data from device");
+    ulcd_io_fail(ulcd, ERRTIMEOUT);
+
+    return ERRTIMEOUT;
+}
+
+/**
+ * Queue a command. In pipelined mode, this blocks until the command has been
+ * written. In asynchronous mode, ERRBUSY is returned if the queue is full.
+ */
+int
+ulcd_io_submit(struct ulcd_t *ulcd, const char *data, int size, const char *payload, int psize, int reply, param_t *result)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    struct pending_cmd_t *cmd;
+
+    assert(size <= TXBUFSIZE && reply <= 2);
+
+    ulcd_link_lock(ulcd);
+
+    if (ulcd_txt_stream_before(ulcd) || ulcd_touch_service_before(ulcd, 1)) {
+        ulcd_link_unlock(ulcd);
+        return ulcd->error;
+    }
+
+    while (p->count == PIPELINE_DEPTH_MAX || p->txend - p->txstart + size > TXBUFSIZE) {
+        if (p->async) {
+            ulcd_link_unlock(ulcd);
+            return ulcd_error(ulcd, ERRBUSY, "Command queue is full");
+        }
+        ulcd_io_wait(ulcd);
+    }
+
+    if (p->txend + size > TXBUFSIZE) {
+        memmove(p->txbuf, p->txbuf + p->txstart, p->txend - p->txstart);
+        p->txend -= p->txstart;
+        p->txstart = 0;
+    }
+
+    memcpy(p->txbuf + p->txend, data, size);
+    p->txend += size;
+
+    cmd = pending_at(p, p->count);
+    cmd->seq = ++(p->seq);
+    cmd->opcode = 0;
+    if (size >= 2) {
+        unpack_uint(&cmd->opcode, data);
+    }
+    cmd->size = size;
+    cmd->payload = payload;
+    cmd->psize = psize;
+    cmd->reply = reply;
+    cmd->result = result;
+    cmd->timeout = ulcd->call_timeout;
+    cmd->started = 0;
+    cmd->deadline = 0;
+    ulcd->call_timeout = 0;
+    ++(p->count);
+
+    if (p->async) {
+        ulcd_io_write(ulcd);
+        ulcd_link_unlock(ulcd);
+        return ERROK;
+    }
+
+    /* The payload belongs to the caller, so it must be written before returning */
+    while (p->sent < p->count) {
+        ulcd_io_wait(ulcd);
+    }
+
+    ulcd_link_unlock(ulcd);
+
+    return ERROK;
+}
+
+/**
+ * Returns a combination of IO_WANT_READ and IO_WANT_WRITE, telling which
+ * events on the file descriptor should wake up the caller's event loop.
+ */
+int
+ulcd_io_wants(struct ulcd_t *ulcd)
+{
+    int wants = 0;
+
+    if (ulcd->pipeline.sent > 0) {
+        wants |= IO_WANT_READ;
+    }
+    if (ulcd_io_can_write(ulcd)) {
+        wants |= IO_WANT_WRITE;
+    }
+
+    return wants;
+}
+
+/**
+ * Returns the number of milliseconds until the oldest command times out, or
+ * -1 if no replies are outstanding. Suitable as a poll() or epoll_wait()
+ * timeout.
+ */
+int
+ulcd_io_timeout(struct ulcd_t *ulcd)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    unsigned long long now;
+    unsigned long long deadline;
+
+    if (p->sent == 0) {
+        return -1;
+    }
+
+    now = ulcd_now();
+    deadline = pending_at(p, 0)->deadline;
+    if (now >= deadline) {
+        return 0;
+    }
+
+    return (deadline - now + 999) / 1000;
+}
+
+/**
+ * Advance the command queue without blocking: write as much as the window
+ * allows, read and dispatch available replies, and expire timed out commands.
+ * Completed commands are reported through the reply callback.
+ */
+int
+ulcd_process_io(struct ulcd_t *ulcd)
+{
+    int error;
+
+    ulcd_link_lock(ulcd);
+
+    if ((error = ulcd_io_write(ulcd)) == ERROK && (error = ulcd_io_read(ulcd)) == ERROK) {
+        /* Replies may have opened up the window */
+        error = ulcd_io_write(ulcd);
+    }
+    if (error == ERROK) {
+        error = ulcd_io_check_timeout(ulcd);
+    }
+    /* An event loop that only processes replies still polls the panel */
+    if (error == ERROK && ulcd->pipeline.async && ulcd_touch_service_before(ulcd, 1)) {
+        error = ulcd->error;
+    }
+
+    ulcd_link_unlock(ulcd);
+
+    return error;
+}
+
+/**
+ * Block until the file descriptor is ready or the oldest command times out,
+ * then advance the command queue.
+ */
+int
+ulcd_io_wait(struct ulcd_t *ulcd)
+{
+    struct pollfd pfd;
+    int wants;
+
+    wants = ulcd_io_wants(ulcd);
+    if (wants == 0) {
+        return ERROK;
+    }
+
+    pfd.fd = ulcd->fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (wants & IO_WANT_READ) {
+        pfd.events |= POLLIN;
+    }
+    if (wants & IO_WANT_WRITE) {
+        pfd.events |= POLLOUT;
+    }
+
+    ++(ulcd->poll_calls);
+    if (poll(&pfd, 1, ulcd_io_timeout(ulcd)) == -1 && errno != EINTR) {
+        ulcd_error(ulcd, ERRREAD, "Unable to poll device: %s", strerror(errno));
+        ulcd_io_fail(ulcd, ERRREAD);
+        return ERRREAD;
+    }
+
+    return ulcd_process_io(ulcd);
+}
+
+/**
+ * Wait for the replies to all queued commands, keeping any error for the
+ * next call to ulcd_pipeline_flush().
+ */
+void
+ulcd_pipeline_drain(struct ulcd_t *ulcd)
+{
+    while (ulcd->pipeline.count > 0) {
+        ulcd_io_wait(ulcd);
+    }
+}
+
+/**
+ * Enable pipelined mode. Up to `window' commands are sent to the device
+ * before their replies are read. Commands return ERROK as soon as they are
+ * sent, and words returned by the device are stored when the reply is
+ * collected; result pointers must stay valid until then. Errors are reported
+ * per command through `callback', which may be NULL.
+ */
+int
+ulcd_pipeline_begin(struct ulcd_t *ulcd, int window, reply_cb_t callback, void *arg)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+
+    ulcd_pipeline_drain(ulcd);
+
+    if (window < 1) {
+        window = 1;
+    } else if (window > PIPELINE_DEPTH_MAX) {
+        window = PIPELINE_DEPTH_MAX;
+    }
+
+    p->window = window;
+    p->async = 0;
+    p->callback = callback;
+    p->arg = arg;
+
+    return ERROK;
+}
+
+/**
+ * Wait for the replies to all commands in flight. Returns the first error
+ * encountered since the previous flush.
+ */
+int
+ulcd_pipeline_flush(struct ulcd_t *ulcd)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    int error;
+
+    ulcd_pipeline_drain(ulcd);
+
+    error = p->error;
+    p->error = ERROK;
+
+    return error;
+}
+
+/**
+ * Flush the pipeline and go back to waiting for every reply.
+ */
+int
+ulcd_pipeline_end(struct ulcd_t *ulcd)
+{
+    int error;
+
+    error = ulcd_pipeline_flush(ulcd);
+    ulcd->pipeline.window = 0;
+    ulcd->pipeline.async = 0;
+    ulcd->pipeline.callback = NULL;
+    ulcd->pipeline.arg = NULL;
+
+    return error;
+}
+
+/**
+ * Enable asynchronous mode. Commands are queued and return immediately, or
+ * fail with ERRBUSY if the queue is full. The caller must watch `ulcd->fd'
+ * for the events given by ulcd_io_wants(), and call ulcd_process_io() when it
+ * is ready. Results are delivered through `callback'. Payloads and result
+ * pointers must stay valid until the command has completed.
+ */
+int
+ulcd_async_begin(struct ulcd_t *ulcd, int window, reply_cb_t callback, void *arg)
+{
+    if (ulcd_pipeline_begin(ulcd, window, callback, arg)) {
+        return ulcd->error;
+    }
+    ulcd->pipeline.async = 1;
+    return ERROK;
+}
+
+/**
+ * Complete all queued commands, blocking if necessary, and leave
+ * asynchronous mode.
+ */
+int
+ulcd_async_end(struct ulcd_t *ulcd)
+{
+    return ulcd_pipeline_end(ulcd);
+}
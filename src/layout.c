@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Text layout. Text is broken into lines that fit a box, using the cached
+ * font metrics (see metrics.c), and each line is drawn with one move of the
+ * origin and as many PUT_STR commands as it takes, at most 511 characters
+ * each. Unless a pipeline is already active, one is set up for the duration
+ * of the text, so that a whole paragraph costs a single wait for the display.
+ *
+ * Lines are broken at newlines and, with TXT_LAYOUT_WRAP, at the last space
+ * that fits, or within a word that is wider than the box. With
+ * TXT_LAYOUT_CLIP, characters that would cross the right edge and lines that
+ * would cross the bottom edge are left out.
+ */
+
+/**
+ * Width of characters `start' to `end' of a line, with the gaps between.
+ */
+static param_t
+line_width(const struct font_metrics_t *m, const unsigned char *start, const unsigned char *end, param_t xgap)
+{
+    const unsigned char *p;
+    param_t w = 0;
+
+    for (p = start; p < end; p++) {
+        w += m->width[*p] + (p == start ? 0 : xgap);
+    }
+
+    return w;
+}
+
+static param_t
+line_height(const struct font_metrics_t *m, const unsigned char *start, const unsigned char *end)
+{
+    const unsigned char *p;
+    param_t h = m->height[' '];
+
+    for (p = start; p < end; p++) {
+        if (m->height[*p] > h) {
+            h = m->height[*p];
+        }
+    }
+
+    return h;
+}
+
+/**
+ * Find where the line that starts at `start' ends, and where the next one
+ * starts.
+ */
+static void
+line_break(const struct font_metrics_t *m, const unsigned char *start, const unsigned char *end,
+           param_t width, param_t xgap, int flags, const unsigned char **line_end, const unsigned char **next)
+{
+    const unsigned char *p, *space = NULL;
+    param_t w = 0, cw;
+
+    for (p = start; p < end; p++) {
+        cw = m->width[*p] + (p == start ? 0 : xgap);
+        if (w + cw > width) {
+            break;
+        }
+        w += cw;
+        if (*p == ' ') {
+            space = p;
+        }
+    }
+
+    if (p == end) {
+        *line_end = *next = end;
+    } else if (flags & TXT_LAYOUT_WRAP) {
+        if (space != NULL && space > start) {
+            *line_end = space;
+            *next = space + 1;
+        } else {
+            /* A word wider than the box, or a character */
+            *line_end = *next = p > start ? p : p + 1;
+        }
+    } else {
+        *line_end = flags & TXT_LAYOUT_CLIP ? p : end;
+        *next = end;
+    }
+}
+
+/**
+ * Draw characters `start' to `end' at the origin, in chunks that PUT_STR
+ * accepts.
+ */
+static int
+line_draw(struct ulcd_t *ulcd, const unsigned char *start, const unsigned char *end)
+{
+    char chunk[TXT_PUTSTR_MAX + 1];
+    int n;
+
+    while (start < end) {
+        n = end - start > TXT_PUTSTR_MAX ? TXT_PUTSTR_MAX : end - start;
+        memcpy(chunk, start, n);
+        chunk[n] = '\0';
+        if (ulcd_txt_putstr(ulcd, chunk, NULL)) {
+            return ulcd->error;
+        }
+        start += n;
+    }
+
+    return ERROK;
+}
+
+static int
+layout(struct ulcd_t *ulcd, const struct font_metrics_t *m, struct point_t *p1, struct point_t *p2,
+       const char *str, int flags, param_t *height)
+{
+    const unsigned char *p = (const unsigned char *)str;
+    const unsigned char *end, *line_end, *next;
+    param_t width = p2->x - p1->x + 1;
+    param_t xgap = ulcd->txt.value[TXT_STATE_XGAP];
+    param_t ygap = ulcd->txt.value[TXT_STATE_YGAP];
+    param_t w, h, y = p1->y;
+    struct point_t origin;
+    int align = flags & (TXT_LAYOUT_CENTER | TXT_LAYOUT_RIGHT);
+
+    while (1) {
+        for (end = p; *end != '\0' && *end != '\n'; end++);
+
+        /* An empty paragraph is an empty line */
+        do {
+            line_break(m, p, end, width, xgap, flags, &line_end, &next);
+            while (line_end > p && line_end[-1] == ' ' && align != TXT_LAYOUT_LEFT) {
+                --line_end;
+            }
+
+            h = line_height(m, p, line_end);
+            if ((flags & TXT_LAYOUT_CLIP) && y + h > p2->y + 1) {
+                return ERROK;
+            }
+
+            w = line_width(m, p, line_end, xgap);
+            origin.x = p1->x;
+            if (w < width && align == TXT_LAYOUT_RIGHT) {
+                origin.x += width - w;
+            } else if (w < width && align == TXT_LAYOUT_CENTER) {
+                origin.x += (width - w) / 2;
+            }
+            origin.y = y;
+
+            if (line_end > p && (ulcd_gfx_move_to(ulcd, &origin) || line_draw(ulcd, p, line_end))) {
+                return ulcd->error;
+            }
+
+            y += h + ygap;
+            *height = y - ygap - p1->y;
+            p = next;
+        } while (p < end);
+
+        if (*end == '\0') {
+            return ERROK;
+        }
+        p = end + 1;
+    }
+}
+
+/**
+ * Draw text in the box from `p1' to `p2' inclusive, in the font and size in
+ * effect, broken into lines and aligned as `flags' say. The height of the
+ * text that was drawn is left in `height'. The character gaps must be known,
+ * i.e. set since the text settings were last reset.
+ */
+int
+ulcd_txt_layout(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2, const char *str,
+                int flags, param_t *height)
+{
+    struct font_metrics_t *m;
+    param_t w, h;
+    int own_pipeline;
+    int err, e;
+
+    *height = 0;
+
+    if (!(ulcd->txt.valid & (1 << TXT_STATE_YGAP))) {
+        return ulcd_error(ulcd, ERRRANGE, "Line gap is not known, set it first");
+    }
+    if ((m = ulcd_metrics_current(ulcd)) == NULL) {
+        return ulcd_error(ulcd, ERRRANGE, "Font and size are not known, set them first");
+    }
+
+    /* Fetch the metrics that are missing, and check the gap too */
+    if (ulcd_txt_measure(ulcd, str, &w, &h) || ulcd_txt_measure(ulcd, " ", &w, &h)) {
+        return ulcd->error;
+    }
+
+    own_pipeline = ulcd->pipeline.window == 0;
+    if (own_pipeline) {
+        ulcd_pipeline_begin(ulcd, PIPELINE_DEPTH_MAX, NULL, NULL);
+    }
+
+    err = layout(ulcd, m, p1, p2, str, flags, height);
+
+    if (own_pipeline && (e = ulcd_pipeline_end(ulcd)) && err == ERROK) {
+        err = e;
+    }
+
+    return err;
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Font metrics cache. The width and height of each character are asked of
+ * the display once per font and size, and kept, so that text can be measured
+ * on the host. Metrics are keyed by the font and the width and height
+ * multipliers in effect, as known from the text settings cache; with those
+ * unknown, the display is asked every time.
+ *
+ * The cache can be filled lazily, one character at a time, or for all
+ * printable characters at once with ulcd_txt_metrics_probe(), and can be
+ * saved to a file so that it survives restarts. Fonts differ between
+ * displays and firmware versions, so keep one file per kind of display.
+ */
+
+#define METRICS_MAGIC "ULCDFNT1"
+
+/**
+ * Returns the metrics for a font and size, optionally creating them.
+ */
+static struct font_metrics_t *
+metrics_find(struct ulcd_t *ulcd, param_t font, param_t xmul, param_t ymul, int create)
+{
+    struct font_metrics_t *m;
+
+    for (m = ulcd->metrics; m != NULL; m = m->next) {
+        if (m->font == font && m->xmul == xmul && m->ymul == ymul) {
+            return m;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    m = malloc(sizeof(struct font_metrics_t));
+    memset(m, 0, sizeof(struct font_metrics_t));
+    m->font = font;
+    m->xmul = xmul;
+    m->ymul = ymul;
+    m->next = ulcd->metrics;
+    ulcd->metrics = m;
+
+    return m;
+}
+
+/**
+ * Returns the metrics for the font and size in effect, or NULL if those are
+ * not known.
+ */
+struct font_metrics_t *
+ulcd_metrics_current(struct ulcd_t *ulcd)
+{
+    const struct txt_state_t *txt = &ulcd->txt;
+    unsigned int need = (1 << TXT_STATE_FONT) | (1 << TXT_STATE_WIDTH) | (1 << TXT_STATE_HEIGHT);
+
+    if ((txt->valid & need) != need) {
+        return NULL;
+    }
+
+    return metrics_find(ulcd, txt->value[TXT_STATE_FONT], txt->value[TXT_STATE_WIDTH],
+                        txt->value[TXT_STATE_HEIGHT], 1);
+}
+
+/**
+ * Forget all font metrics.
+ */
+void
+ulcd_txt_metrics_clear(struct ulcd_t *ulcd)
+{
+    struct font_metrics_t *m;
+
+    while (ulcd->metrics != NULL) {
+        m = ulcd->metrics;
+        ulcd->metrics = m->next;
+        free(m);
+    }
+}
+
+/**
+ * Ask the display for the width and height of every printable character in
+ * the font and size in effect, with the commands pipelined.
+ */
+int
+ulcd_txt_metrics_probe(struct ulcd_t *ulcd)
+{
+    struct font_metrics_t *m;
+    int own_pipeline;
+    int c, s, err = ERROK, e;
+
+    if (ulcd->pipeline.async) {
+        return ulcd_error(ulcd, ERRASYNC, "Cannot probe font metrics in asynchronous mode");
+    }
+    if ((m = ulcd_metrics_current(ulcd)) == NULL) {
+        return ulcd_error(ulcd, ERRRANGE, "Font and size are not known, set them first");
+    }
+
+    own_pipeline = ulcd->pipeline.window == 0;
+    if (own_pipeline) {
+        ulcd_pipeline_begin(ulcd, PIPELINE_DEPTH_MAX, NULL, NULL);
+    } else if (ulcd_pipeline_flush(ulcd)) {
+        return ulcd->error;
+    }
+
+    for (c = 32; c < 127 && err == ERROK; c++) {
+        s = pack_uint(ulcd->cmdbuf, CHAR_WIDTH);
+        ulcd->cmdbuf[s] = c;
+        err = ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s + 1, &m->width[c]);
+        if (err == ERROK) {
+            s = pack_uint(ulcd->cmdbuf, CHAR_HEIGHT);
+            ulcd->cmdbuf[s] = c;
+            err = ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s + 1, &m->height[c]);
+        }
+    }
+
+    if ((e = ulcd_pipeline_flush(ulcd)) && err == ERROK) {
+        err = e;
+    }
+    if (own_pipeline && (e = ulcd_pipeline_end(ulcd)) && err == ERROK) {
+        err = e;
+    }
+
+    if (err == ERROK) {
+        for (c = 32; c < 127; c++) {
+            m->known[c] = METRIC_WIDTH | METRIC_HEIGHT;
+        }
+    }
+
+    return err;
+}
+
+/**
+ * Measure a line of text in the font and size in effect, as ulcd_txt_putstr()
+ * would draw it: `width' includes the gaps between characters, but not the
+ * one after the last, and `height' is that of the tallest character. Only
+ * characters that are not in the cache yet are asked of the display.
+ */
+int
+ulcd_txt_measure(struct ulcd_t *ulcd, const char *str, param_t *width, param_t *height)
+{
+    struct font_metrics_t *m;
+    const unsigned char *p;
+    param_t w, h, xgap;
+
+    *width = 0;
+    *height = 0;
+
+    if (!(ulcd->txt.valid & (1 << TXT_STATE_XGAP))) {
+        return ulcd_error(ulcd, ERRRANGE, "Character gap is not known, set it first");
+    }
+    xgap = ulcd->txt.value[TXT_STATE_XGAP];
+    m = ulcd_metrics_current(ulcd);
+
+    for (p = (const unsigned char *)str; *p != '\0'; p++) {
+        if (m != NULL && m->known[*p] == (METRIC_WIDTH | METRIC_HEIGHT)) {
+            w = m->width[*p];
+            h = m->height[*p];
+        } else {
+            if (ulcd->pipeline.async) {
+                return ulcd_error(ulcd, ERRASYNC, "Cannot measure text in asynchronous mode");
+            }
+            /* Pipelined replies are only in once the pipeline is flushed */
+            if (ulcd_txt_charwidth(ulcd, *p, &w) || ulcd_txt_charheight(ulcd, *p, &h) ||
+                (ulcd->pipeline.window > 0 && ulcd_pipeline_flush(ulcd))) {
+                return ulcd->error;
+            }
+            if (m != NULL) {
+                m->width[*p] = w;
+                m->height[*p] = h;
+                m->known[*p] = METRIC_WIDTH | METRIC_HEIGHT;
+            }
+        }
+        *width += w + (p == (const unsigned char *)str ? 0 : xgap);
+        if (h > *height) {
+            *height = h;
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * Save the metrics that are known to a file.
+ */
+int
+ulcd_txt_metrics_save(struct ulcd_t *ulcd, const char *path)
+{
+    struct font_metrics_t *m;
+    FILE *f;
+    int c, err = ERROK;
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        return ulcd_error(ulcd, ERRWRITE, "Unable to open %s", path);
+    }
+
+    fprintf(f, "%s\n", METRICS_MAGIC);
+    for (m = ulcd->metrics; m != NULL; m = m->next) {
+        for (c = 0; c < 256; c++) {
+            if (m->known[c] == (METRIC_WIDTH | METRIC_HEIGHT)) {
+                fprintf(f, "%u %u %u %d %u %u\n", m->font, m->xmul, m->ymul, c, m->width[c], m->height[c]);
+            }
+        }
+    }
+
+    if (ferror(f)) {
+        err = ERRWRITE;
+    }
+    if (fclose(f)) {
+        err = ERRWRITE;
+    }
+    if (err) {
+        return ulcd_error(ulcd, err, "Unable to write %s", path);
+    }
+
+    return ERROK;
+}
+
+/**
+ * Load metrics saved with ulcd_txt_metrics_save(), adding to those in the
+ * cache.
+ */
+int
+ulcd_txt_metrics_load(struct ulcd_t *ulcd, const char *path)
+{
+    struct font_metrics_t *m;
+    char line[STRBUFSIZE];
+    unsigned int font, xmul, ymul, c, w, h;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return ulcd_error(ulcd, ERRREAD, "Unable to open %s", path);
+    }
+    if (fgets(line, sizeof(line), f) == NULL || strncmp(line, METRICS_MAGIC, 8)) {
+        fclose(f);
+        return ulcd_error(ulcd, ERRREAD, "%s is not a font metrics file", path);
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%u %u %u %u %u %u", &font, &xmul, &ymul, &c, &w, &h) != 6 || c > 255) {
+            continue;
+        }
+        m = metrics_find(ulcd, font, xmul, ymul, 1);
+        m->width[c] = w;
+        m->height[c] = h;
+        m->known[c] = METRIC_WIDTH | METRIC_HEIGHT;
+    }
+
+    fclose(f);
+
+    return ERROK;
+}
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Wire format of every command in the PICASO serial protocol.
+ *
+ * `args' is the number of fixed words after the opcode, and `extra' tells how
+ * variable length data follows them. For OPARG_POLY, the vertex count and
+ * coordinates come first, followed by the fixed words. `reply' is the number
+ * of words the device returns after the ACK.
+ *
+ * `allowance' is how long the device may take to execute the command, in
+ * microseconds, on top of the time spent on the serial link. The values are
+ * generous estimates for a full screen operation.
+ */
+struct opcode_t opcode_table[] = {
+    /* 5.1: Text and String Commands */
+    {MOVE_CURSOR, "MOVE_CURSOR", 2, OPARG_NONE, 0, 1000},
+    {PUT_CH, "PUT_CH", 1, OPARG_NONE, 0, 2000},
+    {PUT_STR, "PUT_STR", 0, OPARG_STRING, 1, 20000},
+    {CHAR_WIDTH, "CHAR_WIDTH", 0, OPARG_CHAR, 1, 1000},
+    {CHAR_HEIGHT, "CHAR_HEIGHT", 0, OPARG_CHAR, 1, 1000},
+    {TEXT_FGCOLOUR, "TEXT_FGCOLOUR", 1, OPARG_NONE, 1, 1000},
+    {TEXT_BGCOLOUR, "TEXT_BGCOLOUR", 1, OPARG_NONE, 1, 1000},
+    {TXT_FONT_ID, "TXT_FONT_ID", 1, OPARG_NONE, 1, 1000},
+    {TXT_WIDTH, "TXT_WIDTH", 1, OPARG_NONE, 1, 1000},
+    {TXT_HEIGHT, "TXT_HEIGHT", 1, OPARG_NONE, 1, 1000},
+    {TXT_X_GAP, "TXT_X_GAP", 1, OPARG_NONE, 1, 1000},
+    {TXT_Y_GAP, "TXT_Y_GAP", 1, OPARG_NONE, 1, 1000},
+    {TXT_BOLD, "TXT_BOLD", 1, OPARG_NONE, 1, 1000},
+    {TXT_INVERSE, "TXT_INVERSE", 1, OPARG_NONE, 1, 1000},
+    {TXT_ITALIC, "TXT_ITALIC", 1, OPARG_NONE, 1, 1000},
+    {TXT_OPACITY, "TXT_OPACITY", 1, OPARG_NONE, 1, 1000},
+    {TXT_UNDERLINE, "TXT_UNDERLINE", 1, OPARG_NONE, 1, 1000},
+    {TXT_ATTRIBUTES, "TXT_ATTRIBUTES", 1, OPARG_NONE, 1, 1000},
+
+    /* 5.2: Graphics Commands */
+    {CLEAR_SCREEN, "CLEAR_SCREEN", 0, OPARG_NONE, 0, 50000},
+    {CHANGE_COLOUR, "CHANGE_COLOUR", 2, OPARG_NONE, 0, 50000},
+    {CIRCLE, "CIRCLE", 4, OPARG_NONE, 0, 10000},
+    {CIRCLE_FILLED, "CIRCLE_FILLED", 4, OPARG_NONE, 0, 50000},
+    {LINE, "LINE", 5, OPARG_NONE, 0, 10000},
+    {RECTANGLE, "RECTANGLE", 5, OPARG_NONE, 0, 10000},
+    {RECTANGLE_FILLED, "RECTANGLE_FILLED", 5, OPARG_NONE, 0, 50000},
+    {POLYLINE, "POLYLINE", 1, OPARG_POLY, 0, 10000},
+    {POLYGON, "POLYGON", 1, OPARG_POLY, 0, 10000},
+    {POLYGON_FILLED, "POLYGON_FILLED", 1, OPARG_POLY, 0, 50000},
+    {TRIANGLE, "TRIANGLE", 7, OPARG_NONE, 0, 10000},
+    {TRIANGLE_FILLED, "TRIANGLE_FILLED", 7, OPARG_NONE, 0, 50000},
+    {ORBIT, "ORBIT", 2, OPARG_NONE, 2, 1000},
+    {PUT_PIXEL, "PUT_PIXEL", 3, OPARG_NONE, 0, 1000},
+    {GET_PIXEL, "GET_PIXEL", 2, OPARG_NONE, 1, 1000},
+    {MOVE_TO, "MOVE_TO", 2, OPARG_NONE, 0, 1000},
+    {LINE_TO, "LINE_TO", 2, OPARG_NONE, 0, 10000},
+    {CLIPPING, "CLIPPING", 1, OPARG_NONE, 0, 1000},
+    {CLIP_WINDOW, "CLIP_WINDOW", 4, OPARG_NONE, 0, 1000},
+    {SET_CLIP_REGION, "SET_CLIP_REGION", 0, OPARG_NONE, 0, 1000},
+    {ELLIPSE, "ELLIPSE", 5, OPARG_NONE, 0, 10000},
+    {ELLIPSE_FILLED, "ELLIPSE_FILLED", 5, OPARG_NONE, 0, 50000},
+    {BUTTON, "BUTTON", 8, OPARG_STRING, 0, 50000},
+    {PANEL, "PANEL", 6, OPARG_NONE, 0, 50000},
+    {SLIDER, "SLIDER", 8, OPARG_NONE, 0, 50000},
+    {SCREEN_COPY_PASTE, "SCREEN_COPY_PASTE", 6, OPARG_NONE, 0, 50000},
+    {BEVEL_SHADOW, "BEVEL_SHADOW", 1, OPARG_NONE, 1, 1000},
+    {BEVEL_WIDTH, "BEVEL_WIDTH", 1, OPARG_NONE, 1, 1000},
+    {BACKGROUND_COLOUR, "BACKGROUND_COLOUR", 1, OPARG_NONE, 1, 1000},
+    {OUTLINE_COLOUR, "OUTLINE_COLOUR", 1, OPARG_NONE, 1, 1000},
+    {CONTRAST, "CONTRAST", 1, OPARG_NONE, 1, 1000},
+    {FRAME_DELAY, "FRAME_DELAY", 1, OPARG_NONE, 1, 1000},
+    {LINE_PATTERN, "LINE_PATTERN", 1, OPARG_NONE, 1, 1000},
+    {SCREEN_MODE, "SCREEN_MODE", 1, OPARG_NONE, 1, 1000},
+    {TRANSPARENCY, "TRANSPARENCY", 1, OPARG_NONE, 1, 1000},
+    {TRANSPARENT_COLOUR, "TRANSPARENT_COLOUR", 1, OPARG_NONE, 1, 1000},
+    {GFX_SET, "GFX_SET", 2, OPARG_NONE, 0, 1000},
+    {GFX_GET, "GFX_GET", 1, OPARG_NONE, 1, 1000},
+
+    /* 5.4: Serial (UART) Communications Commands */
+    {SET_BAUD_RATE, "SET_BAUD_RATE", 1, OPARG_NONE, 0, 200000},
+
+    /* 5.5: Timer Commands */
+    {SLEEP, "SLEEP", 1, OPARG_NONE, 1, 1000},
+
+    /* 5.8: Touch Screen Commands */
+    {TOUCH_DETECT_REGION, "TOUCH_DETECT_REGION", 4, OPARG_NONE, 0, 1000},
+    {TOUCH_SET, "TOUCH_SET", 1, OPARG_NONE, 0, 1000},
+    {TOUCH_GET, "TOUCH_GET", 1, OPARG_NONE, 1, 1000},
+
+    /* 5.9: Image Control Commands */
+    {BLIT_COM_TO_DISPLAY, "BLIT_COM_TO_DISPLAY", 4, OPARG_PIXELS, 0, 10000},
+
+    /* 5.10: System Commands */
+    {GET_DISPLAY_MODEL, "GET_DISPLAY_MODEL", 0, OPARG_NONE, REPLY_STRING, 1000},
+    {GET_SPE_VERSION, "GET_SPE_VERSION", 0, OPARG_NONE, 1, 1000},
+    {GET_PMMC_VERSION, "GET_PMMC_VERSION", 0, OPARG_NONE, 1, 1000},
+
+    {0, NULL, 0, 0, 0, 0}
+};
+
+
+/**
+ * Look up the wire format of an opcode. Returns NULL for unknown opcodes.
+ */
+const struct opcode_t *
+ulcd_opcode_lookup(param_t opcode)
+{
+    const struct opcode_t *op;
+
+    for (op = opcode_table; op->name != NULL; op++) {
+        if (op->opcode == opcode) {
+            return op;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the position of an opcode in the table, or -1 for unknown opcodes.
+ */
+int
+ulcd_opcode_index(param_t opcode)
+{
+    const struct opcode_t *op = ulcd_opcode_lookup(opcode);
+    return op == NULL ? -1 : op - opcode_table;
+}
+
+/**
+ * Returns the number of opcodes in the table.
+ */
+int
+ulcd_opcode_count(void)
+{
+    return sizeof(opcode_table) / sizeof(opcode_table[0]) - 1;
+}
+
+/**
+ * Returns the name of an opcode, or "UNKNOWN".
+ */
+const char *
+ulcd_opcode_name(param_t opcode)
+{
+    const struct opcode_t *op = ulcd_opcode_lookup(opcode);
+    return op == NULL ? "UNKNOWN" : op->name;
+}
@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXEL_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define PIXEL_NEON
+#endif
+
+/**
+ * Pixel format conversion. The display takes big endian RGB565; renderers
+ * usually produce 24 or 32 bit colour, or RGB565 in host order. The kernels
+ * below use SSE2 or NEON when the compiler targets them, and finish the
+ * pixels that do not fill a whole vector in plain C.
+ *
+ * Dithering adds a 4x4 ordered (Bayer) pattern, scaled to the bits that are
+ * dropped from each channel, before truncating. The pattern is anchored to
+ * the screen position given by the caller, so adjacent updates line up.
+ */
+
+static const unsigned char bayer[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+
+/**
+ * Fill `pattern' with the amounts to add to the red, green, blue and alpha
+ * bytes of 16 pixels starting at column `x' of row `y'.
+ */
+static void
+dither_pattern(unsigned char pattern[64], int x, int y)
+{
+    int i, d;
+
+    for (i = 0; i < 16; i++) {
+        d = bayer[y & 3][(x + i) & 3];
+        pattern[i * 4] = d >> 1;
+        pattern[i * 4 + 1] = d >> 2;
+        pattern[i * 4 + 2] = d >> 1;
+        pattern[i * 4 + 3] = 0;
+    }
+}
+
+static inline unsigned char
+sat_add(unsigned char a, unsigned char b)
+{
+    return a + b > 255 ? 255 : a + b;
+}
+
+static void
+rgb_scalar(unsigned char *dest, const unsigned char *src, int count, int bpp, const unsigned char *dither)
+{
+    unsigned char r, g, b;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        r = src[0];
+        g = src[1];
+        b = src[2];
+        if (dither != NULL) {
+            r = sat_add(r, dither[(i & 3) * 4]);
+            g = sat_add(g, dither[(i & 3) * 4 + 1]);
+            b = sat_add(b, dither[(i & 3) * 4 + 2]);
+        }
+        dest[0] = (r & 0xf8) | (g >> 5);
+        dest[1] = ((g << 3) & 0xe0) | (b >> 3);
+        src += bpp;
+        dest += 2;
+    }
+}
+
+static void
+swap_scalar(unsigned char *dest, const unsigned char *src, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        dest[i * 2] = src[i * 2 + 1];
+        dest[i * 2 + 1] = src[i * 2];
+    }
+}
+
+#if defined(PIXEL_SSE2)
+
+/**
+ * Pack four RGBA pixels into RGB565, one per 32 bit lane, already in the
+ * byte order of the display.
+ */
+static inline __m128i
+rgba_565_sse2(__m128i v)
+{
+    __m128i w;
+
+    w = _mm_and_si128(v, _mm_set1_epi32(0xf8));
+    w = _mm_or_si128(w, _mm_and_si128(_mm_srli_epi32(v, 13), _mm_set1_epi32(0x07)));
+    w = _mm_or_si128(w, _mm_and_si128(_mm_slli_epi32(v, 3), _mm_set1_epi32(0xe000)));
+    w = _mm_or_si128(w, _mm_and_si128(_mm_srli_epi32(v, 11), _mm_set1_epi32(0x1f00)));
+
+    /* Sign extend, so that packing keeps the low 16 bits */
+    return _mm_srai_epi32(_mm_slli_epi32(w, 16), 16);
+}
+
+static int
+rgb_simd(unsigned char *dest, const unsigned char *src, int count, int bpp, const unsigned char *dither)
+{
+    __m128i a, b, d;
+    int i;
+
+    /* SSE2 has no byte shuffle, so packed 24 bit pixels are left to C */
+    if (bpp != 4) {
+        return 0;
+    }
+
+    d = dither != NULL ? _mm_loadu_si128((const __m128i *)dither) : _mm_setzero_si128();
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        a = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        b = _mm_loadu_si128((const __m128i *)(src + i * 4 + 16));
+        a = _mm_adds_epu8(a, d);
+        b = _mm_adds_epu8(b, d);
+        _mm_storeu_si128((__m128i *)(dest + i * 2), _mm_packs_epi32(rgba_565_sse2(a), rgba_565_sse2(b)));
+    }
+
+    return i;
+}
+
+static int
+swap_simd(unsigned char *dest, const unsigned char *src, int count)
+{
+    __m128i v;
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dest + i * 2), v);
+    }
+
+    return i;
+}
+
+#elif defined(PIXEL_NEON)
+
+static int
+rgb_simd(unsigned char *dest, const unsigned char *src, int count, int bpp, const unsigned char *dither)
+{
+    uint8x16x4_t pattern;
+    uint8x16x4_t p4;
+    uint8x16x3_t p3;
+    uint8x16x2_t out;
+    uint8x16_t r, g, b;
+    int i;
+
+    if (dither != NULL) {
+        pattern = vld4q_u8(dither);
+    } else {
+        pattern.val[0] = pattern.val[1] = pattern.val[2] = vdupq_n_u8(0);
+    }
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        if (bpp == 4) {
+            p4 = vld4q_u8(src + i * 4);
+            r = p4.val[0];
+            g = p4.val[1];
+            b = p4.val[2];
+        } else {
+            p3 = vld3q_u8(src + i * 3);
+            r = p3.val[0];
+            g = p3.val[1];
+            b = p3.val[2];
+        }
+        r = vqaddq_u8(r, pattern.val[0]);
+        g = vqaddq_u8(g, pattern.val[1]);
+        b = vqaddq_u8(b, pattern.val[2]);
+
+        out.val[0] = vorrq_u8(vandq_u8(r, vdupq_n_u8(0xf8)), vshrq_n_u8(g, 5));
+        out.val[1] = vorrq_u8(vandq_u8(vshlq_n_u8(g, 3), vdupq_n_u8(0xe0)), vshrq_n_u8(b, 3));
+        vst2q_u8(dest + i * 2, out);
+    }
+
+    return i;
+}
+
+static int
+swap_simd(unsigned char *dest, const unsigned char *src, int count)
+{
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        vst1q_u8(dest + i * 2, vrev16q_u8(vld1q_u8(src + i * 2)));
+    }
+
+    return i;
+}
+
+#else
+
+static int
+rgb_simd(unsigned char *dest, const unsigned char *src, int count, int bpp, const unsigned char *dither)
+{
+    return 0;
+}
+
+static int
+swap_simd(unsigned char *dest, const unsigned char *src, int count)
+{
+    return 0;
+}
+
+#endif
+
+/**
+ * Returns the number of bytes per pixel of a format.
+ */
+int
+ulcd_pixel_size(int format)
+{
+    switch (format & ~PIXEL_DITHER) {
+    case PIXEL_RGB888:
+        return 3;
+    case PIXEL_RGBA8888:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+/**
+ * Convert `count' pixels in `format' to big endian RGB565. `x' and `y' give
+ * the screen position of the first pixel, which anchors the dither pattern.
+ */
+void
+ulcd_pixels_convert(char *dest, const void *src, int count, int format, int x, int y)
+{
+    unsigned char pattern[64];
+    const unsigned char *dither = NULL;
+    const unsigned char *s = src;
+    unsigned char *d = (unsigned char *)dest;
+    int bpp;
+    int i;
+
+    switch (format & ~PIXEL_DITHER) {
+    case PIXEL_RGB565:
+        memcpy(dest, src, count * 2);
+        break;
+
+    case PIXEL_RGB565_LE:
+        i = swap_simd(d, s, count);
+        swap_scalar(d + i * 2, s + i * 2, count - i);
+        break;
+
+    case PIXEL_RGB888:
+    case PIXEL_RGBA8888:
+        bpp = ulcd_pixel_size(format);
+        if (format & PIXEL_DITHER) {
+            dither_pattern(pattern, x, y);
+            dither = pattern;
+        }
+        /* Vectors cover a multiple of four pixels, so the pattern stays in phase */
+        i = rgb_simd(d, s, count, bpp, dither);
+        rgb_scalar(d + i * 2, s + i * bpp, count - i, bpp, dither);
+        break;
+    }
+}
+
+struct convert_source_t {
+    const char *pixels;
+    int stride;
+    int format;
+    param_t width;
+    param_t x;
+    param_t y;
+    param_t row;
+};
+
+static int
+convert_source(struct ulcd_t *ulcd, char *buffer, int size, void *arg)
+{
+    struct convert_source_t *src = arg;
+    int done;
+
+    for (done = 0; done < size; done += src->width * 2) {
+        ulcd_pixels_convert(buffer + done, src->pixels + (size_t)src->row * src->stride,
+                            src->width, src->format, src->x, src->y + src->row);
+        ++(src->row);
+    }
+
+    return size;
+}
+
+/**
+ * Draw an image in another pixel format, converting it band by band as it
+ * is sent. `stride' is the distance between rows of the source in bytes.
+ * Unless a pipeline is already active, a short one is set up for the
+ * duration of the image, so that each band is converted while the previous
+ * one is being transmitted.
+ */
+int
+ulcd_image_bitblt_convert(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height,
+                          const void *pixels, int stride, int format)
+{
+    struct convert_source_t src;
+    int own_pipeline;
+    int err, e;
+
+    if ((format & ~PIXEL_DITHER) == PIXEL_RGB565) {
+        return ulcd_image_bitblt_rect(ulcd, point, pixels, stride, 0, 0, width, height);
+    }
+
+    src.pixels = pixels;
+    src.stride = stride;
+    src.format = format;
+    src.width = width;
+    src.x = point->x;
+    src.y = point->y;
+    src.row = 0;
+
+    own_pipeline = ulcd->pipeline.window == 0;
+    if (own_pipeline) {
+        ulcd_pipeline_begin(ulcd, 2, NULL, NULL);
+    }
+
+    err = ulcd_image_bitblt_stream(ulcd, point, width, height, convert_source, NULL, &src);
+
+    if (own_pipeline && (e = ulcd_pipeline_end(ulcd)) && err == ERROK) {
+        err = e;
+    }
+
+    return err;
+}
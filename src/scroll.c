@@ -0,0 +1,90 @@
+#include <stdlib.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Scrolling. The pixels of a region are moved by the display itself with
+ * screen copy and paste, and only the strip that is uncovered is cleared, to
+ * be drawn by the caller. The region keeps its neighbours intact; to keep
+ * the new content inside the region too, set the clip window to it and turn
+ * clipping on while drawing.
+ *
+ * How the display copies overlapping rectangles is not documented. Like the
+ * rest of its drawing, copies are taken to go top down, which is safe when
+ * scrolling up, the common case for logs and lists, so that is a single
+ * copy. Scrolling down is split into bands no taller than the distance
+ * scrolled, from the bottom up, so that every band is read before it is
+ * overwritten.
+ */
+
+static int
+scroll_copy(struct ulcd_t *ulcd, param_t x, param_t ys, param_t yd, param_t width, param_t height)
+{
+    struct point_t src, dest;
+
+    src.x = dest.x = x;
+    src.y = ys;
+    dest.y = yd;
+
+    return ulcd_gfx_screen_copy_paste(ulcd, &src, &dest, width, height);
+}
+
+/**
+ * Scroll the region from `p1' to `p2' inclusive up by `dy' pixels, or down if
+ * `dy' is negative, and fill the uncovered strip with `background'. The
+ * clip window is ignored meanwhile; the read page is set to the write page.
+ */
+int
+ulcd_gfx_scroll(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2, int dy, color_t background)
+{
+    struct point_t s1, s2;
+    param_t width, height, n, band, k;
+    int clipping = ulcd->clipping;
+    int err = ERROK, e;
+
+    if (dy == 0 || p2->x < p1->x || p2->y < p1->y) {
+        return ERROK;
+    }
+
+    width = p2->x - p1->x + 1;
+    height = p2->y - p1->y + 1;
+    n = dy > 0 ? dy : -dy;
+    if (n > height) {
+        n = height;
+    }
+
+    if (ulcd->page_read != ulcd->page_write && ulcd_gfx_set_page_read(ulcd, ulcd->page_write)) {
+        return ulcd->error;
+    }
+    if (clipping && ulcd_gfx_clipping(ulcd, 0)) {
+        return ulcd->error;
+    }
+
+    if (dy > 0) {
+        if (n < height) {
+            err = scroll_copy(ulcd, p1->x, p1->y + n, p1->y, width, height - n);
+        }
+    } else {
+        /* Bottom up */
+        for (k = height - n; k > 0 && err == ERROK; k -= band) {
+            band = k < n ? k : n;
+            err = scroll_copy(ulcd, p1->x, p1->y + k - band, p1->y + k - band + n, width, band);
+        }
+    }
+
+    if (err == ERROK) {
+        s1.x = p1->x;
+        s2.x = p2->x;
+        s1.y = dy > 0 ? p2->y - n + 1 : p1->y;
+        s2.y = s1.y + n - 1;
+        err = ulcd_gfx_filled_rectangle(ulcd, &s1, &s2, background);
+    }
+
+    if (clipping && (e = ulcd_gfx_clipping(ulcd, 1)) && err == ERROK) {
+        err = e;
+    }
+
+    return err;
+}
@@ -1,31 +1,48 @@
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <termios.h>
+#include <unistd.h>
+
+#include "config.h"
 #include "ulcd43.h"
 #include "util.h"
 
-extern char cmdbuf[4096];
-extern char recvbuf[2];
-
 /**
- * Baud rates only include types found in Linux. The device also supports other baud rates.
+ * Baud rates with a constant in termios.h are set the standard way. The others
+ * are set to the actual rate of the device with termios2, where available.
  */
 struct baudtable_t baud_index[] = {
-    {0, 110, B110},
-    {1, 300, B300},
-    {2, 600, B600},
-    {3, 1200, B1200},
-    {4, 2400, B2400},
-    {5, 4800, B4800},
-    {6, 9600, B9600},
-    {8, 19200, B19200},
-    {10, 38400, B38400},
-    {12, 57600, B57600},
-    {13, 115200, B115200},
-    {-1, -1, -1}
+    {0, 110, B110, 110},
+    {1, 300, B300, 300},
+    {2, 600, B600, 600},
+    {3, 1200, B1200, 1200},
+    {4, 2400, B2400, 2402},
+    {5, 4800, B4800, 4808},
+    {6, 9600, B9600, 9632},
+    {7, 14400, 0, 14423},
+    {8, 19200, B19200, 19264},
+    {9, 31250, 0, 31250},
+    {10, 38400, B38400, 38527},
+    {11, 56000, 0, 56250},
+    {12, 57600, B57600, 58594},
+    {13, 115200, B115200, 117188},
+    {14, 128000, 0, 133929},
+    {15, 256000, 0, 281250},
+    {16, 300000, 0, 312500},
+    {17, 375000, 0, 401786},
+    {18, 500000, 0, 562500},
+    {19, 600000, 0, 703125},
+    {-1, -1, -1, -1}
 };
 
+/**
+ * Number of round trips that must succeed before a baud rate is trusted.
+ */
+#define NEGOTIATE_PROBES 8
+
 
 /**
  * 5.4.1. Set Baud Rate
@@ -59,37 +76,217 @@ int
 ulcd_set_baud_rate(struct ulcd_t *ulcd, long baud_rate)
 {
     int s;
+    const struct baudtable_t *t;
+
+    t = ulcd_baud_lookup(baud_rate);
+    if (t == NULL) {
+        return ulcd_error(ulcd, ERRBAUDRATE, "Baud rate %ld is not supported.", baud_rate);
+    }
+#ifndef HAVE_ASM_TERMBITS_H
+    if (t->baud_const == 0) {
+        return ulcd_error(ulcd, ERRBAUDRATE, "Baud rate %ld is not supported on this system.", baud_rate);
+    }
+#endif
+
+    if (ulcd->pipeline.async) {
+        return ulcd_error(ulcd, ERRASYNC, "Cannot change baud rate in asynchronous mode");
+    }
+
+    ulcd->baud_rate = t->baud_rate;
+    ulcd->baud_const = t->baud_const;
+
+    if (ulcd->fd == -1) {
+        return ERROK;
+    }
+
+    ulcd_pipeline_drain(ulcd);
+
+    s = pack_uints(ulcd->cmdbuf, 2, SET_BAUD_RATE, t->index);
+    ulcd_trace_command(ulcd, ulcd->cmdbuf);
+    if (ulcd_send(ulcd, ulcd->cmdbuf, s)) {
+        return ulcd->error;
+    }
+
+    if (ulcd_set_host_baud_rate(ulcd, 1)) {
+        return ulcd->error;
+    }
+
+    usleep(200000);
+
+    return ulcd_recv_ack(ulcd);
+}
+
+/**
+ * Returns the entry of the baud rate table for a rate or a termios constant,
+ * or NULL if the device does not support it.
+ */
+const struct baudtable_t *
+ulcd_baud_lookup(long baud_rate)
+{
+    const struct baudtable_t *t;
+
+    for (t = baud_index; t->index != -1; t++) {
+        if (baud_rate == t->baud_rate || (t->baud_const != 0 && baud_rate == t->baud_const)) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Set the speed of the serial device to the current baud rate, without
+ * telling the device. With `drain' set, pending output is sent first.
+ */
+int
+ulcd_set_host_baud_rate(struct ulcd_t *ulcd, int drain)
+{
+    const struct baudtable_t *t;
     struct termios options;
-    struct baudtable_t *t;
 
-    t = baud_index;
+    t = ulcd_baud_lookup(ulcd->baud_rate);
+    if (t == NULL) {
+        return ulcd_error(ulcd, ERRBAUDRATE, "Baud rate %lu is not supported.", ulcd->baud_rate);
+    }
+
+    if (t->baud_const == 0) {
+        if (ulcd_set_custom_baud_rate(ulcd->fd, t->line_rate, drain)) {
+            return ulcd_error(ulcd, ERRBAUDRATE, "Unable to set baud rate %lu: %s",
+                              ulcd->baud_rate, strerror(errno));
+        }
+        return ERROK;
+    }
+
+    tcgetattr(ulcd->fd, &options);
+    cfsetispeed(&options, t->baud_const);
+    cfsetospeed(&options, t->baud_const);
+    tcsetattr(ulcd->fd, drain ? TCSADRAIN : TCSANOW, &options);
+
+    return ERROK;
+}
+
+/**
+ * Drop whatever was received, e.g. noise from a failed baud rate change.
+ */
+static void
+serial_flush(struct ulcd_t *ulcd)
+{
+    usleep(10000);
+    tcflush(ulcd->fd, TCIFLUSH);
+    ulcd->rxpos = 0;
+    ulcd->rxend = 0;
+}
+
+/**
+ * Read the SPE version and wait for it, even when pipelining.
+ */
+static int
+serial_version(struct ulcd_t *ulcd, param_t *version)
+{
+    char buffer[2];
+    int s = pack_uints(ulcd->cmdbuf, 1, GET_SPE_VERSION);
+
+    if (ulcd_send_recv_ack_data(ulcd, ulcd->cmdbuf, s, buffer, 2)) {
+        return ulcd->error;
+    }
+    unpack_uint(version, buffer);
+
+    return ERROK;
+}
+
+/**
+ * Check that the link works by reading the SPE version a number of times.
+ * Every reply must match `version'.
+ */
+static int
+serial_probe(struct ulcd_t *ulcd, param_t version)
+{
+    param_t reply;
+    int i;
+
+    for (i = 0; i < NEGOTIATE_PROBES; i++) {
+        if (serial_version(ulcd, &reply)) {
+            return ulcd->error;
+        }
+        if (reply != version) {
+            return ulcd_error(ulcd, ERRREAD, "Unexpected SPE version %04x at %lu baud",
+                              reply, ulcd->baud_rate);
+        }
+    }
+
+    return ERROK;
+}
 
-    while (t->index != -1) {
-        if (baud_rate == t->baud_rate || baud_rate == t->baud_const) {
+/**
+ * Go back to a baud rate that worked after switching to `failed'. The device
+ * may or may not have switched, so the change is requested at both rates.
+ */
+static int
+serial_fallback(struct ulcd_t *ulcd, const struct baudtable_t *good, const struct baudtable_t *failed, param_t version)
+{
+    int i;
 
-            ulcd->baud_rate = t->baud_rate;
-            ulcd->baud_const = t->baud_const;
+    for (i = 0; i < 3; i++) {
+        serial_flush(ulcd);
+        ulcd_set_baud_rate(ulcd, good->baud_rate);
+        serial_flush(ulcd);
+        if (serial_probe(ulcd, version) == ERROK) {
+            return ERROK;
+        }
 
-            if (ulcd->fd == -1) {
-                return ERROK;
-            }
+        /* The device did not understand us; try again from the failed rate */
+        ulcd->baud_rate = failed->baud_rate;
+        ulcd->baud_const = failed->baud_const;
+        ulcd_set_host_baud_rate(ulcd, 0);
+    }
 
-            s = pack_uints(cmdbuf, 2, SET_BAUD_RATE, t->index);
-            if (ulcd_send(ulcd, cmdbuf, s)) {
-                return ulcd->error;
-            }
+    ulcd->baud_rate = good->baud_rate;
+    ulcd->baud_const = good->baud_const;
+    ulcd_set_host_baud_rate(ulcd, 0);
 
-            tcgetattr(ulcd->fd, &options);
-            cfsetispeed(&options, ulcd->baud_const);
-            cfsetospeed(&options, ulcd->baud_const);
-            tcsetattr(ulcd->fd, TCSADRAIN, &options);
+    return ulcd_error(ulcd, ERRBAUDRATE, "Lost the device while changing baud rate");
+}
 
-            usleep(200000);
+/**
+ * Raise the baud rate step by step, up to `max_rate', while the link stays
+ * reliable. Each step is verified with a number of round trips; on failure
+ * the last rate that worked is restored and kept. The connection must work
+ * at the current rate. The resulting rate is left in ulcd->baud_rate.
+ */
+int
+ulcd_negotiate_baud_rate(struct ulcd_t *ulcd, long max_rate)
+{
+    const struct baudtable_t *good, *t;
+    param_t version;
+
+    if (ulcd->pipeline.async) {
+        return ulcd_error(ulcd, ERRASYNC, "Cannot change baud rate in asynchronous mode");
+    }
+
+    good = ulcd_baud_lookup(ulcd->baud_rate);
+    if (good == NULL) {
+        return ulcd_error(ulcd, ERRBAUDRATE, "Baud rate %lu is not supported.", ulcd->baud_rate);
+    }
+
+    ulcd_pipeline_drain(ulcd);
+
+    if (serial_version(ulcd, &version)) {
+        return ulcd->error;
+    }
+    ulcd->spe_version = version;
+
+    for (t = good + 1; t->index != -1 && t->baud_rate <= max_rate; t++) {
+        if (ulcd_set_baud_rate(ulcd, t->baud_rate) == ERROK &&
+            serial_probe(ulcd, version) == ERROK) {
+            good = t;
+            continue;
+        }
 
-            return ulcd_recv_ack(ulcd);
+        if (serial_fallback(ulcd, good, t, version)) {
+            return ulcd->error;
         }
-        ++t;
+        break;
     }
 
-    return ulcd_error(ulcd, ERRBAUDRATE, "Baud rate %d is not supported.", baud_rate);
+    return ulcd_error(ulcd, ERROK, "Baud rate set to %lu", ulcd->baud_rate);
 }
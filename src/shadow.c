@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Shadow framebuffer. A copy of what the display shows is kept on the host,
+ * and new frames are compared against it, so that only the areas that
+ * changed are sent.
+ *
+ * The frame is divided into tiles, and the changed pixels of each tile are
+ * bounded by a rectangle. Rectangles are then merged while one command for
+ * the union costs less than separate commands, counting the pixels of the
+ * union and a fixed overhead per command. Each rectangle is then sent with
+ * the encoder, see encode.c.
+ */
+
+#define SHADOW_TILE 16
+
+/**
+ * Create a shadow of a `width' x `height' screen. Its contents are unknown,
+ * so the first update sends the whole frame.
+ */
+struct shadow_t *
+ulcd_shadow_new(param_t width, param_t height)
+{
+    struct shadow_t *shadow;
+
+    shadow = malloc(sizeof(struct shadow_t));
+    memset(shadow, 0, sizeof(struct shadow_t));
+    shadow->width = width;
+    shadow->height = height;
+    shadow->pixels = malloc(width * height * 2);
+
+    return shadow;
+}
+
+void
+ulcd_shadow_free(struct shadow_t *shadow)
+{
+    free(shadow->pixels);
+    free(shadow);
+}
+
+/**
+ * Forget the contents of the shadow, e.g. after the screen was cleared or
+ * drawn on by other means. The next update sends the whole frame.
+ */
+void
+ulcd_shadow_invalidate(struct shadow_t *shadow)
+{
+    shadow->valid = 0;
+}
+
+/**
+ * Returns the bytes it takes to send a rectangle, including the overhead of
+ * the command.
+ */
+static unsigned long
+rect_cost(const struct rect_t *r, unsigned long overhead)
+{
+    return overhead + (unsigned long)(r->x1 - r->x0) * (r->y1 - r->y0) * 2;
+}
+
+static void
+rect_union(struct rect_t *u, const struct rect_t *a, const struct rect_t *b)
+{
+    u->x0 = a->x0 < b->x0 ? a->x0 : b->x0;
+    u->y0 = a->y0 < b->y0 ? a->y0 : b->y0;
+    u->x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+    u->y1 = a->y1 > b->y1 ? a->y1 : b->y1;
+}
+
+static int
+rect_contains(const struct rect_t *a, const struct rect_t *b)
+{
+    return b->x0 >= a->x0 && b->y0 >= a->y0 && b->x1 <= a->x1 && b->y1 <= a->y1;
+}
+
+/**
+ * Find the bounds of the pixels that differ within a tile. Returns zero if
+ * none do.
+ */
+static int
+tile_diff(const struct shadow_t *shadow, const char *frame, int tx, int ty, struct rect_t *r)
+{
+    const char *a, *b;
+    int x0, x1, y0, y1;
+    int x, y, first, last;
+    int stride = shadow->width * 2;
+
+    x0 = tx * SHADOW_TILE;
+    y0 = ty * SHADOW_TILE;
+    x1 = x0 + SHADOW_TILE < (int)shadow->width ? x0 + SHADOW_TILE : (int)shadow->width;
+    y1 = y0 + SHADOW_TILE < (int)shadow->height ? y0 + SHADOW_TILE : (int)shadow->height;
+
+    r->x0 = x1;
+    r->x1 = x0;
+    r->y0 = y1;
+    r->y1 = y0;
+
+    for (y = y0; y < y1; y++) {
+        a = shadow->pixels + y * stride + x0 * 2;
+        b = frame + y * stride + x0 * 2;
+        if (!memcmp(a, b, (x1 - x0) * 2)) {
+            continue;
+        }
+
+        for (first = 0; a[first * 2] == b[first * 2] && a[first * 2 + 1] == b[first * 2 + 1]; first++);
+        for (last = x1 - x0 - 1; a[last * 2] == b[last * 2] && a[last * 2 + 1] == b[last * 2 + 1]; last--);
+
+        x = x0 + first;
+        if (x < r->x0) {
+            r->x0 = x;
+        }
+        x = x0 + last + 1;
+        if (x > r->x1) {
+            r->x1 = x;
+        }
+        if (y < r->y0) {
+            r->y0 = y;
+        }
+        r->y1 = y + 1;
+    }
+
+    return r->x1 > r->x0;
+}
+
+/**
+ * Merge rectangles while that makes sending them cheaper, given the cost of
+ * a command in bytes besides its pixels. Rectangles that end up inside a
+ * merged one are dropped. Returns the new number of rectangles.
+ */
+int
+ulcd_rects_merge(struct rect_t *rects, int n, unsigned long overhead)
+{
+    struct rect_t u, best_u;
+    long gain, best;
+    int i, j, k, bi, bj;
+
+    while (n > 1) {
+        best = 0;
+        bi = bj = -1;
+        for (i = 0; i < n; i++) {
+            for (j = i + 1; j < n; j++) {
+                rect_union(&u, &rects[i], &rects[j]);
+                gain = (long)(rect_cost(&rects[i], overhead) + rect_cost(&rects[j], overhead)) -
+                       (long)rect_cost(&u, overhead);
+                if (gain > best) {
+                    best = gain;
+                    best_u = u;
+                    bi = i;
+                    bj = j;
+                }
+            }
+        }
+        if (bi == -1) {
+            break;
+        }
+
+        rects[bi] = best_u;
+        rects[bj] = rects[--n];
+        for (k = 0; k < n; k++) {
+            if (k != bi && rect_contains(&best_u, &rects[k])) {
+                rects[k] = rects[--n];
+                if (bi == n) {
+                    bi = k;
+                }
+                --k;
+            }
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Bring the display up to date with `frame', a full screen of big endian
+ * RGB565 pixels, by sending only the areas that differ from the shadow. The
+ * number of changed rectangles and the bytes sent are left in the shadow.
+ */
+int
+ulcd_shadow_update(struct ulcd_t *ulcd, struct shadow_t *shadow, const char *frame)
+{
+    struct point_t p;
+    struct rect_t *rects;
+    unsigned long long sent = ulcd->tx_bytes;
+    unsigned long overhead;
+    int tw, th, tx, ty;
+    int stride = shadow->width * 2;
+    int i, n = 0, y;
+
+    shadow->rects = 0;
+    shadow->bytes = 0;
+
+    if (!shadow->valid) {
+        p.x = 0;
+        p.y = 0;
+        if (ulcd_image_encode(ulcd, &p, frame, stride, 0, 0, shadow->width, shadow->height)) {
+            return ulcd->error;
+        }
+        memcpy(shadow->pixels, frame, shadow->height * stride);
+        shadow->valid = 1;
+        shadow->rects = 1;
+        shadow->bytes = ulcd->tx_bytes - sent;
+        return ERROK;
+    }
+
+    tw = (shadow->width + SHADOW_TILE - 1) / SHADOW_TILE;
+    th = (shadow->height + SHADOW_TILE - 1) / SHADOW_TILE;
+    rects = malloc(sizeof(struct rect_t) * tw * th);
+
+    /* Merge each row of tiles first, so that there are fewer pairs to try */
+    overhead = 10 + ulcd_command_overhead(ulcd);
+    for (ty = 0; ty < th; ty++) {
+        i = n;
+        for (tx = 0; tx < tw; tx++) {
+            if (tile_diff(shadow, frame, tx, ty, &rects[n])) {
+                ++n;
+            }
+        }
+        n = i + ulcd_rects_merge(rects + i, n - i, overhead);
+    }
+    n = ulcd_rects_merge(rects, n, overhead);
+
+    for (i = 0; i < n; i++) {
+        p.x = rects[i].x0;
+        p.y = rects[i].y0;
+        if (ulcd_image_encode(ulcd, &p, frame, stride, rects[i].x0, rects[i].y0,
+                              rects[i].x1 - rects[i].x0, rects[i].y1 - rects[i].y0)) {
+            /* Part of the rectangle may have been drawn */
+            shadow->valid = 0;
+            free(rects);
+            return ulcd->error;
+        }
+        for (y = rects[i].y0; y < rects[i].y1; y++) {
+            memcpy(shadow->pixels + y * stride + rects[i].x0 * 2, frame + y * stride + rects[i].x0 * 2,
+                   (rects[i].x1 - rects[i].x0) * 2);
+        }
+        ++(shadow->rects);
+    }
+    shadow->bytes = ulcd->tx_bytes - sent;
+
+    free(rects);
+
+    return ERROK;
+}
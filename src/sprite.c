@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Sprite cache. Images that are drawn over and over, such as icons, digits
+ * and buttons, are uploaded once to display memory that is never shown, and
+ * then copied into place by the display. A copy is a 14 byte command however
+ * large the image is.
+ *
+ * The off-screen pages are divided into shelves: rows of sprites of about
+ * the same height, filled from the left. When there is no room for a new
+ * sprite, the shelf that was used least recently is emptied and reused, and
+ * the sprites it held are uploaded again the next time they are drawn.
+ *
+ * Drawing a sprite leaves the read page set to the cache; the write page is
+ * restored after an upload. Uploads are affected by the clipping window like
+ * any other drawing, so it should include the cache area when enabled.
+ */
+
+/**
+ * Create a cache in `pages' pages of display memory starting at
+ * `first_page', each `width' x `height'. The pages must exist on the display
+ * and must not be used for anything else, e.g. pages 2 and 3 when frames
+ * are drawn on pages 0 and 1.
+ */
+struct sprite_cache_t *
+ulcd_sprite_cache_new(param_t first_page, param_t pages, param_t width, param_t height)
+{
+    struct sprite_cache_t *cache;
+
+    cache = malloc(sizeof(struct sprite_cache_t));
+    memset(cache, 0, sizeof(struct sprite_cache_t));
+    cache->first_page = first_page;
+    cache->pages = pages;
+    cache->width = width;
+    cache->height = height;
+
+    return cache;
+}
+
+void
+ulcd_sprite_cache_free(struct sprite_cache_t *cache)
+{
+    free(cache->sprites);
+    free(cache->shelves);
+    free(cache);
+}
+
+/**
+ * Forget every sprite, e.g. after the display was reset or its off-screen
+ * pages were drawn on by other means.
+ */
+void
+ulcd_sprite_cache_clear(struct sprite_cache_t *cache)
+{
+    cache->nsprites = 0;
+    cache->nshelves = 0;
+}
+
+/**
+ * Forget the sprites drawn from `pixels', e.g. because the image changed.
+ * Their space is reclaimed when their shelf is evicted.
+ */
+void
+ulcd_sprite_forget(struct sprite_cache_t *cache, const char *pixels)
+{
+    int i;
+
+    for (i = 0; i < cache->nsprites; i++) {
+        if (cache->sprites[i].pixels == pixels) {
+            cache->sprites[i--] = cache->sprites[--(cache->nsprites)];
+        }
+    }
+}
+
+static int
+sprite_find(const struct sprite_cache_t *cache, const char *pixels, param_t width, param_t height)
+{
+    const struct sprite_t *sprite;
+    int i;
+
+    for (i = 0; i < cache->nsprites; i++) {
+        sprite = &cache->sprites[i];
+        if (sprite->pixels == pixels && sprite->width == width && sprite->height == height) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Find a shelf with room for a sprite, that would not waste more than half
+ * of the sprite's height.
+ */
+static int
+shelf_find(const struct sprite_cache_t *cache, param_t width, param_t height)
+{
+    const struct shelf_t *shelf;
+    int i;
+
+    for (i = 0; i < cache->nshelves; i++) {
+        shelf = &cache->shelves[i];
+        if (shelf->height >= height && shelf->height <= height + height / 2 &&
+            shelf->x + width <= cache->width) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Add a shelf below the last one, or at the top of the next page. Returns
+ * -1 if the cache is full.
+ */
+static int
+shelf_new(struct sprite_cache_t *cache, param_t height)
+{
+    struct shelf_t *shelf;
+    param_t page = cache->first_page;
+    param_t y = 0;
+
+    if (cache->nshelves > 0) {
+        shelf = &cache->shelves[cache->nshelves - 1];
+        page = shelf->page;
+        y = shelf->y + shelf->height;
+        if (y + height > cache->height) {
+            ++page;
+            y = 0;
+        }
+    }
+    if (page >= cache->first_page + cache->pages) {
+        return -1;
+    }
+
+    if (cache->nshelves == cache->max_shelves) {
+        cache->max_shelves = cache->max_shelves ? cache->max_shelves * 2 : 16;
+        cache->shelves = realloc(cache->shelves, sizeof(struct shelf_t) * cache->max_shelves);
+    }
+
+    shelf = &cache->shelves[cache->nshelves];
+    shelf->page = page;
+    shelf->y = y;
+    shelf->height = height;
+    shelf->x = 0;
+    shelf->used = 0;
+
+    return cache->nshelves++;
+}
+
+/**
+ * Empty the least recently used shelf that is tall enough. Returns -1 if
+ * none is.
+ */
+static int
+shelf_evict(struct sprite_cache_t *cache, param_t height)
+{
+    int i, lru = -1;
+
+    for (i = 0; i < cache->nshelves; i++) {
+        if (cache->shelves[i].height >= height &&
+            (lru == -1 || cache->shelves[i].used < cache->shelves[lru].used)) {
+            lru = i;
+        }
+    }
+    if (lru == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < cache->nsprites; i++) {
+        if (cache->sprites[i].shelf == lru) {
+            cache->sprites[i--] = cache->sprites[--(cache->nsprites)];
+            ++(cache->evictions);
+        }
+    }
+    cache->shelves[lru].x = 0;
+
+    return lru;
+}
+
+/**
+ * Upload a sprite to the cache. Returns its index, or -1 on error.
+ */
+static int
+sprite_upload(struct ulcd_t *ulcd, struct sprite_cache_t *cache, const char *pixels, int stride,
+              param_t width, param_t height)
+{
+    struct sprite_t *sprite;
+    struct shelf_t *shelf;
+    struct point_t p;
+    param_t page = ulcd->page_write;
+    int i, err, e;
+
+    i = shelf_find(cache, width, height);
+    if (i == -1) {
+        i = shelf_new(cache, height);
+    }
+    if (i == -1) {
+        i = shelf_evict(cache, height);
+    }
+    if (i == -1) {
+        /* Only shorter shelves are left, start over */
+        cache->evictions += cache->nsprites;
+        ulcd_sprite_cache_clear(cache);
+        i = shelf_new(cache, height);
+    }
+    shelf = &cache->shelves[i];
+
+    p.x = shelf->x;
+    p.y = shelf->y;
+    err = ulcd_gfx_set_page_write(ulcd, shelf->page);
+    if (err == ERROK) {
+        err = ulcd_image_bitblt_rect(ulcd, &p, pixels, stride, 0, 0, width, height);
+        if ((e = ulcd_gfx_set_page_write(ulcd, page)) && err == ERROK) {
+            err = e;
+        }
+    }
+    if (err) {
+        return -1;
+    }
+
+    if (cache->nsprites == cache->max_sprites) {
+        cache->max_sprites = cache->max_sprites ? cache->max_sprites * 2 : 64;
+        cache->sprites = realloc(cache->sprites, sizeof(struct sprite_t) * cache->max_sprites);
+    }
+
+    sprite = &cache->sprites[cache->nsprites];
+    sprite->pixels = pixels;
+    sprite->width = width;
+    sprite->height = height;
+    sprite->page = shelf->page;
+    sprite->x = p.x;
+    sprite->y = p.y;
+    sprite->shelf = i;
+    shelf->x += width;
+
+    return cache->nsprites++;
+}
+
+/**
+ * Draw a `width' x `height' image at `point', uploading it to the cache
+ * first unless it is there already. `stride' is the distance between rows of
+ * the image in bytes. Images are told apart by the address of their pixels,
+ * so an image that changes must be forgotten with ulcd_sprite_forget().
+ * Images larger than the cache are blitted directly.
+ */
+int
+ulcd_sprite_draw(struct ulcd_t *ulcd, struct sprite_cache_t *cache, struct point_t *point,
+                 const char *pixels, int stride, param_t width, param_t height)
+{
+    struct sprite_t *sprite;
+    struct point_t p;
+    int i;
+
+    if (width > cache->width || height > cache->height || cache->pages == 0) {
+        return ulcd_image_bitblt_rect(ulcd, point, pixels, stride, 0, 0, width, height);
+    }
+
+    i = sprite_find(cache, pixels, width, height);
+    if (i == -1) {
+        ++(cache->misses);
+        if ((i = sprite_upload(ulcd, cache, pixels, stride, width, height)) == -1) {
+            return ulcd->error;
+        }
+    } else {
+        ++(cache->hits);
+    }
+
+    sprite = &cache->sprites[i];
+    sprite->used = ++(cache->clock);
+    cache->shelves[sprite->shelf].used = sprite->used;
+
+    if (ulcd->page_read != sprite->page && ulcd_gfx_set_page_read(ulcd, sprite->page)) {
+        return ulcd->error;
+    }
+
+    p.x = sprite->x;
+    p.y = sprite->y;
+
+    return ulcd_gfx_screen_copy_paste(ulcd, &p, point, width, height);
+}
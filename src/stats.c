@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Per-opcode statistics. Each connection keeps one set of counters for every
+ * opcode in the opcode table, plus one for opcodes that are not in it.
+ */
+
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+
+/**
+ * Map a latency to its histogram bucket. Values below STATS_SUB_COUNT get a
+ * bucket each; above that, the top STATS_SUB_BITS bits below the most
+ * significant one select the bucket within its power of two.
+ */
+static int
+stats_bucket(unsigned long long value)
+{
+    int shift = 0;
+
+    if (value > 0xffffffffULL) {
+        value = 0xffffffffULL;
+    }
+    if (value < STATS_SUB_COUNT) {
+        return value;
+    }
+    while ((value >> shift) >= 2 * STATS_SUB_COUNT) {
+        ++shift;
+    }
+
+    return ((shift + 1) << STATS_SUB_BITS) + ((value >> shift) & (STATS_SUB_COUNT - 1));
+}
+
+/**
+ * Returns the largest value that falls in a bucket.
+ */
+static unsigned long long
+stats_bucket_max(int bucket)
+{
+    int shift;
+
+    if (bucket < STATS_SUB_COUNT) {
+        return bucket;
+    }
+    shift = (bucket >> STATS_SUB_BITS) - 1;
+
+    return (((unsigned long long)(STATS_SUB_COUNT + (bucket & (STATS_SUB_COUNT - 1))) + 1) << shift) - 1;
+}
+
+/**
+ * Record the outcome of a command. `start' is when it was written, or zero
+ * if it never was.
+ */
+void
+ulcd_stats_record(struct ulcd_t *ulcd, param_t opcode, unsigned long long start, unsigned long tx, unsigned long rx, int error)
+{
+    struct opcode_stats_t *s;
+    unsigned long long latency;
+    int i;
+
+    i = ulcd_opcode_index(opcode);
+    s = &ulcd->stats[i < 0 ? ulcd_opcode_count() : i];
+
+    ++(s->calls);
+    s->tx_bytes += tx;
+    s->rx_bytes += rx;
+
+    if (error == ERRNAK) {
+        ++(s->naks);
+    } else if (error == ERRTIMEOUT) {
+        ++(s->timeouts);
+    }
+    if (error != ERROK) {
+        ++(s->errors);
+    }
+
+    if (start == 0) {
+        return;
+    }
+
+    latency = ulcd_now() - start;
+    s->latency_sum += latency;
+    if (latency > s->latency_max) {
+        s->latency_max = latency;
+    }
+    ++(s->histogram[stats_bucket(latency)]);
+}
+
+/**
+ * Point `stats' to the counters of a connection, and return the number of
+ * entries. Entries for opcodes that have not been used have zero calls.
+ */
+int
+ulcd_get_stats(struct ulcd_t *ulcd, const struct opcode_stats_t **stats)
+{
+    *stats = ulcd->stats;
+    return ulcd_opcode_count() + 1;
+}
+
+/**
+ * Zero all counters of a connection.
+ */
+void
+ulcd_stats_reset(struct ulcd_t *ulcd)
+{
+    int i, n;
+
+    n = ulcd_opcode_count();
+
+    if (ulcd->stats == NULL) {
+        ulcd->stats = malloc(sizeof(struct opcode_stats_t) * (n + 1));
+    }
+    memset(ulcd->stats, 0, sizeof(struct opcode_stats_t) * (n + 1));
+
+    for (i = 0; i < n; i++) {
+        ulcd->stats[i].opcode = opcode_table[i].opcode;
+    }
+}
+
+/**
+ * Returns the number of latency samples in the histogram.
+ */
+static unsigned long
+stats_samples(const struct opcode_stats_t *stats)
+{
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        n += stats->histogram[i];
+    }
+
+    return n;
+}
+
+/**
+ * Returns the latency below which `percentile' percent of the commands
+ * completed, e.g. 99.9. The result is rounded up to the end of its bucket.
+ */
+unsigned long long
+ulcd_stats_percentile(const struct opcode_stats_t *stats, double percentile)
+{
+    unsigned long long target;
+    unsigned long long max;
+    unsigned long n = 0;
+    int i;
+
+    target = stats_samples(stats) * percentile / 100.0 + 0.5;
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        n += stats->histogram[i];
+        if (n >= target) {
+            max = stats_bucket_max(i);
+            return max < stats->latency_max ? max : stats->latency_max;
+        }
+    }
+
+    return 0;
+}
+
+static void
+prometheus_counter(FILE *f, struct ulcd_t **displays, int num, const char *name, const char *help, size_t offset, int wide)
+{
+    const struct opcode_stats_t *s;
+    unsigned long long value;
+    int d, i, n;
+
+    fprintf(f, "# HELP %s %s\n", name, help);
+    fprintf(f, "# TYPE %s counter\n", name);
+
+    for (d = 0; d < num; d++) {
+        n = ulcd_get_stats(displays[d], &s);
+        for (i = 0; i < n; i++) {
+            if (s[i].calls == 0) {
+                continue;
+            }
+            if (wide) {
+                value = *(const unsigned long long *)((const char *)&s[i] + offset);
+            } else {
+                value = *(const unsigned long *)((const char *)&s[i] + offset);
+            }
+            fprintf(f, "%s{device=\"%s\",opcode=\"%s\"} %llu\n",
+                    name, displays[d]->device, ulcd_opcode_name(s[i].opcode), value);
+        }
+    }
+}
+
+/**
+ * Write the statistics of a number of displays in the Prometheus text
+ * exposition format. The latency histogram is exported with buckets at
+ * powers of two microseconds.
+ */
+void
+ulcd_stats_prometheus(FILE *f, struct ulcd_t **displays, int num)
+{
+    const struct opcode_stats_t *s;
+    const char *name;
+    unsigned long n;
+    int d, i, j, k, count;
+
+    prometheus_counter(f, displays, num, "ulcd_commands_total", "Commands sent to the display.",
+                       offsetof(struct opcode_stats_t, calls), 0);
+    prometheus_counter(f, displays, num, "ulcd_errors_total", "Commands that failed.",
+                       offsetof(struct opcode_stats_t, errors), 0);
+    prometheus_counter(f, displays, num, "ulcd_naks_total", "Commands rejected by the display.",
+                       offsetof(struct opcode_stats_t, naks), 0);
+    prometheus_counter(f, displays, num, "ulcd_timeouts_total", "Commands that timed out.",
+                       offsetof(struct opcode_stats_t, timeouts), 0);
+    prometheus_counter(f, displays, num, "ulcd_tx_bytes_total", "Bytes sent to the display.",
+                       offsetof(struct opcode_stats_t, tx_bytes), 1);
+    prometheus_counter(f, displays, num, "ulcd_rx_bytes_total", "Bytes received from the display.",
+                       offsetof(struct opcode_stats_t, rx_bytes), 1);
+
+    fprintf(f, "# HELP ulcd_command_latency_seconds Time from sending a command to receiving its reply.\n");
+    fprintf(f, "# TYPE ulcd_command_latency_seconds histogram\n");
+
+    for (d = 0; d < num; d++) {
+        count = ulcd_get_stats(displays[d], &s);
+        for (i = 0; i < count; i++) {
+            if (s[i].calls == 0) {
+                continue;
+            }
+            name = ulcd_opcode_name(s[i].opcode);
+            n = 0;
+            j = 0;
+            for (k = 4; k <= 25; k++) {
+                while (j < STATS_BUCKETS && stats_bucket_max(j) <= (1ULL << k)) {
+                    n += s[i].histogram[j++];
+                }
+                fprintf(f, "ulcd_command_latency_seconds_bucket{device=\"%s\",opcode=\"%s\",le=\"%g\"} %lu\n",
+                        displays[d]->device, name, (1ULL << k) / 1000000.0, n);
+            }
+            while (j < STATS_BUCKETS) {
+                n += s[i].histogram[j++];
+            }
+            fprintf(f, "ulcd_command_latency_seconds_bucket{device=\"%s\",opcode=\"%s\",le=\"+Inf\"} %lu\n",
+                    displays[d]->device, name, n);
+            fprintf(f, "ulcd_command_latency_seconds_sum{device=\"%s\",opcode=\"%s\"} %.6f\n",
+                    displays[d]->device, name, s[i].latency_sum / 1000000.0);
+            fprintf(f, "ulcd_command_latency_seconds_count{device=\"%s\",opcode=\"%s\"} %lu\n",
+                    displays[d]->device, name, n);
+        }
+    }
+}
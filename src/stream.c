@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Text stream. Characters written one at a time are collected and drawn with
+ * a single PUT_STR, instead of a PUT_CH command and a wait per character.
+ * The characters are sent at a newline, when `threshold' of them have been
+ * collected, when the first of them has waited `delay' microseconds, or
+ * when flushed explicitly.
+ *
+ * Any other command sends the characters collected so far first, so that
+ * they are drawn with the text settings and at the position in effect when
+ * they were written. The delay is only checked when characters are written
+ * or when ulcd_txt_stream_poll() is called; an event loop can wait for
+ * ulcd_txt_stream_timeout() milliseconds, then poll.
+ */
+
+/**
+ * Start collecting characters. A `threshold' of zero or more than a PUT_STR
+ * command takes means as many as fit, and a `delay' of zero means no limit.
+ */
+int
+ulcd_txt_stream_begin(struct ulcd_t *ulcd, int threshold, unsigned long delay)
+{
+    struct txt_stream_t *stream = &ulcd->stream;
+
+    if (stream->enabled && ulcd_txt_stream_flush(ulcd)) {
+        return ulcd->error;
+    }
+
+    stream->enabled = 1;
+    stream->len = 0;
+    stream->threshold = threshold > 0 && threshold < TXT_PUTSTR_MAX ? threshold : TXT_PUTSTR_MAX;
+    stream->delay = delay;
+    pack_uint(stream->buffer, PUT_STR);
+
+    return ERROK;
+}
+
+/**
+ * Send what is left and stop collecting characters.
+ */
+int
+ulcd_txt_stream_end(struct ulcd_t *ulcd)
+{
+    int err = ulcd_txt_stream_flush(ulcd);
+
+    ulcd->stream.enabled = 0;
+
+    return err;
+}
+
+/**
+ * Send the characters collected so far.
+ */
+int
+ulcd_txt_stream_flush(struct ulcd_t *ulcd)
+{
+    struct txt_stream_t *stream = &ulcd->stream;
+    int len = stream->len;
+
+    if (len == 0) {
+        return ERROK;
+    }
+
+    /* Emptied first, as sending would otherwise flush the stream again */
+    stream->len = 0;
+    stream->buffer[2 + len] = '\0';
+
+    return ulcd_send_recv_ack_word(ulcd, stream->buffer, 2 + len + 1, NULL);
+}
+
+/**
+ * Called before any command is sent, to send the characters collected first.
+ * The timeout set for the command is kept for it. Touch polls leave the
+ * stream alone: one that goes ahead of a command comes after the stream was
+ * sent, and the service thread must not touch the application's stream.
+ */
+int
+ulcd_txt_stream_before(struct ulcd_t *ulcd)
+{
+    unsigned long timeout = ulcd->call_timeout;
+    int err;
+
+    if ((ulcd->touch != NULL && ulcd->touch->busy) || ulcd->stream.len == 0) {
+        return ERROK;
+    }
+
+    ulcd->call_timeout = 0;
+    err = ulcd_txt_stream_flush(ulcd);
+    ulcd->call_timeout = timeout;
+
+    return err;
+}
+
+int
+ulcd_txt_stream_putch(struct ulcd_t *ulcd, char c)
+{
+    struct txt_stream_t *stream = &ulcd->stream;
+
+    if (!stream->enabled) {
+        return ulcd_txt_putch(ulcd, c);
+    }
+
+    /* PUT_STR cannot carry a NUL */
+    if (c == '\0') {
+        if (ulcd_txt_stream_flush(ulcd)) {
+            return ulcd->error;
+        }
+        return ulcd_txt_putch(ulcd, c);
+    }
+
+    if (stream->len == 0) {
+        stream->since = ulcd_now();
+    }
+    stream->buffer[2 + stream->len++] = c;
+
+    if (c == '\n' || stream->len >= stream->threshold ||
+        (stream->delay > 0 && ulcd_now() - stream->since >= stream->delay)) {
+        return ulcd_txt_stream_flush(ulcd);
+    }
+
+    return ERROK;
+}
+
+int
+ulcd_txt_stream_write(struct ulcd_t *ulcd, const char *data, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if (ulcd_txt_stream_putch(ulcd, data[i])) {
+            return ulcd->error;
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * Send the characters collected if the first of them has waited long
+ * enough.
+ */
+int
+ulcd_txt_stream_poll(struct ulcd_t *ulcd)
+{
+    struct txt_stream_t *stream = &ulcd->stream;
+
+    if (stream->len > 0 && stream->delay > 0 && ulcd_now() - stream->since >= stream->delay) {
+        return ulcd_txt_stream_flush(ulcd);
+    }
+
+    return ERROK;
+}
+
+/**
+ * Returns the number of milliseconds until the characters collected are due,
+ * or -1 if there are none or no delay was given.
+ */
+int
+ulcd_txt_stream_timeout(struct ulcd_t *ulcd)
+{
+    struct txt_stream_t *stream = &ulcd->stream;
+    unsigned long long now;
+
+    if (stream->len == 0 || stream->delay == 0) {
+        return -1;
+    }
+
+    now = ulcd_now();
+    if (now - stream->since >= stream->delay) {
+        return 0;
+    }
+
+    return (stream->since + stream->delay - now + 999) / 1000;
+}
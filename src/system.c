@@ -4,23 +4,26 @@
 
 #include "config.h"
 #include "ulcd43.h"
-
-/**
- * Global send and receive buffer
- */
-extern char cmdbuf[4096];
-extern char recvbuf[2];
+#include "util.h"
 
 
 int
 ulcd_get_display_model(struct ulcd_t *ulcd)
 {
     param_t size;
-    int s = pack_uints(cmdbuf, 1, GET_DISPLAY_MODEL);
-    if (ulcd_send_recv_ack_word(ulcd, cmdbuf, s, &size)) {
-        return ulcd->error;
+    char buffer[2];
+    int s = pack_uints(ulcd->cmdbuf, 1, GET_DISPLAY_MODEL);
+    int err;
+
+    /* The model follows the reply, so no touch poll may come in between */
+    ulcd_link_lock(ulcd);
+    err = ulcd_send_recv_ack_data(ulcd, ulcd->cmdbuf, s, buffer, 2);
+    if (err == ERROK) {
+        unpack_uint(&size, buffer);
+        err = ulcd_recv(ulcd, ulcd->model, size);
     }
-    if (ulcd_recv(ulcd, ulcd->model, size)) {
+    ulcd_link_unlock(ulcd);
+    if (err) {
         return ulcd->error;
     }
     ulcd->model[size] = '\0';
@@ -30,15 +33,15 @@ ulcd_get_display_model(struct ulcd_t *ulcd)
 int
 ulcd_get_spe_version(struct ulcd_t *ulcd)
 {
-    int s = pack_uints(cmdbuf, 1, GET_SPE_VERSION);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, &(ulcd->spe_version));
+    int s = pack_uints(ulcd->cmdbuf, 1, GET_SPE_VERSION);
+    return ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s, &(ulcd->spe_version));
 }
 
 int
 ulcd_get_pmmc_version(struct ulcd_t *ulcd)
 {
-    int s = pack_uints(cmdbuf, 1, GET_PMMC_VERSION);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, &(ulcd->pmmc_version));
+    int s = pack_uints(ulcd->cmdbuf, 1, GET_PMMC_VERSION);
+    return ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s, &(ulcd->pmmc_version));
 }
 
 int
@@ -0,0 +1,522 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Terminal. Output is interpreted as a subset of VT100: printable characters,
+ * carriage return, newline (which also returns the carriage, like a tty in
+ * cooked mode), backspace and tab, cursor movement (CSI A, B, C, D, H, f),
+ * erasing (CSI J, K) and the colours and attributes of CSI m. Anything else
+ * is ignored, and no cursor is drawn.
+ *
+ * Writing only changes a grid of cells on the host. A refresh brings the
+ * display up to date: lines that scrolled off are scrolled on the display
+ * itself, then the cells that differ from what the display shows are drawn,
+ * in runs of cells with the same colours and attributes. Nearby changes on a
+ * line are drawn as one run when that is cheaper than another command, and
+ * runs are sent grouped by their attributes, so that the text settings
+ * change as few times as possible. The commands are pipelined.
+ *
+ * Cells are the size of an `M' in the font in effect at the first refresh,
+ * which should be fixed width.
+ */
+
+#define TERM_NORMAL 0
+#define TERM_ESC 1
+#define TERM_CSI 2
+
+#define TERM_FG 0xffff
+#define TERM_BG 0x0000
+
+/* Unchanged cells worth drawing to save a MOVE_TO and a PUT_STR */
+#define TERM_JOIN 8
+
+static const unsigned short term_colors[16] = {
+    0x0000, 0xa800, 0x0540, 0xaaa0, 0x0015, 0xa815, 0x0555, 0xad55,
+    0x52aa, 0xfaaa, 0x57ea, 0xffea, 0x52bf, 0xfabf, 0x57ff, 0xffff
+};
+
+struct term_run_t {
+    unsigned long long key;
+    int row;
+    int start;
+    int end;
+};
+
+#define cell_at(term, cells, col, row) (&(cells)[(row) * (term)->cols + (col)])
+
+static void
+cells_blank(struct term_cell_t *cells, int n, unsigned short bg)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        cells[i].c = ' ';
+        cells[i].attributes = 0;
+        cells[i].fg = TERM_FG;
+        cells[i].bg = bg;
+    }
+}
+
+struct term_t *
+ulcd_term_new(struct point_t *origin, param_t cols, param_t rows)
+{
+    struct term_t *term;
+
+    term = malloc(sizeof(struct term_t));
+    memset(term, 0, sizeof(struct term_t));
+    term->origin = *origin;
+    term->cols = cols;
+    term->rows = rows;
+    term->cells = malloc(sizeof(struct term_cell_t) * cols * rows);
+    term->shown = malloc(sizeof(struct term_cell_t) * cols * rows);
+    cells_blank(term->cells, cols * rows, TERM_BG);
+    term->pen.fg = TERM_FG;
+    term->pen.bg = TERM_BG;
+
+    return term;
+}
+
+void
+ulcd_term_free(struct term_t *term)
+{
+    free(term->cells);
+    free(term->shown);
+    free(term);
+}
+
+/**
+ * Forget what the display shows, e.g. after the screen was cleared. The next
+ * refresh clears the box and draws every cell that is not blank.
+ */
+void
+ulcd_term_invalidate(struct term_t *term)
+{
+    term->valid = 0;
+}
+
+/**
+ * Scroll the grid up by a line.
+ */
+static void
+term_scroll(struct term_t *term)
+{
+    memmove(term->cells, term->cells + term->cols, sizeof(struct term_cell_t) * term->cols * (term->rows - 1));
+    cells_blank(cell_at(term, term->cells, 0, term->rows - 1), term->cols, TERM_BG);
+    if (term->scroll < (int)term->rows) {
+        ++(term->scroll);
+    }
+}
+
+static void
+term_newline(struct term_t *term)
+{
+    term->cx = 0;
+    if (term->cy + 1 < (int)term->rows) {
+        ++(term->cy);
+    } else {
+        term_scroll(term);
+    }
+}
+
+static void
+term_put(struct term_t *term, char c)
+{
+    struct term_cell_t *cell;
+
+    /* Wrapping is deferred until there is something to put on the next line */
+    if (term->cx >= (int)term->cols) {
+        term_newline(term);
+    }
+
+    cell = cell_at(term, term->cells, term->cx, term->cy);
+    cell->c = c;
+    cell->attributes = term->pen.attributes;
+    cell->fg = term->inverse ? term->pen.bg : term->pen.fg;
+    cell->bg = term->inverse ? term->pen.fg : term->pen.bg;
+    ++(term->cx);
+}
+
+/**
+ * Erase cells `from' to `to' of the grid, counted from the top left.
+ */
+static void
+term_erase(struct term_t *term, int from, int to)
+{
+    if (from < to) {
+        cells_blank(term->cells + from, to - from, term->pen.bg);
+    }
+}
+
+static int
+param(const struct term_t *term, int i, int def)
+{
+    return i < term->nparams && term->params[i] > 0 ? term->params[i] : def;
+}
+
+static void
+term_sgr(struct term_t *term)
+{
+    int i, p;
+
+    if (term->nparams == 0) {
+        term->nparams = 1;
+        term->params[0] = 0;
+    }
+
+    for (i = 0; i < term->nparams; i++) {
+        p = term->params[i];
+        if (p == 0) {
+            term->pen.attributes = 0;
+            term->pen.fg = TERM_FG;
+            term->pen.bg = TERM_BG;
+            term->inverse = 0;
+        } else if (p == 1) {
+            term->pen.attributes |= TXT_ATTRIBUTE_BOLD;
+        } else if (p == 4) {
+            term->pen.attributes |= TXT_ATTRIBUTE_UNDERLINED;
+        } else if (p == 7) {
+            term->inverse = 1;
+        } else if (p == 22) {
+            term->pen.attributes &= ~TXT_ATTRIBUTE_BOLD;
+        } else if (p == 24) {
+            term->pen.attributes &= ~TXT_ATTRIBUTE_UNDERLINED;
+        } else if (p == 27) {
+            term->inverse = 0;
+        } else if (p >= 30 && p <= 37) {
+            term->pen.fg = term_colors[p - 30];
+        } else if (p == 39) {
+            term->pen.fg = TERM_FG;
+        } else if (p >= 40 && p <= 47) {
+            term->pen.bg = term_colors[p - 40];
+        } else if (p == 49) {
+            term->pen.bg = TERM_BG;
+        } else if (p >= 90 && p <= 97) {
+            term->pen.fg = term_colors[p - 90 + 8];
+        } else if (p >= 100 && p <= 107) {
+            term->pen.bg = term_colors[p - 100 + 8];
+        }
+    }
+}
+
+static void
+term_csi(struct term_t *term, char c)
+{
+    int cols = term->cols, rows = term->rows;
+    int at = term->cy * cols + (term->cx < cols ? term->cx : cols - 1);
+
+    /* Erasing and colours leave the cursor alone, moves stay on the screen */
+    switch (c) {
+    case 'A':
+        term->cy -= param(term, 0, 1);
+        break;
+    case 'B':
+        term->cy += param(term, 0, 1);
+        break;
+    case 'C':
+        term->cx += param(term, 0, 1);
+        break;
+    case 'D':
+        term->cx = (term->cx < cols ? term->cx : cols - 1) - param(term, 0, 1);
+        break;
+    case 'H':
+    case 'f':
+        term->cy = param(term, 0, 1) - 1;
+        term->cx = param(term, 1, 1) - 1;
+        break;
+    case 'J':
+        if (param(term, 0, 0) == 0) {
+            term_erase(term, at, cols * rows);
+        } else if (term->params[0] == 1) {
+            term_erase(term, 0, at + 1);
+        } else {
+            term_erase(term, 0, cols * rows);
+        }
+        return;
+    case 'K':
+        if (param(term, 0, 0) == 0) {
+            term_erase(term, at, (term->cy + 1) * cols);
+        } else if (term->params[0] == 1) {
+            term_erase(term, term->cy * cols, at + 1);
+        } else {
+            term_erase(term, term->cy * cols, (term->cy + 1) * cols);
+        }
+        return;
+    case 'm':
+        term_sgr(term);
+        return;
+    }
+
+    if (term->cx < 0) {
+        term->cx = 0;
+    } else if (term->cx >= cols) {
+        term->cx = cols - 1;
+    }
+    if (term->cy < 0) {
+        term->cy = 0;
+    } else if (term->cy >= rows) {
+        term->cy = rows - 1;
+    }
+}
+
+/**
+ * Interpret terminal output. Only the grid changes; see ulcd_term_refresh().
+ */
+void
+ulcd_term_write(struct term_t *term, const char *data, int size)
+{
+    char c;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        c = data[i];
+
+        if (term->state == TERM_ESC) {
+            term->state = c == '[' ? TERM_CSI : TERM_NORMAL;
+            term->nparams = 0;
+            memset(term->params, 0, sizeof(term->params));
+            continue;
+        }
+
+        if (term->state == TERM_CSI) {
+            if (c >= '0' && c <= '9') {
+                if (term->nparams == 0) {
+                    term->nparams = 1;
+                }
+                term->params[term->nparams - 1] = term->params[term->nparams - 1] * 10 + c - '0';
+            } else if (c == ';') {
+                if (term->nparams == 0) {
+                    term->nparams = 1;
+                }
+                if (term->nparams < TERM_PARAMS_MAX) {
+                    ++(term->nparams);
+                }
+            } else if (c >= 0x40 && c <= 0x7e) {
+                term_csi(term, c);
+                term->state = TERM_NORMAL;
+            }
+            continue;
+        }
+
+        switch (c) {
+        case '\033':
+            term->state = TERM_ESC;
+            break;
+        case '\r':
+            term->cx = 0;
+            break;
+        case '\n':
+            term_newline(term);
+            break;
+        case '\b':
+            if (term->cx > 0) {
+                term->cx = (term->cx < (int)term->cols ? term->cx : (int)term->cols) - 1;
+            }
+            break;
+        case '\t':
+            do {
+                term_put(term, ' ');
+            } while (term->cx % 8 != 0 && term->cx < (int)term->cols);
+            break;
+        default:
+            if ((unsigned char)c >= ' ' && c != 0x7f) {
+                term_put(term, c);
+            }
+            break;
+        }
+    }
+}
+
+static int
+cell_same(const struct term_cell_t *a, const struct term_cell_t *b)
+{
+    return a->c == b->c && a->attributes == b->attributes && a->fg == b->fg && a->bg == b->bg;
+}
+
+static int
+cell_same_style(const struct term_cell_t *a, const struct term_cell_t *b)
+{
+    return a->attributes == b->attributes && a->fg == b->fg && a->bg == b->bg;
+}
+
+static int
+run_compare(const void *a, const void *b)
+{
+    const struct term_run_t *x = a, *y = b;
+
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    if (x->row != y->row) {
+        return x->row - y->row;
+    }
+    return x->start - y->start;
+}
+
+/**
+ * Find the runs of cells to draw, in the order to draw them. Returns the
+ * number of runs.
+ */
+static int
+term_diff(struct term_t *term, struct term_run_t *runs)
+{
+    struct term_cell_t *cells, *shown;
+    int row, col, k, last, n = 0;
+
+    for (row = 0; row < (int)term->rows; row++) {
+        cells = cell_at(term, term->cells, 0, row);
+        shown = cell_at(term, term->shown, 0, row);
+
+        for (col = 0; col < (int)term->cols; col++) {
+            if (cell_same(&cells[col], &shown[col])) {
+                continue;
+            }
+
+            last = col;
+            for (k = col + 1; k < (int)term->cols && k - col < TXT_PUTSTR_MAX &&
+                              cell_same_style(&cells[k], &cells[col]); k++) {
+                if (!cell_same(&cells[k], &shown[k])) {
+                    if (k - last - 1 > TERM_JOIN) {
+                        break;
+                    }
+                    last = k;
+                }
+            }
+
+            runs[n].key = ((unsigned long long)cells[col].attributes << 32) |
+                          ((unsigned long long)cells[col].fg << 16) | cells[col].bg;
+            runs[n].row = row;
+            runs[n].start = col;
+            runs[n].end = last + 1;
+            ++n;
+            col = last;
+        }
+    }
+
+    qsort(runs, n, sizeof(struct term_run_t), run_compare);
+
+    return n;
+}
+
+static int
+term_draw(struct ulcd_t *ulcd, struct term_t *term, const struct term_run_t *run)
+{
+    const struct term_cell_t *cells = cell_at(term, term->cells, 0, run->row);
+    char text[TXT_PUTSTR_MAX + 1];
+    struct point_t p;
+    int i;
+
+    if (ulcd_txt_set_color_fg(ulcd, cells[run->start].fg, NULL) ||
+        ulcd_txt_set_color_bg(ulcd, cells[run->start].bg, NULL) ||
+        ulcd_txt_set_attributes(ulcd, cells[run->start].attributes, NULL)) {
+        return ulcd->error;
+    }
+
+    for (i = run->start; i < run->end; i++) {
+        text[i - run->start] = cells[i].c;
+    }
+    text[run->end - run->start] = '\0';
+
+    p.x = term->origin.x + run->start * term->cell_width;
+    p.y = term->origin.y + run->row * term->cell_height;
+    if (ulcd_gfx_move_to(ulcd, &p) || ulcd_txt_putstr(ulcd, text, NULL)) {
+        return ulcd->error;
+    }
+
+    memcpy(cell_at(term, term->shown, run->start, run->row), &cells[run->start],
+           sizeof(struct term_cell_t) * (run->end - run->start));
+
+    return ERROK;
+}
+
+/**
+ * Bring the display up to date with the grid.
+ */
+static int
+term_update(struct ulcd_t *ulcd, struct term_t *term)
+{
+    struct term_run_t *runs;
+    struct point_t p1, p2;
+    int i, n, err = ERROK;
+
+    p1 = term->origin;
+    p2.x = p1.x + term->cols * term->cell_width - 1;
+    p2.y = p1.y + term->rows * term->cell_height - 1;
+
+    if (!term->valid) {
+        if (ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, TERM_BG)) {
+            return ulcd->error;
+        }
+        cells_blank(term->shown, term->cols * term->rows, TERM_BG);
+        term->valid = 1;
+    } else if (term->scroll > 0 && term->scroll < (int)term->rows) {
+        if (ulcd_gfx_scroll(ulcd, &p1, &p2, term->scroll * term->cell_height, TERM_BG)) {
+            term->valid = 0;
+            return ulcd->error;
+        }
+        memmove(term->shown, term->shown + term->scroll * term->cols,
+                sizeof(struct term_cell_t) * term->cols * (term->rows - term->scroll));
+        cells_blank(cell_at(term, term->shown, 0, term->rows - term->scroll), term->scroll * term->cols, TERM_BG);
+    }
+    term->scroll = 0;
+
+    if (ulcd_txt_set_opacity(ulcd, 1, NULL)) {
+        return ulcd->error;
+    }
+
+    runs = malloc(sizeof(struct term_run_t) * term->rows * term->cols);
+    n = term_diff(term, runs);
+    for (i = 0; i < n && err == ERROK; i++) {
+        err = term_draw(ulcd, term, &runs[i]);
+    }
+    free(runs);
+
+    if (err) {
+        term->valid = 0;
+    }
+
+    return err;
+}
+
+/**
+ * Draw what changed since the last refresh. The text settings must be known,
+ * i.e. set since they were last reset; the colours and attributes are left
+ * as the last cell drawn needed them.
+ */
+int
+ulcd_term_refresh(struct ulcd_t *ulcd, struct term_t *term)
+{
+    param_t w, h;
+    int own_pipeline;
+    int err, e;
+
+    if (term->cell_width == 0) {
+        if (ulcd_txt_measure(ulcd, "M", &w, &h)) {
+            return ulcd->error;
+        }
+        if (!(ulcd->txt.valid & (1 << TXT_STATE_YGAP))) {
+            return ulcd_error(ulcd, ERRRANGE, "Line gap is not known, set it first");
+        }
+        term->cell_width = w + ulcd->txt.value[TXT_STATE_XGAP];
+        term->cell_height = h + ulcd->txt.value[TXT_STATE_YGAP];
+    }
+
+    own_pipeline = ulcd->pipeline.window == 0;
+    if (own_pipeline) {
+        ulcd_pipeline_begin(ulcd, PIPELINE_DEPTH_MAX, NULL, NULL);
+    }
+
+    err = term_update(ulcd, term);
+
+    if (own_pipeline && (e = ulcd_pipeline_end(ulcd)) && err == ERROK) {
+        err = e;
+    }
+    if (err) {
+        term->valid = 0;
+    }
+
+    return err;
+}
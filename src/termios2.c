@@ -0,0 +1,36 @@
+#include "config.h"
+
+#ifdef HAVE_ASM_TERMBITS_H
+/* asm/termbits.h clashes with termios.h, so this file includes only the
+ * kernel headers. */
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#endif
+#include <errno.h>
+
+/**
+ * Set the speed of a serial device to an arbitrary rate, with the Linux
+ * termios2 interface. With `drain' set, output that has been written is sent
+ * at the old rate first. Returns -1 with errno set on failure.
+ */
+int
+ulcd_set_custom_baud_rate(int fd, unsigned long rate, int drain)
+{
+#if defined(HAVE_ASM_TERMBITS_H) && defined(BOTHER) && defined(TCSETS2)
+    struct termios2 options;
+
+    if (ioctl(fd, TCGETS2, &options) == -1) {
+        return -1;
+    }
+
+    options.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    options.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    options.c_ispeed = rate;
+    options.c_ospeed = rate;
+
+    return ioctl(fd, drain ? TCSETSW2 : TCSETS2, &options);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
@@ -31,26 +31,3 @@ test_touch_draw(struct ulcd_t *ulcd)
 
     return 0;
 }
-
-
-/*
-int
-benchmark(struct ulcd_t *ulcd, unsigned long iterations)
-{
-    unsigned long i;
-
-    clock_t diff;
-    clock_t start = clock();
-    param_t st;
-
-    for (i = 0; i < iterations; i++) {
-    }
-
-    diff = clock() - start;
-    int msec = diff * 1000 / CLOCKS_PER_SEC;
-
-    printf("%u iterations in %.3f seconds\n", iterations, (msec/1000.0));
-    return 0;
-}
-
-*/
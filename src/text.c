@@ -5,152 +5,254 @@
 #include "ulcd43.h"
 #include "util.h"
 
-extern char cmdbuf[4096];
-
 int
 ulcd_move_cursor(struct ulcd_t *ulcd, param_t line, param_t column)
 {
-    int s = pack_uints(cmdbuf, 3, MOVE_CURSOR, line, column);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 3, MOVE_CURSOR, line, column);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_txt_putch(struct ulcd_t *ulcd, char c)
 {
-    int s = pack_uints(cmdbuf, 2, PUT_CH, 0x0000 | c);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 2, PUT_CH, 0x0000 | c);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_txt_putstr(struct ulcd_t *ulcd, const char *str, param_t *slen)
 {
     int len = strlen(str);
-    int s = pack_uint(cmdbuf, PUT_STR);
+    int s = pack_uint(ulcd->cmdbuf, PUT_STR);
+
+    if (len > TXT_PUTSTR_MAX) {
+        len = TXT_PUTSTR_MAX;
+    }
+    strncpy(ulcd->cmdbuf+s, str, len);
+    ulcd->cmdbuf[s+len] = '\0';
+
+    return ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s+len+1, slen);
+}
+
+/**
+ * Character metrics are cached per font and size, see metrics.c.
+ */
+static int
+txt_metric(struct ulcd_t *ulcd, param_t opcode, int metric, char c, param_t *value)
+{
+    struct font_metrics_t *m = ulcd_metrics_current(ulcd);
+    unsigned char i = c;
+    param_t *cached;
+    int s;
+
+    if (m != NULL) {
+        cached = metric == METRIC_WIDTH ? &m->width[i] : &m->height[i];
+        if (m->known[i] & metric) {
+            *value = *cached;
+            return ERROK;
+        }
+    }
+
+    s = pack_uint(ulcd->cmdbuf, opcode);
+    ulcd->cmdbuf[s] = c;
+    if (ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s+1, value)) {
+        return ulcd->error;
+    }
 
-    if (len > 511) {
-        len = 511;
+    /* Pipelined replies come later */
+    if (m != NULL && ulcd->pipeline.window == 0) {
+        *cached = *value;
+        m->known[i] |= metric;
     }
-    strncpy(cmdbuf+s, str, len);
-    cmdbuf[s+len] = '\0';
 
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s+len+1, slen);
+    return ERROK;
 }
 
 int
 ulcd_txt_charwidth(struct ulcd_t *ulcd, char c, param_t *width)
 {
-    int s = pack_uint(cmdbuf, CHAR_WIDTH);
-    cmdbuf[s] = c;
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s+1, width);
+    return txt_metric(ulcd, CHAR_WIDTH, METRIC_WIDTH, c, width);
 }
 
 int
 ulcd_txt_charheight(struct ulcd_t *ulcd, char c, param_t *height)
 {
-    int s = pack_uint(cmdbuf, CHAR_HEIGHT);
-    cmdbuf[s] = c;
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s+1, height);
+    return txt_metric(ulcd, CHAR_HEIGHT, METRIC_HEIGHT, c, height);
+}
+
+/**
+ * Text settings are cached, see struct txt_state_t. Setting one to the value
+ * it is known to have already sends nothing; `prev' is then that value.
+ */
+static int
+txt_set(struct ulcd_t *ulcd, param_t opcode, int index, param_t value, param_t *prev)
+{
+    struct txt_state_t *txt = &ulcd->txt;
+    int s;
+
+    if ((txt->valid & (1 << index)) && txt->value[index] == value) {
+        if (prev != NULL) {
+            *prev = value;
+        }
+        return ERROK;
+    }
+
+    s = pack_uints(ulcd->cmdbuf, 2, opcode, value);
+    if (ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s, prev)) {
+        txt->valid &= ~(1 << index);
+        return ulcd->error;
+    }
+    txt->value[index] = value;
+    txt->valid |= 1 << index;
+
+    return ERROK;
+}
+
+/**
+ * Bold, italic, inverse and underline are bits of the text attributes.
+ */
+static int
+txt_set_attribute(struct ulcd_t *ulcd, param_t opcode, param_t bit, param_t value, param_t *prev)
+{
+    struct txt_state_t *txt = &ulcd->txt;
+    int s;
+
+    if ((txt->attributes_known & bit) && ((txt->attributes & bit) != 0) == (value != 0)) {
+        if (prev != NULL) {
+            *prev = value != 0 ? 1 : 0;
+        }
+        return ERROK;
+    }
+
+    s = pack_uints(ulcd->cmdbuf, 2, opcode, value != 0 ? 1 : 0);
+    if (ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s, prev)) {
+        txt->attributes_known &= ~bit;
+        return ulcd->error;
+    }
+    txt->attributes = value != 0 ? (txt->attributes | bit) : (txt->attributes & ~bit);
+    txt->attributes_known |= bit;
+
+    return ERROK;
+}
+
+/**
+ * Forget the cached text settings, e.g. when the display may have changed
+ * them by itself.
+ */
+void
+ulcd_txt_invalidate(struct ulcd_t *ulcd)
+{
+    ulcd->txt.valid = 0;
+    ulcd->txt.attributes_known = 0;
 }
 
 int
 ulcd_txt_set_color_fg(struct ulcd_t *ulcd, color_t color, color_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TEXT_FGCOLOUR, color);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TEXT_FGCOLOUR, TXT_STATE_FG, color, prev);
 }
 
 int
 ulcd_txt_set_color_bg(struct ulcd_t *ulcd, color_t color, color_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TEXT_BGCOLOUR, color);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TEXT_BGCOLOUR, TXT_STATE_BG, color, prev);
 }
 
 int
 ulcd_txt_set_font(struct ulcd_t *ulcd, param_t font, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_FONT_ID, font);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TXT_FONT_ID, TXT_STATE_FONT, font, prev);
 }
 
 int
 ulcd_txt_set_width(struct ulcd_t *ulcd, param_t multiplier, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_WIDTH, multiplier);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TXT_WIDTH, TXT_STATE_WIDTH, multiplier, prev);
 }
 
 int
 ulcd_txt_set_height(struct ulcd_t *ulcd, param_t multiplier, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_HEIGHT, multiplier);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TXT_HEIGHT, TXT_STATE_HEIGHT, multiplier, prev);
 }
 
 int
 ulcd_txt_set_xgap(struct ulcd_t *ulcd, param_t pixels, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_X_GAP, pixels);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TXT_X_GAP, TXT_STATE_XGAP, pixels, prev);
 }
 
 int
 ulcd_txt_set_ygap(struct ulcd_t *ulcd, param_t pixels, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_Y_GAP, pixels);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TXT_Y_GAP, TXT_STATE_YGAP, pixels, prev);
 }
 
 int
 ulcd_txt_set_bold(struct ulcd_t *ulcd, param_t value, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_BOLD, value != 0 ? 1 : 0);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set_attribute(ulcd, TXT_BOLD, TXT_ATTRIBUTE_BOLD, value, prev);
 }
 
 int
 ulcd_txt_set_inverse(struct ulcd_t *ulcd, param_t value, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_INVERSE, value != 0 ? 1 : 0);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set_attribute(ulcd, TXT_INVERSE, TXT_ATTRIBUTE_INVERSE, value, prev);
 }
 
 int
 ulcd_txt_set_italic(struct ulcd_t *ulcd, param_t value, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_ITALIC, value != 0 ? 1 : 0);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set_attribute(ulcd, TXT_ITALIC, TXT_ATTRIBUTE_ITALIC, value, prev);
 }
 
 int
 ulcd_txt_set_underline(struct ulcd_t *ulcd, param_t value, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_UNDERLINE, value != 0 ? 1 : 0);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set_attribute(ulcd, TXT_UNDERLINE, TXT_ATTRIBUTE_UNDERLINED, value, prev);
 }
 
 int
 ulcd_txt_set_opacity(struct ulcd_t *ulcd, param_t value, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_OPACITY, value != 0 ? 1 : 0);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    return txt_set(ulcd, TXT_OPACITY, TXT_STATE_OPACITY, value != 0 ? 1 : 0, prev);
 }
 
 int
 ulcd_txt_set_attributes(struct ulcd_t *ulcd, param_t value, param_t *prev)
 {
-    int s = pack_uints(cmdbuf, 2, TXT_ATTRIBUTES, value);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, prev);
+    struct txt_state_t *txt = &ulcd->txt;
+    int s;
+
+    if (txt->attributes_known == TXT_ATTRIBUTES_ALL && txt->attributes == value) {
+        if (prev != NULL) {
+            *prev = value;
+        }
+        return ERROK;
+    }
+
+    s = pack_uints(ulcd->cmdbuf, 2, TXT_ATTRIBUTES, value);
+    if (ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s, prev)) {
+        txt->attributes_known = 0;
+        return ulcd->error;
+    }
+    txt->attributes = value;
+    txt->attributes_known = TXT_ATTRIBUTES_ALL;
+
+    return ERROK;
 }
 
 /**
- * Resets text parameters to sane values.
+ * Resets text parameters to sane values. Every parameter is sent, whatever
+ * the cache says.
  *
  * Not part of the official API.
  */
 int
 ulcd_txt_reset(struct ulcd_t *ulcd)
 {
+    ulcd_txt_invalidate(ulcd);
+
     if (ulcd_txt_set_attributes(ulcd, 0, NULL)) {
         return ulcd->error;
     }
@@ -175,5 +277,5 @@ ulcd_txt_reset(struct ulcd_t *ulcd)
     if (ulcd_txt_set_color_fg(ulcd, 0xffff, NULL)) {
         return ulcd->error;
     }
-    return ulcd->error;
+    return ERROK;
 }
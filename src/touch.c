@@ -3,9 +3,6 @@
 #include "ulcd43.h"
 #include "util.h"
 
-extern char cmdbuf[4096];
-extern char recvbuf[2];
-
 
 /**
  * Official API
@@ -14,22 +11,22 @@ extern char recvbuf[2];
 int
 ulcd_touch_set_detect_region(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2)
 {
-    int s = pack_uints(cmdbuf, 5, TOUCH_DETECT_REGION, p1->x, p1->y, p2->x, p2->y);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 5, TOUCH_DETECT_REGION, p1->x, p1->y, p2->x, p2->y);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_touch_set(struct ulcd_t *ulcd, param_t type)
 {
-    int s = pack_uints(cmdbuf, 2, TOUCH_SET, type);
-    return ulcd_send_recv_ack(ulcd, cmdbuf, s);
+    int s = pack_uints(ulcd->cmdbuf, 2, TOUCH_SET, type);
+    return ulcd_send_recv_ack(ulcd, ulcd->cmdbuf, s);
 }
 
 int
 ulcd_touch_get(struct ulcd_t *ulcd, param_t type, param_t *status)
 {
-    int s = pack_uints(cmdbuf, 2, TOUCH_GET, type);
-    return ulcd_send_recv_ack_word(ulcd, cmdbuf, s, status);
+    int s = pack_uints(ulcd->cmdbuf, 2, TOUCH_GET, type);
+    return ulcd_send_recv_ack_word(ulcd, ulcd->cmdbuf, s, status);
 }
 
 /**
@@ -51,7 +48,7 @@ ulcd_touch_disable(struct ulcd_t *ulcd)
 }
 
 /**
- * Disable the panel's touch mode.
+ * Reset the panel's touch mode.
  */
 int
 ulcd_touch_reset(struct ulcd_t *ulcd)
@@ -60,7 +57,26 @@ ulcd_touch_reset(struct ulcd_t *ulcd)
 }
 
 /**
- * Get a complete touch event with status, x and y coordinates.
+ * Ask for a touch value and wait for the reply, even when pipelining, as
+ * the next request depends on it.
+ */
+static int
+touch_get_now(struct ulcd_t *ulcd, param_t type, param_t *value)
+{
+    char buffer[2];
+    int s = pack_uints(ulcd->cmdbuf, 2, TOUCH_GET, type);
+
+    if (ulcd_send_recv_ack_data(ulcd, ulcd->cmdbuf, s, buffer, 2)) {
+        return ulcd->error;
+    }
+    unpack_uint(value, buffer);
+
+    return 0;
+}
+
+/**
+ * Get a complete touch event with status, x and y coordinates. Commands in
+ * flight are waited for first; not possible in asynchronous mode.
  *
  * Not part of the official API.
  */
@@ -68,14 +84,14 @@ int
 ulcd_touch_get_event(struct ulcd_t *ulcd, struct touch_event_t *ev)
 {
     int err;
-    if ((err = ulcd_touch_get(ulcd, TOUCH_GET_MODE_STATUS, &(ev->status)))) {
+    if ((err = touch_get_now(ulcd, TOUCH_GET_MODE_STATUS, &(ev->status)))) {
         return err;
     }
     if (ev->status != TOUCH_STATUS_NOTOUCH) {
-        if ((err = ulcd_touch_get(ulcd, TOUCH_GET_MODE_GET_X, &(ev->point.x)))) {
+        if ((err = touch_get_now(ulcd, TOUCH_GET_MODE_GET_X, &(ev->point.x)))) {
             return err;
         }
-        if ((err = ulcd_touch_get(ulcd, TOUCH_GET_MODE_GET_Y, &(ev->point.y)))) {
+        if ((err = touch_get_now(ulcd, TOUCH_GET_MODE_GET_Y, &(ev->point.y)))) {
             return err;
         }
     }
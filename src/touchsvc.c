@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+/**
+ * Touch service. The touch panel is polled every `interval' microseconds
+ * and touches are queued for the application, which reads them with
+ * ulcd_touch_service_read(), from any one thread.
+ *
+ * A poll shares the link with drawing. When a poll is due as a command is
+ * sent, it is slipped in ahead of the command: in pipelined and asynchronous
+ * mode its three TOUCH_GET commands are queued like any other, so that they
+ * wait behind what is in flight instead of draining it; otherwise the status
+ * is asked, and the coordinates too while the panel is touched. Commands
+ * sent by the service are reported to a pipeline callback like any other.
+ *
+ * With TOUCH_SERVICE_THREAD, a thread polls while the application is not
+ * using the link. Every command holds the link while it is sent and its
+ * reply is read, so the thread waits for at most one command, and never for
+ * a whole frame. A poll is thus at most `interval' plus the time of the
+ * longest command late, or of the commands ahead of it in the pipeline.
+ * Very large images should be sent in pieces for that to stay small.
+ *
+ * With TOUCH_SERVICE_EVENTFD, an event file descriptor becomes readable
+ * when touches are queued, for the application's event loop.
+ *
+ * Stop the service before resetting the device, changing the baud rate or
+ * closing the connection.
+ */
+
+/* Sleeps of the thread: it must not spin, and must stop quickly */
+#define TOUCH_SLEEP_MIN 1000
+#define TOUCH_SLEEP_MAX 100000
+
+/**
+ * Hold the link for a command. The lock is recursive, as commands send the
+ * text stream and touch polls first.
+ */
+void
+ulcd_link_lock(struct ulcd_t *ulcd)
+{
+    if (ulcd->touch != NULL) {
+        pthread_mutex_lock(&ulcd->touch->link);
+    }
+}
+
+void
+ulcd_link_unlock(struct ulcd_t *ulcd)
+{
+    if (ulcd->touch != NULL) {
+        pthread_mutex_unlock(&ulcd->touch->link);
+    }
+}
+
+/**
+ * Queue a touch event. Only called with the link held, so there is one
+ * producer at a time.
+ */
+static void
+service_push(struct touch_service_t *svc, param_t status, param_t x, param_t y)
+{
+    unsigned int head = svc->head;
+    unsigned long long one = 1;
+    struct touch_event_t *ev;
+
+    if (head - svc->tail == TOUCH_QUEUE_SIZE) {
+        ++(svc->dropped);
+        return;
+    }
+
+    ev = &svc->events[head % TOUCH_QUEUE_SIZE];
+    ev->status = status;
+    ev->point.x = x;
+    ev->point.y = y;
+
+    /* The event must be in place before the consumer can see it */
+    __sync_synchronize();
+    svc->head = head + 1;
+
+    if (svc->fd != -1 && write(svc->fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        ++(svc->dropped);
+    }
+}
+
+/**
+ * Account for a completed poll.
+ */
+static void
+service_done(struct touch_service_t *svc, param_t status, param_t x, param_t y)
+{
+    unsigned long long now = ulcd_now();
+
+    if (svc->last > 0 && now - svc->last > svc->max_gap) {
+        svc->max_gap = now - svc->last;
+    }
+    svc->last = now;
+    ++(svc->polls);
+
+    if (status != TOUCH_STATUS_NOTOUCH) {
+        service_push(svc, status, x, y);
+    }
+}
+
+/**
+ * Ask the display for a touch value and wait for the reply. Uses its own
+ * buffer, as the application's command may be waiting in the connection's.
+ */
+static int
+service_get(struct ulcd_t *ulcd, struct touch_service_t *svc, param_t mode, param_t *value)
+{
+    struct iovec iov;
+    char buffer[2];
+    int err;
+
+    iov.iov_base = svc->cmdbuf;
+    iov.iov_len = pack_uints(svc->cmdbuf, 2, TOUCH_GET, mode);
+    ulcd->call_timeout = svc->call_timeout;
+
+    if ((err = ulcd_send_recv(ulcd, &iov, 1, buffer, 2)) == ERROK) {
+        unpack_uint(value, buffer);
+    }
+
+    return err;
+}
+
+/**
+ * Poll the panel and wait for the answer. Only possible with no commands in
+ * flight.
+ */
+static int
+service_poll(struct ulcd_t *ulcd, struct touch_service_t *svc)
+{
+    param_t status, x = 0, y = 0;
+
+    if (service_get(ulcd, svc, TOUCH_GET_MODE_STATUS, &status)) {
+        return ulcd->error;
+    }
+    if (status != TOUCH_STATUS_NOTOUCH &&
+        (service_get(ulcd, svc, TOUCH_GET_MODE_GET_X, &x) ||
+         service_get(ulcd, svc, TOUCH_GET_MODE_GET_Y, &y))) {
+        return ulcd->error;
+    }
+
+    service_done(svc, status, x, y);
+
+    return ERROK;
+}
+
+/**
+ * Queue a poll behind the commands in flight. The answer is collected by
+ * ulcd_touch_service_complete(). Skipped in asynchronous mode unless the
+ * queue has room for it and the command that is being sent.
+ */
+static int
+service_queue(struct ulcd_t *ulcd, struct touch_service_t *svc)
+{
+    struct pipeline_t *p = &ulcd->pipeline;
+    param_t modes[3] = { TOUCH_GET_MODE_STATUS, TOUCH_GET_MODE_GET_X, TOUCH_GET_MODE_GET_Y };
+    int i, s;
+
+    s = pack_uints(svc->cmdbuf, 2, TOUCH_GET, modes[0]);
+    if (p->async && (p->count + 3 >= PIPELINE_DEPTH_MAX || p->txend - p->txstart + 3 * s > TXBUFSIZE)) {
+        return ERROK;
+    }
+
+    /* Collected with the last of them, which may complete before it is queued */
+    svc->seq = p->seq + 3;
+    svc->polling = 1;
+
+    for (i = 0; i < 3; i++) {
+        pack_uints(svc->cmdbuf, 2, TOUCH_GET, modes[i]);
+        ulcd->call_timeout = svc->call_timeout;
+        if (ulcd_io_submit(ulcd, svc->cmdbuf, s, NULL, 0, 2, &svc->value[i])) {
+            if (p->seq < svc->seq) {
+                svc->polling = 0;
+            }
+            return ulcd->error;
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * Called with the link held before a command is sent, to poll first if a
+ * poll is due. `queue' tells whether the command goes through the command
+ * queue, so that the poll can be queued ahead of it. A timeout set for the
+ * command applies to the poll's commands too, and is kept for it.
+ */
+int
+ulcd_touch_service_before(struct ulcd_t *ulcd, int queue)
+{
+    struct touch_service_t *svc = ulcd->touch;
+    unsigned long long now;
+    int err;
+
+    if (svc == NULL || svc->busy || svc->polling) {
+        return ERROK;
+    }
+
+    now = ulcd_now();
+    if (now < svc->due) {
+        return ERROK;
+    }
+    if (ulcd->pipeline.count > 0 && !queue) {
+        /* Replies in flight would be taken for the poll's */
+        return ERROK;
+    }
+
+    svc->due = now + svc->interval;
+    svc->busy = 1;
+    svc->call_timeout = ulcd->call_timeout;
+    err = ulcd->pipeline.count > 0 || (queue && ulcd->pipeline.async) ?
+        service_queue(ulcd, svc) : service_poll(ulcd, svc);
+    ulcd->call_timeout = svc->call_timeout;
+    svc->busy = 0;
+
+    return err;
+}
+
+/**
+ * Called as a queued command completes, to collect a queued poll.
+ */
+void
+ulcd_touch_service_complete(struct ulcd_t *ulcd, unsigned long seq, int error)
+{
+    struct touch_service_t *svc = ulcd->touch;
+
+    if (svc == NULL || !svc->polling || seq != svc->seq) {
+        return;
+    }
+
+    svc->polling = 0;
+    if (error == ERROK) {
+        service_done(svc, svc->value[0], svc->value[1], svc->value[2]);
+    }
+}
+
+/**
+ * Called when queued commands are forgotten without completing.
+ */
+void
+ulcd_touch_service_discard(struct ulcd_t *ulcd)
+{
+    if (ulcd->touch != NULL) {
+        ulcd->touch->polling = 0;
+    }
+}
+
+static void *
+service_thread(void *arg)
+{
+    struct ulcd_t *ulcd = arg;
+    struct touch_service_t *svc = ulcd->touch;
+    unsigned long long now, wait;
+    struct timespec ts;
+
+    while (svc->running) {
+        ulcd_link_lock(ulcd);
+        if (ulcd->pipeline.count == 0) {
+            ulcd_touch_service_before(ulcd, 0);
+        }
+        /* With commands in flight, the application polls as it sends more */
+        now = ulcd_now();
+        wait = svc->due > now ? svc->due - now : svc->interval;
+        ulcd_link_unlock(ulcd);
+
+        if (wait < TOUCH_SLEEP_MIN) {
+            wait = TOUCH_SLEEP_MIN;
+        } else if (wait > TOUCH_SLEEP_MAX) {
+            wait = TOUCH_SLEEP_MAX;
+        }
+        ts.tv_sec = 0;
+        ts.tv_nsec = wait * 1000;
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start polling the touch panel every `interval' microseconds, optionally
+ * from a thread of its own and with an event file descriptor, see above.
+ * The panel must have been initialized with ulcd_touch_init().
+ */
+int
+ulcd_touch_service_start(struct ulcd_t *ulcd, unsigned long interval, int flags)
+{
+    struct touch_service_t *svc;
+    pthread_mutexattr_t attr;
+
+    if (ulcd->touch != NULL) {
+        return ulcd_error(ulcd, ERRBUSY, "Touch service is already running");
+    }
+
+    svc = malloc(sizeof(struct touch_service_t));
+    memset(svc, 0, sizeof(struct touch_service_t));
+    svc->interval = interval;
+    svc->fd = -1;
+
+    if (flags & TOUCH_SERVICE_EVENTFD) {
+#ifdef HAVE_SYS_EVENTFD_H
+        svc->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        errno = ENOSYS;
+#endif
+        if (svc->fd == -1) {
+            free(svc);
+            return ulcd_error(ulcd, ERRREAD, "Unable to create event file descriptor: %s", strerror(errno));
+        }
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&svc->link, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ulcd->touch = svc;
+
+    if (flags & TOUCH_SERVICE_THREAD) {
+        svc->running = 1;
+        svc->threaded = 1;
+        if (pthread_create(&svc->thread, NULL, service_thread, ulcd)) {
+            svc->running = 0;
+            svc->threaded = 0;
+            ulcd_touch_service_stop(ulcd);
+            return ulcd_error(ulcd, ERRBUSY, "Unable to start touch service thread");
+        }
+    }
+
+    return ERROK;
+}
+
+/**
+ * Stop polling. Waits for a poll that is in flight, and for the commands
+ * queued ahead of it. Touches not read yet are lost.
+ */
+int
+ulcd_touch_service_stop(struct ulcd_t *ulcd)
+{
+    struct touch_service_t *svc = ulcd->touch;
+
+    if (svc == NULL) {
+        return ERROK;
+    }
+
+    if (svc->threaded) {
+        svc->running = 0;
+        pthread_join(svc->thread, NULL);
+    }
+
+    /* Replies are stored in the service */
+    while (svc->polling && ulcd->pipeline.count > 0) {
+        ulcd_io_wait(ulcd);
+    }
+
+    ulcd->touch = NULL;
+    if (svc->fd != -1) {
+        close(svc->fd);
+    }
+    pthread_mutex_destroy(&svc->link);
+    free(svc);
+
+    return ERROK;
+}
+
+/**
+ * Take the oldest touch from the queue. Returns 1 if there was one, 0 if the
+ * queue is empty. The event file descriptor is cleared when the queue is
+ * found empty, so read until then each time it becomes readable.
+ */
+int
+ulcd_touch_service_read(struct ulcd_t *ulcd, struct touch_event_t *ev)
+{
+    struct touch_service_t *svc = ulcd->touch;
+    unsigned long long count;
+    unsigned int tail;
+
+    if (svc == NULL) {
+        return 0;
+    }
+
+    tail = svc->tail;
+    if (tail == svc->head && svc->fd != -1) {
+        /* Look again after clearing, in case a touch was queued meanwhile */
+        while (read(svc->fd, &count, sizeof(count)) == -1 && errno == EINTR);
+    }
+    if (tail == svc->head) {
+        return 0;
+    }
+
+    /* Read the event only once the producer has published it */
+    __sync_synchronize();
+    *ev = svc->events[tail % TOUCH_QUEUE_SIZE];
+    __sync_synchronize();
+    svc->tail = tail + 1;
+
+    return 1;
+}
+
+/**
+ * Returns the event file descriptor, or -1 if there is none.
+ */
+int
+ulcd_touch_service_fd(struct ulcd_t *ulcd)
+{
+    return ulcd->touch != NULL ? ulcd->touch->fd : -1;
+}
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulcd43.h"
+#include "util.h"
+
+/**
+ * Wire trace. Every chunk of data written to or read from a device is
+ * recorded, with a timestamp, in a process wide ring buffer. The oldest
+ * records are overwritten when the ring is full, so tracing can be left on
+ * and the ring dumped after something went wrong.
+ *
+ * Recording is lock-free: a writer claims a slot by incrementing the head,
+ * and publishes the record by storing its sequence number last. A reader
+ * takes a record as valid only if the sequence number is the same before
+ * and after copying it.
+ */
+
+#define TRACE_MAGIC "ULCDTRC1"
+
+struct trace_ring_t {
+    int enabled;
+    unsigned long size;
+    unsigned long head;
+    struct trace_record_t *records;
+};
+
+static struct trace_ring_t ring;
+
+#ifdef SERIAL_DEBUG
+static void
+ulcd_trace_atexit(void)
+{
+    ulcd_trace_dump(stderr);
+}
+
+static void __attribute__((constructor))
+ulcd_trace_init(void)
+{
+    ulcd_trace_enable(TRACE_RING_SIZE);
+    atexit(ulcd_trace_atexit);
+}
+#endif
+
+
+/**
+ * Start recording into a ring of at least `size' records. The ring is
+ * allocated on first use and keeps its size afterwards.
+ */
+int
+ulcd_trace_enable(unsigned long size)
+{
+    struct trace_record_t *records;
+    unsigned long n = 1;
+
+    if (ring.records == NULL) {
+        while (n < size) {
+            n <<= 1;
+        }
+        records = malloc(sizeof(struct trace_record_t) * n);
+        if (records == NULL) {
+            return ERRUNKNOWN;
+        }
+        memset(records, 0, sizeof(struct trace_record_t) * n);
+        ring.size = n;
+        __atomic_store_n(&ring.records, records, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&ring.enabled, 1, __ATOMIC_RELEASE);
+
+    return ERROK;
+}
+
+/**
+ * Stop recording. The records are kept for dumping.
+ */
+void
+ulcd_trace_disable(void)
+{
+    __atomic_store_n(&ring.enabled, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record data sent to or received from the device. Only the first
+ * TRACE_DATA_SIZE bytes are kept.
+ */
+void
+ulcd_trace(struct ulcd_t *ulcd, int type, const char *data, int size)
+{
+    struct trace_record_t *r;
+    unsigned long pos;
+
+    if (!__atomic_load_n(&ring.enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pos = __atomic_fetch_add(&ring.head, 1, __ATOMIC_RELAXED);
+    r = &ring.records[pos & (ring.size - 1)];
+
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->time = ulcd_now();
+    r->fd = ulcd->fd;
+    r->type = type;
+    r->size = size;
+    r->len = size < TRACE_DATA_SIZE ? size : TRACE_DATA_SIZE;
+    memcpy(r->data, data, r->len);
+
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record the start of a command, given its header.
+ */
+void
+ulcd_trace_command(struct ulcd_t *ulcd, const char *data)
+{
+    ulcd_trace(ulcd, TRACE_CMD, data, 2);
+}
+
+/**
+ * Copy up to `max' of the most recent records to `records', oldest first.
+ * Records that are being written while copying are skipped. Returns the
+ * number of records copied.
+ */
+unsigned long
+ulcd_trace_snapshot(struct trace_record_t *records, unsigned long max)
+{
+    struct trace_record_t *r;
+    unsigned long head, pos, seq;
+    unsigned long n = 0;
+
+    if (__atomic_load_n(&ring.records, __ATOMIC_ACQUIRE) == NULL) {
+        return 0;
+    }
+
+    head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    if (max > ring.size) {
+        max = ring.size;
+    }
+    pos = head > max ? head - max : 0;
+
+    for (; pos < head; pos++) {
+        r = &ring.records[pos & (ring.size - 1)];
+        seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        if (seq != pos + 1) {
+            continue;
+        }
+        memcpy(&records[n], r, sizeof(struct trace_record_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        ++n;
+    }
+
+    return n;
+}
+
+/**
+ * Save the contents of the ring to a file, for decoding with ulcd-trace.
+ */
+int
+ulcd_trace_save(const char *path)
+{
+    struct trace_record_t *records;
+    unsigned long num;
+    FILE *f;
+    int err = ERROK;
+
+    records = malloc(sizeof(struct trace_record_t) * (ring.size ? ring.size : 1));
+    num = ulcd_trace_snapshot(records, ring.size);
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        free(records);
+        return ERRUNKNOWN;
+    }
+    if (fwrite(TRACE_MAGIC, 8, 1, f) != 1 ||
+        (num > 0 && fwrite(records, sizeof(struct trace_record_t), num, f) != num)) {
+        err = ERRWRITE;
+    }
+    if (fclose(f)) {
+        err = ERRWRITE;
+    }
+
+    free(records);
+
+    return err;
+}
+
+/**
+ * Load records saved with ulcd_trace_save(). The records are allocated and
+ * must be freed by the caller.
+ */
+int
+ulcd_trace_load(const char *path, struct trace_record_t **records, unsigned long *num)
+{
+    struct trace_record_t r;
+    char magic[8];
+    unsigned long size = 0;
+    FILE *f;
+
+    *records = NULL;
+    *num = 0;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return ERRREAD;
+    }
+    if (fread(magic, 8, 1, f) != 1 || memcmp(magic, TRACE_MAGIC, 8)) {
+        fclose(f);
+        return ERRREAD;
+    }
+
+    while (fread(&r, sizeof(struct trace_record_t), 1, f) == 1) {
+        if (*num == size) {
+            size += 1024;
+            *records = realloc(*records, sizeof(struct trace_record_t) * size);
+        }
+        memcpy(&(*records)[(*num)++], &r, sizeof(struct trace_record_t));
+    }
+
+    fclose(f);
+
+    return ERROK;
+}
+
+/**
+ * Print records in readable form. Times are relative to the first record.
+ */
+void
+ulcd_trace_print(FILE *f, const struct trace_record_t *records, unsigned long num)
+{
+    const struct trace_record_t *r;
+    param_t opcode;
+    unsigned long i;
+    int j;
+
+    for (i = 0; i < num; i++) {
+        r = &records[i];
+        fprintf(f, "%12.6f  fd %-3d ", (r->time - records[0].time) / 1000000.0, r->fd);
+
+        switch (r->type) {
+        case TRACE_CMD:
+            unpack_uint(&opcode, r->data);
+            fprintf(f, "CMD  %04x %s\n", opcode, ulcd_opcode_name(opcode));
+            continue;
+        case TRACE_TX:
+            fprintf(f, "TX  ");
+            break;
+        case TRACE_RX:
+            fprintf(f, "RX  ");
+            break;
+        default:
+            fprintf(f, "?   ");
+            break;
+        }
+
+        for (j = 0; j < r->len; j++) {
+            fprintf(f, " %02x", (unsigned char)r->data[j]);
+        }
+        if (r->size > r->len) {
+            fprintf(f, " ... (%d bytes)", r->size);
+        }
+        fprintf(f, "\n");
+    }
+}
+
+/**
+ * Print the contents of the ring.
+ */
+void
+ulcd_trace_dump(FILE *f)
+{
+    struct trace_record_t *records;
+    unsigned long num;
+
+    if (ring.size == 0) {
+        return;
+    }
+
+    records = malloc(sizeof(struct trace_record_t) * ring.size);
+    num = ulcd_trace_snapshot(records, ring.size);
+    ulcd_trace_print(f, records, num);
+    free(records);
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "ulcd43.h"
+
+/**
+ * Run a device emulator until interrupted, for use with programs that take a
+ * serial device path.
+ *
+ * Usage: ulcd-emulator [-b baud_rate] [-c command_cost_usec] [-m max_baud_rate]
+ */
+
+static volatile int running = 1;
+
+static void
+stop(int sig)
+{
+    running = 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct ulcd_emu_t *emu;
+    int opt;
+
+    emu = ulcd_emu_new();
+
+    while ((opt = getopt(argc, argv, "b:c:m:")) != -1) {
+        switch (opt) {
+        case 'b':
+            emu->baud_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            emu->cmd_cost = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            emu->max_baud_rate = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b baud_rate] [-c command_cost_usec] [-m max_baud_rate]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (ulcd_emu_start(emu)) {
+        fprintf(stderr, "Unable to create pseudo-terminal.\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    printf("%s\n", emu->device);
+    fflush(stdout);
+
+    while (running) {
+        pause();
+    }
+
+    fprintf(stderr, "%lu commands, %lu NAKs\n", emu->commands, emu->naks);
+    ulcd_emu_free(emu);
+
+    return EXIT_SUCCESS;
+}
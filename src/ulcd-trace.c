@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ulcd43.h"
+
+/**
+ * Print a wire trace saved with ulcd_trace_save(), with opcode names.
+ *
+ * Usage: ulcd-trace file
+ */
+int
+main(int argc, char **argv)
+{
+    struct trace_record_t *records;
+    unsigned long num;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (ulcd_trace_load(argv[1], &records, &num)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    ulcd_trace_print(stdout, records, num);
+    free(records);
+
+    return EXIT_SUCCESS;
+}
@@ -1,7 +1,24 @@
 #ifndef _ULCD43_H_
 #define _ULCD43_H_
 
+#include <stdio.h>
+#include <pthread.h>
+
 #define STRBUFSIZE 1024
+#define CMDBUFSIZE 4096
+
+/**
+ * Pipelining: maximum number of commands in flight, and the default number of
+ * unacknowledged bytes allowed to sit in the device's serial input buffer.
+ */
+#define PIPELINE_DEPTH_MAX 64
+#define PIPELINE_BUFSIZE 128
+#define TXBUFSIZE CMDBUFSIZE
+
+/**
+ * Size of the per-connection receive buffer
+ */
+#define RXBUFSIZE 256
 
 /**
  * Errors
@@ -15,6 +32,47 @@
 #define ERRREAD 5
 #define ERRWRITE 6
 #define ERRTIMEOUT 7
+#define ERRBUSY 8
+#define ERRASYNC 9
+#define ERRCANCELED 10
+#define ERRRANGE 11
+
+/**
+ * Pixel formats, for ulcd_image_bitblt_convert(). PIXEL_RGB565 is big
+ * endian, as the display takes it; the others are in memory byte order, with
+ * red first. PIXEL_DITHER may be added to the 24 and 32 bit formats.
+ */
+
+#define PIXEL_RGB565 0
+#define PIXEL_RGB565_LE 1
+#define PIXEL_RGB888 2
+#define PIXEL_RGBA8888 3
+#define PIXEL_DITHER 0x100
+
+/**
+ * Flags returned by ulcd_io_wants()
+ */
+
+#define IO_WANT_READ 1
+#define IO_WANT_WRITE 2
+
+/**
+ * Wire trace record types, and the amount of data kept per record
+ */
+
+#define TRACE_CMD 1
+#define TRACE_TX 2
+#define TRACE_RX 3
+#define TRACE_DATA_SIZE 64
+#define TRACE_RING_SIZE 4096
+
+/**
+ * Latency histograms are log-linear: each power of two is split into
+ * 2^STATS_SUB_BITS buckets, which bounds the error to 1/8 of the value.
+ */
+
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS ((33 - STATS_SUB_BITS) << STATS_SUB_BITS)
 
 /*********
  * Types *
@@ -23,6 +81,124 @@
 typedef unsigned int color_t;
 typedef unsigned int param_t;
 
+struct ulcd_t;
+
+/**
+ * Called once for every pipelined command, in submission order, when its reply
+ * has been read. `value' holds the returned word for commands that have one.
+ */
+typedef void (*reply_cb_t)(struct ulcd_t *ulcd, unsigned long seq, param_t opcode, int error, param_t value, void *arg);
+
+/**
+ * Fills `buffer' with the next `size' bytes of a streamed image. Returns the
+ * number of bytes written; anything short of `size' aborts the image.
+ */
+typedef int (*pixel_source_t)(struct ulcd_t *ulcd, char *buffer, int size, void *arg);
+
+/**
+ * Called as a long operation advances. Returns non-zero to cancel it.
+ */
+typedef int (*progress_cb_t)(struct ulcd_t *ulcd, unsigned long done, unsigned long total, void *arg);
+
+/**
+ * A queued command. The command header is stored in the transmit buffer; the
+ * payload, if any, is sent straight from the caller's memory. `reply' is the
+ * number of bytes that follow the ACK.
+ */
+struct pending_cmd_t {
+    unsigned long seq;
+    param_t opcode;
+    int size;
+    const char *payload;
+    int psize;
+    int reply;
+    param_t *result;
+    unsigned long timeout;
+    unsigned long long started;
+    unsigned long long deadline;
+};
+
+/**
+ * Commands queued when pipelining is enabled. The queue is a ring buffer
+ * starting at `head'; the first `sent' commands have been written and are
+ * waiting for a reply, the rest are waiting for room in the window. A window
+ * of zero means pipelining is disabled.
+ */
+struct pipeline_t {
+    int window;
+    int async;
+    int max_bytes;
+    int head;
+    int count;
+    int sent;
+    int bytes;
+    int txoff;
+    int txstart;
+    int txend;
+    int rxlen;
+    char rxword[2];
+    unsigned long seq;
+    int error;
+    reply_cb_t callback;
+    void *arg;
+    struct pending_cmd_t queue[PIPELINE_DEPTH_MAX];
+    char txbuf[TXBUFSIZE];
+};
+
+/**
+ * Text settings known to be in effect on the display, see text.c. A value
+ * is only used while its bit in `valid' is set; the bold, italic, inverse
+ * and underline bits of the attributes are known separately.
+ */
+#define TXT_STATE_FG 0
+#define TXT_STATE_BG 1
+#define TXT_STATE_FONT 2
+#define TXT_STATE_WIDTH 3
+#define TXT_STATE_HEIGHT 4
+#define TXT_STATE_XGAP 5
+#define TXT_STATE_YGAP 6
+#define TXT_STATE_OPACITY 7
+#define TXT_STATE_MAX 8
+
+struct txt_state_t {
+    param_t value[TXT_STATE_MAX];
+    unsigned int valid;
+    param_t attributes;
+    param_t attributes_known;
+};
+
+/**
+ * Width and height of each character of a font at a size, see metrics.c.
+ * `known' holds METRIC_WIDTH and METRIC_HEIGHT bits per character.
+ */
+#define METRIC_WIDTH 1
+#define METRIC_HEIGHT 2
+
+struct font_metrics_t {
+    param_t font;
+    param_t xmul;
+    param_t ymul;
+    param_t width[256];
+    param_t height[256];
+    unsigned char known[256];
+    struct font_metrics_t *next;
+};
+
+/**
+ * Characters collected by the text stream, see stream.c. `buffer' holds a
+ * PUT_STR command, with the characters after the opcode.
+ */
+#define TXT_PUTSTR_MAX 511
+
+struct txt_stream_t {
+    int enabled;
+    int len;
+    int threshold;
+    unsigned long delay;
+    unsigned long long since;
+    char buffer[2 + TXT_PUTSTR_MAX + 1];
+};
+
 /**
  * Connection object
  */
@@ -35,8 +211,83 @@ struct ulcd_t {
     int baud_const;
     unsigned long baud_rate;
     unsigned long timeout;
+    unsigned long call_timeout;
+    unsigned long long deadline;
     int error;
     char err[STRBUFSIZE];
+    char cmdbuf[CMDBUFSIZE];
+    char rxbuf[RXBUFSIZE];
+    int rxpos;
+    int rxend;
+    struct pipeline_t pipeline;
+    param_t page_display;
+    param_t page_read;
+    param_t page_write;
+    int in_frame;
+    int clipping;
+    param_t clip[4];
+    struct txt_state_t txt;
+    struct font_metrics_t *metrics;
+    struct txt_stream_t stream;
+    struct touch_service_t *touch;
+    unsigned long long tx_bytes;
+    unsigned long long rx_bytes;
+    unsigned long read_calls;
+    unsigned long write_calls;
+    unsigned long poll_calls;
+    struct opcode_stats_t *stats;
+};
+
+/**
+ * Per-display statistics of a display group
+ */
+struct group_stats_t {
+    int queued;
+    int in_flight;
+    unsigned long completed;
+    unsigned long errors;
+    double rate;
+};
+
+struct group_member_t {
+    struct ulcd_t *ulcd;
+    int wants;
+    reply_cb_t callback;
+    void *arg;
+    struct group_stats_t stats;
+    unsigned long sampled;
+    unsigned long long sampled_at;
+    struct group_member_t *next;
+};
+
+/**
+ * Counters for one opcode on one connection. Latencies are in microseconds,
+ * measured from writing the command to receiving the complete reply.
+ */
+struct opcode_stats_t {
+    param_t opcode;
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long naks;
+    unsigned long timeouts;
+    unsigned long long tx_bytes;
+    unsigned long long rx_bytes;
+    unsigned long long latency_sum;
+    unsigned long long latency_max;
+    unsigned long histogram[STATS_BUCKETS];
+};
+
+/**
+ * Many connections driven from one thread
+ */
+struct ulcd_group_t {
+    int epfd;
+    int num;
+    int size;
+    int next;
+    struct group_member_t **members;
+    int dispatching;
+    struct group_member_t *removed;
 };
 
 struct point_t {
@@ -49,15 +300,223 @@ struct polygon_t {
     struct point_t **points;
 };
 
+/**
+ * A memory mapped image file. `stride' is the distance between rows in
+ * bytes.
+ */
+struct asset_t {
+    const char *pixels;
+    size_t size;
+    param_t width;
+    param_t height;
+    int stride;
+};
+
+/**
+ * Host-side copy of the screen, in the byte order of the display. `rects'
+ * and `bytes' describe the last update.
+ */
+struct shadow_t {
+    param_t width;
+    param_t height;
+    char *pixels;
+    int valid;
+    unsigned long rects;
+    unsigned long bytes;
+};
+
+/**
+ * An image held in off-screen display memory by a sprite cache. It is
+ * known by the address of its pixels and its size.
+ */
+struct sprite_t {
+    const char *pixels;
+    param_t width;
+    param_t height;
+    param_t page;
+    param_t x;
+    param_t y;
+    int shelf;
+    unsigned long used;
+};
+
+/**
+ * A row of sprites of at most `height' pixels, filled from the left.
+ */
+struct shelf_t {
+    param_t page;
+    param_t y;
+    param_t height;
+    param_t x;
+    unsigned long used;
+};
+
+/**
+ * Off-screen pages used to keep sprites on the display. `hits', `misses'
+ * and `evictions' count since the cache was created.
+ */
+struct sprite_cache_t {
+    param_t first_page;
+    param_t pages;
+    param_t width;
+    param_t height;
+    struct sprite_t *sprites;
+    int nsprites;
+    int max_sprites;
+    struct shelf_t *shelves;
+    int nshelves;
+    int max_shelves;
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+/**
+ * A character cell of a terminal. `attributes' holds TXT_ATTRIBUTE_BOLD and
+ * TXT_ATTRIBUTE_UNDERLINED; inverse video is applied to the colours.
+ */
+struct term_cell_t {
+    char c;
+    unsigned char attributes;
+    unsigned short fg;
+    unsigned short bg;
+};
+
+/**
+ * A terminal drawn in a box of `cols' x `rows' character cells at `origin',
+ * see term.c. `cells' holds what is wanted and `shown' what the display
+ * shows; `scroll' counts the lines scrolled since the last refresh.
+ */
+#define TERM_PARAMS_MAX 8
+
+struct term_t {
+    struct point_t origin;
+    param_t cols;
+    param_t rows;
+    param_t cell_width;
+    param_t cell_height;
+    struct term_cell_t *cells;
+    struct term_cell_t *shown;
+    int valid;
+    int scroll;
+    int cx;
+    int cy;
+    struct term_cell_t pen;
+    int inverse;
+    int state;
+    int params[TERM_PARAMS_MAX];
+    int nparams;
+};
+
 struct touch_event_t {
     param_t status;
     struct point_t point;
 };
 
+/**
+ * Touch service, see touchsvc.c. Events go from whichever thread polled to
+ * the application through a single-producer single-consumer ring of
+ * TOUCH_QUEUE_SIZE entries, a power of two.
+ */
+#define TOUCH_QUEUE_SIZE 64
+#define TOUCH_SERVICE_THREAD 1
+#define TOUCH_SERVICE_EVENTFD 2
+
+struct touch_service_t {
+    unsigned long interval;
+    unsigned long long due;
+    unsigned long long last;
+    unsigned long long max_gap;
+    int busy;
+    unsigned long call_timeout;
+    int polling;
+    unsigned long seq;
+    param_t value[3];
+    char cmdbuf[8];
+    struct touch_event_t events[TOUCH_QUEUE_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    unsigned long polls;
+    unsigned long dropped;
+    int fd;
+    volatile int running;
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t link;
+};
+
+/**
+ * Wire format of a command, see opcodes.c
+ */
+#define OPARG_NONE 0
+#define OPARG_STRING 1
+#define OPARG_CHAR 2
+#define OPARG_POLY 3
+#define OPARG_PIXELS 4
+#define REPLY_STRING -1
+
+struct opcode_t {
+    param_t opcode;
+    const char *name;
+    int args;
+    int extra;
+    int reply;
+    unsigned long allowance;
+};
+
+/**
+ * Wire trace record. `size' is the length of the traced data, of which the
+ * first `len' bytes are kept.
+ */
+struct trace_record_t {
+    unsigned long seq;
+    unsigned long long time;
+    int fd;
+    int type;
+    int size;
+    int len;
+    char data[TRACE_DATA_SIZE];
+};
+
+/**
+ * PTY-backed device emulator
+ */
+#define EMU_WIDTH 480
+#define EMU_HEIGHT 272
+#define EMU_PAGES 4
+
+struct ulcd_emu_t {
+    int master;
+    int slave;
+    char device[STRBUFSIZE];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    volatile int running;
+    unsigned long baud_rate;
+    unsigned long max_baud_rate;
+    int baud_index;
+    unsigned long cmd_cost;
+    unsigned long commands;
+    unsigned long naks;
+    unsigned short *fb;
+    int page_display;
+    int page_read;
+    int page_write;
+    int clipping;
+    int clip[4];
+    int origin[2];
+    param_t regs[256];
+    struct touch_event_t touch;
+    unsigned long long rx_end;
+    unsigned long long busy_until;
+};
+
 struct baudtable_t {
     int index;
     long baud_rate;
     int baud_const;
+    long line_rate;
 };
 
 
@@ -70,11 +529,59 @@ struct ulcd_t * ulcd_new(void);
 void ulcd_free(struct ulcd_t *ulcd);
 int ulcd_open_serial_device(struct ulcd_t *ulcd);
 void ulcd_set_serial_parameters(struct ulcd_t *ulcd);
+void ulcd_set_call_timeout(struct ulcd_t *ulcd, unsigned long usec);
 struct polygon_t * ulcd_make_polygon(int args, ...);
 void ulcd_free_polygon(struct polygon_t *poly);
 int ulcd_error(struct ulcd_t *ulcd, int error, const char *err, ...);
 int ulcd_reset(struct ulcd_t *ulcd);
 
+/* io.c */
+int ulcd_pipeline_begin(struct ulcd_t *ulcd, int window, reply_cb_t callback, void *arg);
+int ulcd_pipeline_flush(struct ulcd_t *ulcd);
+int ulcd_pipeline_end(struct ulcd_t *ulcd);
+int ulcd_async_begin(struct ulcd_t *ulcd, int window, reply_cb_t callback, void *arg);
+int ulcd_async_end(struct ulcd_t *ulcd);
+int ulcd_io_wants(struct ulcd_t *ulcd);
+int ulcd_io_timeout(struct ulcd_t *ulcd);
+int ulcd_io_wait(struct ulcd_t *ulcd);
+int ulcd_process_io(struct ulcd_t *ulcd);
+
+/* group.c */
+struct ulcd_group_t * ulcd_group_new(void);
+void ulcd_group_free(struct ulcd_group_t *group);
+int ulcd_group_add(struct ulcd_group_t *group, struct ulcd_t *ulcd, int window, reply_cb_t callback, void *arg);
+struct ulcd_t * ulcd_group_remove(struct ulcd_group_t *group, int index);
+struct ulcd_t * ulcd_group_get(struct ulcd_group_t *group, int index);
+int ulcd_group_process(struct ulcd_group_t *group, int timeout);
+int ulcd_group_stats(struct ulcd_group_t *group, int index, struct group_stats_t *stats);
+
+/* emulator.c */
+struct ulcd_emu_t * ulcd_emu_new(void);
+int ulcd_emu_start(struct ulcd_emu_t *emu);
+void ulcd_emu_stop(struct ulcd_emu_t *emu);
+void ulcd_emu_free(struct ulcd_emu_t *emu);
+color_t ulcd_emu_pixel(struct ulcd_emu_t *emu, int page, int x, int y);
+void ulcd_emu_touch(struct ulcd_emu_t *emu, param_t status, param_t x, param_t y);
+
+/* trace.c */
+int ulcd_trace_enable(unsigned long size);
+void ulcd_trace_disable(void);
+unsigned long ulcd_trace_snapshot(struct trace_record_t *records, unsigned long max);
+int ulcd_trace_save(const char *path);
+int ulcd_trace_load(const char *path, struct trace_record_t **records, unsigned long *num);
+void ulcd_trace_print(FILE *f, const struct trace_record_t *records, unsigned long num);
+void ulcd_trace_dump(FILE *f);
+
+/* stats.c */
+int ulcd_get_stats(struct ulcd_t *ulcd, const struct opcode_stats_t **stats);
+void ulcd_stats_reset(struct ulcd_t *ulcd);
+unsigned long long ulcd_stats_percentile(const struct opcode_stats_t *stats, double percentile);
+void ulcd_stats_prometheus(FILE *f, struct ulcd_t **displays, int num);
+
+/* opcodes.c */
+const struct opcode_t * ulcd_opcode_lookup(param_t opcode);
+const char * ulcd_opcode_name(param_t opcode);
+
 /* text.c */
 int ulcd_move_cursor(struct ulcd_t *ulcd, param_t line, param_t column);
 int ulcd_txt_putch(struct ulcd_t *ulcd, char c);
@@ -95,13 +602,23 @@ int ulcd_txt_set_underline(struct ulcd_t *ulcd, param_t value, param_t *prev);
 int ulcd_txt_set_opacity(struct ulcd_t *ulcd, param_t value, param_t *prev);
 int ulcd_txt_set_attributes(struct ulcd_t *ulcd, param_t value, param_t *prev);
 int ulcd_txt_reset(struct ulcd_t *ulcd);
+void ulcd_txt_invalidate(struct ulcd_t *ulcd);
 
 /* touch.c */
 int ulcd_touch_set_detect_region(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2);
 int ulcd_touch_set(struct ulcd_t *ulcd, param_t type);
+int ulcd_touch_init(struct ulcd_t *ulcd);
+int ulcd_touch_disable(struct ulcd_t *ulcd);
+int ulcd_touch_reset(struct ulcd_t *ulcd);
 int ulcd_touch_get(struct ulcd_t *ulcd, param_t type, param_t *status);
 int ulcd_touch_get_event(struct ulcd_t *ulcd, struct touch_event_t *ev);
 
+/* touchsvc.c */
+int ulcd_touch_service_start(struct ulcd_t *ulcd, unsigned long interval, int flags);
+int ulcd_touch_service_stop(struct ulcd_t *ulcd);
+int ulcd_touch_service_read(struct ulcd_t *ulcd, struct touch_event_t *ev);
+int ulcd_touch_service_fd(struct ulcd_t *ulcd);
+
 /* display.c */
 int ulcd_gfx_cls(struct ulcd_t *ulcd);
 int ulcd_gfx_rectangle(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2, color_t color);
@@ -109,15 +626,85 @@ int ulcd_gfx_filled_rectangle(struct ulcd_t *ulcd, struct point_t *p1, struct po
 int ulcd_gfx_circle(struct ulcd_t *ulcd, struct point_t *point, param_t radius, color_t color);
 int ulcd_gfx_filled_circle(struct ulcd_t *ulcd, struct point_t *point, param_t radius, color_t color);
 int ulcd_gfx_polygon(struct ulcd_t *ulcd, struct polygon_t *poly, color_t color);
+int ulcd_gfx_filled_polygon(struct ulcd_t *ulcd, struct polygon_t *poly, color_t color);
 int ulcd_gfx_contrast(struct ulcd_t *ulcd, param_t contrast);
+int ulcd_gfx_move_to(struct ulcd_t *ulcd, struct point_t *point);
+int ulcd_gfx_clipping(struct ulcd_t *ulcd, int on);
+int ulcd_gfx_clip_window(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2);
+int ulcd_gfx_screen_copy_paste(struct ulcd_t *ulcd, struct point_t *src, struct point_t *dest, param_t width, param_t height);
+int ulcd_gfx_set(struct ulcd_t *ulcd, param_t function, param_t value);
+int ulcd_gfx_set_page_display(struct ulcd_t *ulcd, param_t page);
+int ulcd_gfx_set_page_read(struct ulcd_t *ulcd, param_t page);
+int ulcd_gfx_set_page_write(struct ulcd_t *ulcd, param_t page);
 int ulcd_display_on(struct ulcd_t *ulcd);
 int ulcd_display_off(struct ulcd_t *ulcd);
 
 /* image.c */
 int ulcd_image_bitblt(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height, const char *buffer);
+int ulcd_image_bitblt_rect(struct ulcd_t *ulcd, struct point_t *point, const char *base, int stride, param_t x, param_t y, param_t width, param_t height);
+struct asset_t * ulcd_asset_open(const char *path, param_t width);
+void ulcd_asset_close(struct asset_t *asset);
+int ulcd_asset_blit(struct ulcd_t *ulcd, struct point_t *point, const struct asset_t *asset, param_t x, param_t y, param_t width, param_t height);
+int ulcd_image_bitblt_stream(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height, pixel_source_t source, progress_cb_t progress, void *arg);
+int ulcd_image_bitblt_fd(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height, int fd, progress_cb_t progress, void *arg);
+
+/* frame.c */
+int ulcd_frame_begin(struct ulcd_t *ulcd);
+int ulcd_frame_end(struct ulcd_t *ulcd);
+
+/* metrics.c */
+void ulcd_txt_metrics_clear(struct ulcd_t *ulcd);
+int ulcd_txt_metrics_probe(struct ulcd_t *ulcd);
+int ulcd_txt_metrics_save(struct ulcd_t *ulcd, const char *path);
+int ulcd_txt_metrics_load(struct ulcd_t *ulcd, const char *path);
+int ulcd_txt_measure(struct ulcd_t *ulcd, const char *str, param_t *width, param_t *height);
+
+/* layout.c */
+int ulcd_txt_layout(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2, const char *str, int flags, param_t *height);
+
+/* stream.c */
+int ulcd_txt_stream_begin(struct ulcd_t *ulcd, int threshold, unsigned long delay);
+int ulcd_txt_stream_end(struct ulcd_t *ulcd);
+int ulcd_txt_stream_putch(struct ulcd_t *ulcd, char c);
+int ulcd_txt_stream_write(struct ulcd_t *ulcd, const char *data, int size);
+int ulcd_txt_stream_flush(struct ulcd_t *ulcd);
+int ulcd_txt_stream_poll(struct ulcd_t *ulcd);
+int ulcd_txt_stream_timeout(struct ulcd_t *ulcd);
+
+/* term.c */
+struct term_t * ulcd_term_new(struct point_t *origin, param_t cols, param_t rows);
+void ulcd_term_free(struct term_t *term);
+void ulcd_term_invalidate(struct term_t *term);
+void ulcd_term_write(struct term_t *term, const char *data, int size);
+int ulcd_term_refresh(struct ulcd_t *ulcd, struct term_t *term);
+
+/* scroll.c */
+int ulcd_gfx_scroll(struct ulcd_t *ulcd, struct point_t *p1, struct point_t *p2, int dy, color_t background);
+
+/* sprite.c */
+struct sprite_cache_t * ulcd_sprite_cache_new(param_t first_page, param_t pages, param_t width, param_t height);
+void ulcd_sprite_cache_free(struct sprite_cache_t *cache);
+void ulcd_sprite_cache_clear(struct sprite_cache_t *cache);
+void ulcd_sprite_forget(struct sprite_cache_t *cache, const char *pixels);
+int ulcd_sprite_draw(struct ulcd_t *ulcd, struct sprite_cache_t *cache, struct point_t *point, const char *pixels, int stride, param_t width, param_t height);
+
+/* encode.c */
+int ulcd_image_encode(struct ulcd_t *ulcd, struct point_t *point, const char *base, int stride, param_t x, param_t y, param_t width, param_t height);
+
+/* pixel.c */
+int ulcd_pixel_size(int format);
+void ulcd_pixels_convert(char *dest, const void *src, int count, int format, int x, int y);
+int ulcd_image_bitblt_convert(struct ulcd_t *ulcd, struct point_t *point, param_t width, param_t height, const void *pixels, int stride, int format);
+
+/* shadow.c */
+struct shadow_t * ulcd_shadow_new(param_t width, param_t height);
+void ulcd_shadow_free(struct shadow_t *shadow);
+void ulcd_shadow_invalidate(struct shadow_t *shadow);
+int ulcd_shadow_update(struct ulcd_t *ulcd, struct shadow_t *shadow, const char *frame);
 
 /* serial.c */
 int ulcd_set_baud_rate(struct ulcd_t *ulcd, long baud_rate);
+int ulcd_negotiate_baud_rate(struct ulcd_t *ulcd, long max_rate);
 
 /* system.c */
 int ulcd_get_display_model(struct ulcd_t *ulcd);
@@ -161,6 +748,14 @@ int ulcd_get_info(struct ulcd_t *ulcd);
 #define TXT_ATTRIBUTE_ITALIC (1 << 5)
 #define TXT_ATTRIBUTE_INVERSE (1 << 6)
 #define TXT_ATTRIBUTE_UNDERLINED (1 << 7)
+#define TXT_ATTRIBUTES_ALL 0xffff
+
+/* Text layout, see layout.c */
+#define TXT_LAYOUT_LEFT 0
+#define TXT_LAYOUT_CENTER 1
+#define TXT_LAYOUT_RIGHT 2
+#define TXT_LAYOUT_WRAP (1 << 2)
+#define TXT_LAYOUT_CLIP (1 << 3)
 
 /*
 ################################
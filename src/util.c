@@ -4,18 +4,27 @@
 #include <fcntl.h>   /* File control definitions */
 #include <errno.h>   /* Error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
+#include <poll.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <assert.h>
 
 #include "config.h"
 #include "ulcd43.h"
+#include "util.h"
 
 /**
- * Global send and receive buffer
+ * Most buffers passed to a single writev() call.
  */
-char cmdbuf[4096];
-char recvbuf[2];
+#define SENDV_BATCH 64
+
+/**
+ * Time between the end of one command and the start of the next, in
+ * microseconds, when replies are waited for.
+ */
+#define TURNAROUND_TIME 1000
 
 
 /**
@@ -129,18 +138,16 @@ ulcd_free_polygon(struct polygon_t *poly)
     free(poly);
 }
 
+
 /**
- * Debug function
+ * Monotonic time in microseconds.
  */
-void
-print_hex(const char *buffer, int size)
+unsigned long long
+ulcd_now(void)
 {
-    int i = 0;
-    fprintf(stderr, "%d bytes: ", size);
-    for (i = 0; i < size; i++) {
-        fprintf(stderr, "0x%x ", buffer[i]);
-    }
-    fprintf(stderr, "\n");
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 
@@ -156,7 +163,9 @@ ulcd_new(void)
     ulcd->fd = -1;
     ulcd->baud_rate = 9600;
     ulcd->baud_const = B9600;
-    ulcd->timeout = 500000;
+    ulcd->timeout = 100000;
+    ulcd->pipeline.max_bytes = PIPELINE_BUFSIZE;
+    ulcd_stats_reset(ulcd);
     return ulcd;
 }
 
@@ -167,9 +176,12 @@ ulcd_new(void)
 void
 ulcd_free(struct ulcd_t *ulcd)
 {
+    ulcd_touch_service_stop(ulcd);
     if (ulcd->fd != -1) {
         close(ulcd->fd);
     }
+    ulcd_txt_metrics_clear(ulcd);
+    free(ulcd->stats);
     free(ulcd);
 }
 
@@ -208,6 +220,7 @@ ulcd_open_serial_device(struct ulcd_t *ulcd)
     }
 
     ulcd_set_serial_parameters(ulcd);
+    ulcd_txt_invalidate(ulcd);
 
 #ifdef HAVE_SERIAL_BUG
     return ulcd_reset(ulcd);
@@ -227,10 +240,6 @@ ulcd_set_serial_parameters(struct ulcd_t *ulcd)
 
     tcgetattr(ulcd->fd, &options);
 
-    /* Set baud rate */
-    cfsetispeed(&options, ulcd->baud_const);
-    cfsetospeed(&options, ulcd->baud_const);
-
     /* 8N1 */
     options.c_cflag &= ~(PARENB | PARODD | CSTOPB | CSIZE);
     options.c_cflag |= (CS8 | CREAD | CLOCAL);
@@ -247,79 +256,245 @@ ulcd_set_serial_parameters(struct ulcd_t *ulcd)
     /* Raw output */
     options.c_oflag &= ~OPOST;
 
-    /* Timeout handled by select() */
+    /* Timeout handled by poll() */
     options.c_cc[VMIN] = 0;
     options.c_cc[VTIME] = 0;
 
     tcsetattr(ulcd->fd, TCSANOW, &options);
+
+    ulcd_set_host_baud_rate(ulcd, 0);
+}
+
+/**
+ * Returns how long a command may take, in microseconds: the time it takes to
+ * move `bytes' over the serial link, the processing allowance of the opcode,
+ * and the connection timeout as a safety margin.
+ */
+unsigned long long
+ulcd_budget(struct ulcd_t *ulcd, param_t opcode, unsigned long bytes)
+{
+    const struct opcode_t *op = ulcd_opcode_lookup(opcode);
+    unsigned long long budget = ulcd->timeout;
+
+    budget += bytes * 10ULL * 1000000 / ulcd->baud_rate;
+    if (op != NULL) {
+        budget += op->allowance;
+    }
+
+    return budget;
 }
 
-static int
-ulcd_read_select(struct ulcd_t *ulcd, void *buf, size_t count)
+/**
+ * Returns what a command costs beyond its own bytes, in bytes: the ACK, and
+ * unless commands are pipelined, the time the device takes to turn a command
+ * around, expressed in bytes at the current baud rate. Used to decide
+ * between fewer, larger commands and more, smaller ones.
+ */
+unsigned long
+ulcd_command_overhead(struct ulcd_t *ulcd)
 {
-    fd_set set;
-    struct timeval timeout;
+    unsigned long overhead = 1;
+
+    if (ulcd->pipeline.window == 0) {
+        overhead += (unsigned long long)ulcd->baud_rate * TURNAROUND_TIME / 10000000;
+    }
+
+    return overhead;
+}
+
+/**
+ * Give the next command `usec' microseconds to complete, instead of the time
+ * computed from its size and opcode.
+ */
+void
+ulcd_set_call_timeout(struct ulcd_t *ulcd, unsigned long usec)
+{
+    ulcd->call_timeout = usec;
+}
+
+/**
+ * Wait until the device is ready for reading or writing, as given by
+ * `events'. While a command is running, waits until its deadline at most;
+ * otherwise, for the connection timeout.
+ */
+int
+ulcd_poll(struct ulcd_t *ulcd, short events)
+{
+    struct pollfd pfd;
+    unsigned long long now;
+    int timeout;
     int retval;
 
-    FD_ZERO(&set);
-    FD_SET(ulcd->fd, &set);
+    pfd.fd = ulcd->fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    do {
+        if (ulcd->deadline == 0) {
+            timeout = (ulcd->timeout + 999) / 1000;
+        } else if ((now = ulcd_now()) >= ulcd->deadline) {
+            timeout = 0;
+        } else {
+            timeout = (ulcd->deadline - now + 999) / 1000;
+        }
+        ++(ulcd->poll_calls);
+        retval = poll(&pfd, 1, timeout);
+    } while (retval == -1 && errno == EINTR);
+
+    if (retval == 0) {
+        return ulcd_error(ulcd, ERRTIMEOUT, "Timed out while waiting for device");
+    } else if (retval == -1) {
+        return ulcd_error(ulcd, ERRREAD, "Unable to poll device: %s", strerror(errno));
+    }
 
-    timeout.tv_sec = 0;
-    timeout.tv_usec = ulcd->timeout;
+    return ERROK;
+}
 
-    retval = select(FD_SETSIZE, &set, NULL, NULL, &timeout);
+/**
+ * Read as much as the device has sent, up to the free space in the receive
+ * buffer. Returns the number of bytes read, 0 if nothing was available, or
+ * -1 on error.
+ */
+ssize_t
+ulcd_rx_fill(struct ulcd_t *ulcd)
+{
+    ssize_t retval;
+
+    if (ulcd->rxpos == ulcd->rxend) {
+        ulcd->rxpos = ulcd->rxend = 0;
+    } else if (ulcd->rxend == RXBUFSIZE) {
+        memmove(ulcd->rxbuf, ulcd->rxbuf + ulcd->rxpos, ulcd->rxend - ulcd->rxpos);
+        ulcd->rxend -= ulcd->rxpos;
+        ulcd->rxpos = 0;
+    }
 
-    if (retval == 1) {
-        return read(ulcd->fd, buf, count);
-    } else if (retval == 0) {
-        ulcd_error(ulcd, ERRTIMEOUT, "Timed out while reading data from device");
-    } else {
+    ++(ulcd->read_calls);
+    retval = read(ulcd->fd, ulcd->rxbuf + ulcd->rxend, RXBUFSIZE - ulcd->rxend);
+    if (retval == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    } else if (retval == -1) {
         ulcd_error(ulcd, ERRREAD, "Unable to read data from device: %s", strerror(errno));
+        return -1;
     }
 
+    ulcd_trace(ulcd, TRACE_RX, ulcd->rxbuf + ulcd->rxend, retval);
+    ulcd->rx_bytes += retval;
+    ulcd->rxend += retval;
+
     return retval;
 }
 
+/**
+ * Take up to `count' received bytes, waiting for the device if none have
+ * been buffered yet.
+ */
+static ssize_t
+ulcd_read_poll(struct ulcd_t *ulcd, void *buf, size_t count)
+{
+    size_t avail;
+
+    if (ulcd->rxpos == ulcd->rxend) {
+        if (ulcd_poll(ulcd, POLLIN) || ulcd_rx_fill(ulcd) < 0) {
+            return -1;
+        }
+    }
+
+    avail = ulcd->rxend - ulcd->rxpos;
+    if (count > avail) {
+        count = avail;
+    }
+    memcpy(buf, ulcd->rxbuf + ulcd->rxpos, count);
+    ulcd->rxpos += count;
+
+    return count;
+}
+
 int
 ulcd_send(struct ulcd_t *ulcd, const char *data, int size)
 {
-    size_t total = 0;
-    size_t sent;
-    while (total < size) {
-        sent = write(ulcd->fd, data+total, size-total);
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+
+    return ulcd_sendv(ulcd, &iov, 1);
+}
+
+/**
+ * Send data gathered from a number of buffers, with as few write calls as
+ * possible.
+ */
+int
+ulcd_sendv(struct ulcd_t *ulcd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec v[SENDV_BATCH];
+    size_t skip = 0;
+    size_t len;
+    ssize_t sent;
+    int i, n;
+
+    while (1) {
+        while (iovcnt > 0 && iov->iov_len == skip) {
+            ++iov;
+            --iovcnt;
+            skip = 0;
+        }
+        if (iovcnt == 0) {
+            return ERROK;
+        }
+
+        n = iovcnt < SENDV_BATCH ? iovcnt : SENDV_BATCH;
+        for (i = 0; i < n; i++) {
+            v[i] = iov[i];
+        }
+        v[0].iov_base = (char *)v[0].iov_base + skip;
+        v[0].iov_len -= skip;
+
+        ++(ulcd->write_calls);
+        sent = writev(ulcd->fd, v, n);
+        if (sent == -1 && errno == EAGAIN) {
+            if (ulcd_poll(ulcd, POLLOUT)) {
+                return ulcd->error;
+            }
+            continue;
+        }
         if (sent <= 0) {
             return ulcd_error(ulcd, ERRWRITE, "Unable to send data to device: %s", strerror(errno));
         }
-        total += sent;
-    }
-
-#ifdef SERIAL_DEBUG
-    fprintf(stderr, "send: ");
-    print_hex(data, size);
-#endif
+        ulcd->tx_bytes += sent;
 
-    return ERROK;
+        /* Trace what was sent of each buffer, and skip past it */
+        while (sent > 0) {
+            len = iov->iov_len - skip;
+            if (len > (size_t)sent) {
+                len = sent;
+            }
+            ulcd_trace(ulcd, TRACE_TX, (const char *)iov->iov_base + skip, len);
+            sent -= len;
+            skip += len;
+            if (skip == iov->iov_len) {
+                ++iov;
+                --iovcnt;
+                skip = 0;
+            }
+        }
+    }
 }
 
 int
 ulcd_recv(struct ulcd_t *ulcd, void *buffer, int size)
 {
-    size_t bytes_read;
+    ssize_t bytes_read;
     size_t total = 0;
 
     while(total < size) {
-        bytes_read = ulcd_read_select(ulcd, buffer+total, size-total);
-        if (bytes_read <= 0) {
+        bytes_read = ulcd_read_poll(ulcd, buffer+total, size-total);
+        if (bytes_read < 0) {
             return ulcd->error;
         }
         total += bytes_read;
     }
 
-#ifdef SERIAL_DEBUG
-    fprintf(stderr, "recv: ");
-    print_hex(buffer, size);
-#endif
-
     return ERROK;
 }
 
@@ -328,7 +503,6 @@ int
 ulcd_recv_ack(struct ulcd_t *ulcd)
 {
     char r;
-    size_t bytes_read;
 
     if (ulcd_recv(ulcd, &r, 1)) {
         return ulcd->error;
@@ -343,42 +517,131 @@ ulcd_recv_ack(struct ulcd_t *ulcd)
     return ulcd_error(ulcd, ERRUNKNOWN, "Device sent unknown reply `%x' instead of ACK", r);
 }
 
+/**
+ * Run a command synchronously: send the header in iov[0] and the payload in
+ * the rest, wait for the ACK and read `datasize' bytes of reply data. The
+ * whole exchange must complete before one deadline, which is computed from
+ * the amount of data and the opcode. The outcome is added to the statistics
+ * of the opcode.
+ */
 int
-ulcd_send_recv_ack(struct ulcd_t *ulcd, const char *data, int size)
+ulcd_send_recv(struct ulcd_t *ulcd, const struct iovec *iov, int iovcnt, void *buffer, int datasize)
 {
-    if (ulcd_send(ulcd, data, size)) {
+    unsigned long long start, tx, rx;
+    unsigned long bytes = 0;
+    ssize_t bytes_read;
+    size_t total = 0;
+    param_t opcode;
+    int err;
+    int i;
+
+    ulcd_link_lock(ulcd);
+
+    if (ulcd_txt_stream_before(ulcd) || ulcd_touch_service_before(ulcd, 0)) {
+        ulcd_link_unlock(ulcd);
         return ulcd->error;
     }
-    if (ulcd_recv_ack(ulcd)) {
-        return ulcd->error;
+
+    start = ulcd_now();
+    tx = ulcd->tx_bytes;
+    rx = ulcd->rx_bytes;
+    unpack_uint(&opcode, iov[0].iov_base);
+
+    for (i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
     }
-    return ERROK;
+
+    if (ulcd->call_timeout > 0) {
+        ulcd->deadline = start + ulcd->call_timeout;
+        ulcd->call_timeout = 0;
+    } else {
+        ulcd->deadline = start + ulcd_budget(ulcd, opcode, bytes + 1 + datasize);
+    }
+
+    ulcd_trace_command(ulcd, iov[0].iov_base);
+
+    err = ulcd_sendv(ulcd, iov, iovcnt);
+    if (err == ERROK) {
+        err = ulcd_recv_ack(ulcd);
+    }
+
+    while (err == ERROK && total < datasize) {
+        bytes_read = ulcd_read_poll(ulcd, buffer+total, datasize-total);
+        if (bytes_read < 0) {
+            err = ulcd->error;
+        } else {
+            total += bytes_read;
+        }
+    }
+
+    ulcd->deadline = 0;
+    ulcd_stats_record(ulcd, opcode, start, ulcd->tx_bytes - tx, ulcd->rx_bytes - rx, err);
+
+    ulcd_link_unlock(ulcd);
+
+    return err;
 }
 
 int
-ulcd_send_recv_ack_data(struct ulcd_t *ulcd, const char *data, int size, void *buffer, int datasize)
+ulcd_send_recv_ack_payload(struct ulcd_t *ulcd, const char *data, int size, const char *payload, int psize)
 {
-    size_t bytes_read;
-    size_t total = 0;
-   
-    if (ulcd_send_recv_ack(ulcd, data, size)) {
-        return ulcd->error;
+    struct iovec iov[2];
+
+    if (ulcd->pipeline.window > 0) {
+        return ulcd_io_submit(ulcd, data, size, payload, psize, 0, NULL);
     }
 
-    while(total < datasize) {
-        bytes_read = ulcd_read_select(ulcd, buffer+total, datasize-total);
-        if (bytes_read <= 0) {
-            return ulcd->error;
-        }
-        total += bytes_read;
+    iov[0].iov_base = (void *)data;
+    iov[0].iov_len = size;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = psize;
+
+    return ulcd_send_recv(ulcd, iov, 2, NULL, 0);
+}
+
+/**
+ * Send a command whose payload is gathered from a number of buffers; iov[0]
+ * holds the header. The command queue has no room for such a payload, so
+ * the pipeline is flushed first. This is not possible in asynchronous mode.
+ */
+int
+ulcd_send_recv_ack_iov(struct ulcd_t *ulcd, const struct iovec *iov, int iovcnt)
+{
+    if (ulcd->pipeline.async) {
+        return ulcd_error(ulcd, ERRASYNC, "Gathered payloads are not supported in asynchronous mode");
     }
 
-#ifdef SERIAL_DEBUG
-    fprintf(stderr, "recv: ");
-    print_hex(buffer, datasize);
-#endif
+    ulcd_pipeline_drain(ulcd);
 
-    return ERROK;
+    return ulcd_send_recv(ulcd, iov, iovcnt, NULL, 0);
+}
+
+int
+ulcd_send_recv_ack(struct ulcd_t *ulcd, const char *data, int size)
+{
+    return ulcd_send_recv_ack_payload(ulcd, data, size, NULL, 0);
+}
+
+/**
+ * Send a command and read an arbitrary amount of data after the ACK. The
+ * caller needs the data right away, so the pipeline is flushed first. This
+ * is not possible in asynchronous mode.
+ */
+int
+ulcd_send_recv_ack_data(struct ulcd_t *ulcd, const char *data, int size, void *buffer, int datasize)
+{
+    struct iovec iov;
+
+    if (ulcd->pipeline.async) {
+        return ulcd_error(ulcd, ERRASYNC, "Command needs a synchronous reply");
+    }
+
+    ulcd_pipeline_drain(ulcd);
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+
+    return ulcd_send_recv(ulcd, &iov, 1, buffer, datasize);
 }
 
 int
@@ -386,6 +649,10 @@ ulcd_send_recv_ack_word(struct ulcd_t *ulcd, const char *data, int size, param_t
 {
     char buffer[2];
 
+    if (ulcd->pipeline.window > 0) {
+        return ulcd_io_submit(ulcd, data, size, NULL, 0, 2, param);
+    }
+
     if (ulcd_send_recv_ack_data(ulcd, data, size, buffer, 2)) {
         return ulcd->error;
     }
@@ -410,6 +677,10 @@ ulcd_reset(struct ulcd_t *ulcd)
     char rbuf[STRBUFSIZE];
     int pos = 0;
 
+    /* Replies to commands in flight are lost, and the device may be new */
+    ulcd_io_discard(ulcd);
+    ulcd_txt_invalidate(ulcd);
+
     timeout = ulcd->timeout;
     ulcd->timeout = 10000;
 
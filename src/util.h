@@ -1,6 +1,9 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "ulcd43.h"
 
 /* Utility functions */
@@ -8,11 +11,67 @@ inline int pack_uint(char *dest, param_t src);
 inline void unpack_uint(param_t *dest, const char *src);
 inline int pack_uints(char *buffer, int args, ...);
 inline int pack_polygon(char *dest, struct polygon_t *poly);
-void print_hex(const char *buffer, int size);
 
 /* Send and receive */
+unsigned long long ulcd_now(void);
+unsigned long long ulcd_budget(struct ulcd_t *ulcd, param_t opcode, unsigned long bytes);
+unsigned long ulcd_command_overhead(struct ulcd_t *ulcd);
+int ulcd_poll(struct ulcd_t *ulcd, short events);
+ssize_t ulcd_rx_fill(struct ulcd_t *ulcd);
+int ulcd_send(struct ulcd_t *ulcd, const char *data, int size);
+int ulcd_sendv(struct ulcd_t *ulcd, const struct iovec *iov, int iovcnt);
+int ulcd_recv(struct ulcd_t *ulcd, void *buffer, int size);
 int ulcd_recv_ack(struct ulcd_t *ulcd);
+int ulcd_send_recv(struct ulcd_t *ulcd, const struct iovec *iov, int iovcnt, void *buffer, int datasize);
 int ulcd_send_recv_ack(struct ulcd_t *ulcd, const char *data, int size);
+int ulcd_send_recv_ack_payload(struct ulcd_t *ulcd, const char *data, int size, const char *payload, int psize);
+int ulcd_send_recv_ack_iov(struct ulcd_t *ulcd, const struct iovec *iov, int iovcnt);
 int ulcd_send_recv_ack_data(struct ulcd_t *ulcd, const char *data, int size, void *buffer, int datasize);
+int ulcd_send_recv_ack_word(struct ulcd_t *ulcd, const char *data, int size, param_t *param);
+
+/* Rectangles, with exclusive ends */
+struct rect_t {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+int ulcd_rects_merge(struct rect_t *rects, int n, unsigned long overhead);
+
+/* Text stream */
+int ulcd_txt_stream_before(struct ulcd_t *ulcd);
+
+/* Touch service */
+void ulcd_link_lock(struct ulcd_t *ulcd);
+void ulcd_link_unlock(struct ulcd_t *ulcd);
+int ulcd_touch_service_before(struct ulcd_t *ulcd, int queue);
+void ulcd_touch_service_complete(struct ulcd_t *ulcd, unsigned long seq, int error);
+void ulcd_touch_service_discard(struct ulcd_t *ulcd);
+
+/* Font metrics */
+struct font_metrics_t * ulcd_metrics_current(struct ulcd_t *ulcd);
+
+/* Baud rates */
+const struct baudtable_t * ulcd_baud_lookup(long baud_rate);
+int ulcd_set_host_baud_rate(struct ulcd_t *ulcd, int drain);
+int ulcd_set_custom_baud_rate(int fd, unsigned long rate, int drain);
+
+/* Wire trace */
+void ulcd_trace(struct ulcd_t *ulcd, int type, const char *data, int size);
+void ulcd_trace_command(struct ulcd_t *ulcd, const char *data);
+
+/* Statistics */
+void ulcd_stats_record(struct ulcd_t *ulcd, param_t opcode, unsigned long long start, unsigned long tx, unsigned long rx, int error);
+
+/* Opcode table */
+extern struct opcode_t opcode_table[];
+int ulcd_opcode_count(void);
+int ulcd_opcode_index(param_t opcode);
+
+/* Command queue */
+int ulcd_io_submit(struct ulcd_t *ulcd, const char *data, int size, const char *payload, int psize, int reply, param_t *result);
+void ulcd_io_discard(struct ulcd_t *ulcd);
+void ulcd_pipeline_drain(struct ulcd_t *ulcd);
 
 #endif /* #ifndef _UTIL_H_ */
@@ -1,16 +1,34 @@
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
 #include <check.h>
 #include "../src/util.h"
 #include "../src/ulcd43.h"
 
 struct ulcd_t *ulcd;
+struct ulcd_emu_t *emu;
 
+/**
+ * Tests run against the device emulator, unless a real device is given in
+ * the ULCD_DEVICE environment variable.
+ */
 void
 setup(void)
 {
+    const char *device = getenv("ULCD_DEVICE");
+
     ulcd = ulcd_new();
     ulcd_set_baud_rate(ulcd, 115200);
-    strcpy(ulcd->device, "/dev/ttyAMA0");
+
+    if (device == NULL) {
+        emu = ulcd_emu_new();
+        if (ulcd_emu_start(emu)) {
+            ck_abort_msg("Could not start emulator.");
+        }
+        device = emu->device;
+    }
+    strcpy(ulcd->device, device);
 
     if (ulcd_open_serial_device(ulcd)) {
         ck_abort_msg("Could not open serial port.");
@@ -22,6 +40,10 @@ void
 teardown(void)
 {
     ulcd_free(ulcd);
+    if (emu != NULL) {
+        ulcd_emu_free(emu);
+        emu = NULL;
+    }
 }
 
 
@@ -86,6 +108,365 @@ START_TEST (test_pack_polygon)
 }
 END_TEST
 
+START_TEST (test_trace)
+{
+    struct trace_record_t records[16];
+    struct trace_record_t *loaded;
+    unsigned long i, n, num;
+    int cmd = -1, tx = -1, rx = -1;
+    param_t opcode;
+    char path[] = "/tmp/check_ulcd_trace.XXXXXX";
+
+    ck_assert_int_eq(ERROK, ulcd_trace_enable(16));
+    ck_assert_int_eq(ERROK, ulcd_get_spe_version(ulcd));
+    ulcd_trace_disable();
+
+    n = ulcd_trace_snapshot(records, 16);
+    ck_assert(n >= 3);
+
+    for (i = 0; i < n; i++) {
+        if (records[i].fd != ulcd->fd) {
+            continue;
+        }
+        if (records[i].type == TRACE_CMD) {
+            cmd = i;
+        } else if (records[i].type == TRACE_TX) {
+            tx = i;
+        } else if (records[i].type == TRACE_RX && rx == -1 && cmd >= 0) {
+            rx = i;
+        }
+    }
+
+    ck_assert(cmd >= 0 && cmd < tx && tx < rx);
+    unpack_uint(&opcode, records[cmd].data);
+    ck_assert_int_eq(GET_SPE_VERSION, opcode);
+    ck_assert_int_eq(ACK, records[rx].data[0]);
+
+    close(mkstemp(path));
+    ck_assert_int_eq(ERROK, ulcd_trace_save(path));
+    ck_assert_int_eq(ERROK, ulcd_trace_load(path, &loaded, &num));
+    unlink(path);
+    ck_assert_int_eq(n, num);
+    ck_assert(!memcmp(records, loaded, sizeof(struct trace_record_t) * n));
+    free(loaded);
+}
+END_TEST
+
+START_TEST (test_rx_readahead)
+{
+    unsigned long reads;
+    int i;
+
+    /* ACK and reply word arrive together, and are picked up with one read */
+    reads = ulcd->read_calls;
+    for (i = 0; i < 10; i++) {
+        ck_assert_int_eq(ERROK, ulcd_get_spe_version(ulcd));
+    }
+    ck_assert(ulcd->read_calls - reads < 20);
+    ck_assert_int_eq(ulcd->rxpos, ulcd->rxend);
+}
+END_TEST
+
+START_TEST (test_pixels_convert)
+{
+    unsigned char rgba[19 * 4];
+    unsigned char le[19 * 2];
+    char out[19 * 2];
+    char one[2];
+    int i;
+
+    for (i = 0; i < 19; i++) {
+        rgba[i * 4] = i & 1 ? 0xff : 0x00;
+        rgba[i * 4 + 1] = i & 2 ? 0xff : 0x00;
+        rgba[i * 4 + 2] = i & 4 ? 0xff : 0x00;
+        rgba[i * 4 + 3] = 0xff;
+        le[i * 2] = i;
+        le[i * 2 + 1] = 0x80 | i;
+    }
+
+    /* Vector and scalar code must agree, so convert one pixel at a time too */
+    ulcd_pixels_convert(out, rgba, 19, PIXEL_RGBA8888, 0, 0);
+    ck_assert_int_eq(0xf8, (unsigned char)out[2]);
+    ck_assert_int_eq(0x00, (unsigned char)out[3]);
+    ck_assert_int_eq(0x07, (unsigned char)out[4]);
+    ck_assert_int_eq(0xe0, (unsigned char)out[5]);
+    ck_assert_int_eq(0x00, (unsigned char)out[8]);
+    ck_assert_int_eq(0x1f, (unsigned char)out[9]);
+    for (i = 0; i < 19; i++) {
+        ulcd_pixels_convert(one, rgba + i * 4, 1, PIXEL_RGBA8888, i, 0);
+        ck_assert(!memcmp(one, out + i * 2, 2));
+    }
+
+    ulcd_pixels_convert(out, le, 19, PIXEL_RGB565_LE, 0, 0);
+    for (i = 0; i < 19; i++) {
+        ck_assert_int_eq(0x80 | i, (unsigned char)out[i * 2]);
+        ck_assert_int_eq(i, (unsigned char)out[i * 2 + 1]);
+    }
+
+    /* Dark grey only shows up where the dither pattern is high */
+    for (i = 0; i < 19; i++) {
+        rgba[i * 4] = rgba[i * 4 + 1] = rgba[i * 4 + 2] = 4;
+    }
+    ulcd_pixels_convert(out, rgba, 19, PIXEL_RGBA8888 | PIXEL_DITHER, 0, 1);
+    for (i = 0; i < 19; i++) {
+        ulcd_pixels_convert(one, rgba + i * 4, 1, PIXEL_RGB888 | PIXEL_DITHER, i, 1);
+        ck_assert(!memcmp(one, out + i * 2, 2));
+    }
+    ck_assert_int_eq(0x00, (unsigned char)out[2 * 1]);
+    ck_assert_int_eq(0x08, (unsigned char)out[2 * 2]);
+}
+END_TEST
+
+START_TEST (test_stats)
+{
+    const struct opcode_stats_t *stats;
+    struct point_t p = {100, 100};
+    char cmd[4];
+    char line[STRBUFSIZE];
+    int i, n, found = 0;
+    FILE *f;
+
+    ulcd_stats_reset(ulcd);
+
+    for (i = 0; i < 5; i++) {
+        ck_assert_int_eq(ERROK, ulcd_get_spe_version(ulcd));
+    }
+    ck_assert_int_eq(ERROK, ulcd_pipeline_begin(ulcd, 4, NULL, NULL));
+    for (i = 0; i < 3; i++) {
+        ulcd_gfx_circle(ulcd, &p, 10, 0xffff);
+    }
+    ck_assert_int_eq(ERROK, ulcd_pipeline_end(ulcd));
+    if (emu != NULL) {
+        ulcd_send_recv_ack_word(ulcd, cmd, pack_uints(cmd, 2, CONTRAST, 16), NULL);
+    }
+
+    n = ulcd_get_stats(ulcd, &stats);
+    for (i = 0; i < n; i++) {
+        if (stats[i].opcode == GET_SPE_VERSION) {
+            ck_assert_int_eq(5, stats[i].calls);
+            ck_assert_int_eq(0, stats[i].errors);
+            ck_assert_int_eq(10, stats[i].tx_bytes);
+            ck_assert_int_eq(15, stats[i].rx_bytes);
+            ck_assert(ulcd_stats_percentile(&stats[i], 50) <= ulcd_stats_percentile(&stats[i], 99.9));
+            ck_assert(ulcd_stats_percentile(&stats[i], 99.9) <= stats[i].latency_max);
+            ++found;
+        } else if (stats[i].opcode == CIRCLE) {
+            ck_assert_int_eq(3, stats[i].calls);
+            ck_assert_int_eq(30, stats[i].tx_bytes);
+            ck_assert_int_eq(3, stats[i].rx_bytes);
+            ++found;
+        } else if (stats[i].opcode == CONTRAST && emu != NULL) {
+            ck_assert_int_eq(1, stats[i].naks);
+            ck_assert_int_eq(1, stats[i].errors);
+        }
+    }
+    ck_assert_int_eq(2, found);
+
+    f = tmpfile();
+    ulcd_stats_prometheus(f, &ulcd, 1);
+    rewind(f);
+    found = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strstr(line, "ulcd_commands_total{") && strstr(line, "opcode=\"GET_SPE_VERSION\"} 5")) {
+            ++found;
+        }
+        if (strstr(line, "ulcd_command_latency_seconds_count{") && strstr(line, "opcode=\"CIRCLE\"} 3")) {
+            ++found;
+        }
+    }
+    fclose(f);
+    ck_assert_int_eq(2, found);
+}
+END_TEST
+
+
+/**
+ * Pipeline test case
+ */
+
+START_TEST (test_pipeline_draw)
+{
+    struct point_t p1;
+    param_t i;
+
+    ck_assert_int_eq(0, ulcd_pipeline_begin(ulcd, 8, NULL, NULL));
+    for (i = 0; i < 32; i++) {
+        p1.x = 100 + i; p1.y = 100;
+        ck_assert_int_eq(0, ulcd_gfx_circle(ulcd, &p1, 50, 0xffff));
+    }
+    ck_assert_int_eq(0, ulcd_pipeline_end(ulcd));
+    ck_assert_int_eq(0, ulcd->pipeline.count);
+}
+END_TEST
+
+START_TEST (test_pipeline_word)
+{
+    color_t prev1, prev2;
+
+    ck_assert_int_eq(0, ulcd_pipeline_begin(ulcd, 4, NULL, NULL));
+    ck_assert_int_eq(0, ulcd_txt_set_color_fg(ulcd, 0x1234, &prev1));
+    ck_assert_int_eq(0, ulcd_txt_set_color_fg(ulcd, 0x4321, &prev2));
+    ck_assert_int_eq(0, ulcd_pipeline_end(ulcd));
+    ck_assert_int_eq(0x1234, prev2);
+}
+END_TEST
+
+static void
+count_replies(struct ulcd_t *ulcd, unsigned long seq, param_t opcode, int error, param_t value, void *arg)
+{
+    if (error == ERROK) {
+        ++(*(int *)arg);
+    }
+}
+
+START_TEST (test_pipeline_touch_event)
+{
+    struct point_t p1 = { 0, 0 }, p2 = { 9, 9 };
+    struct touch_event_t ev;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* The status is known before deciding whether to ask for X and Y */
+    ulcd_emu_touch(emu, TOUCH_STATUS_PRESS, 12, 34);
+    ev.status = TOUCH_STATUS_NOTOUCH;
+    ev.point.x = 0;
+    ev.point.y = 0;
+    ck_assert_int_eq(0, ulcd_pipeline_begin(ulcd, 4, NULL, NULL));
+    ck_assert_int_eq(0, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0x001f));
+    ck_assert_int_eq(0, ulcd_touch_get_event(ulcd, &ev));
+    ck_assert_int_eq(TOUCH_STATUS_PRESS, ev.status);
+    ck_assert_int_eq(12, ev.point.x);
+    ck_assert_int_eq(34, ev.point.y);
+    ck_assert_int_eq(0, ulcd_pipeline_end(ulcd));
+    ulcd_emu_touch(emu, TOUCH_STATUS_NOTOUCH, 0, 0);
+}
+END_TEST
+
+START_TEST (test_async_draw)
+{
+    struct point_t p1 = { 100, 100 };
+    int queued = 0;
+    int completed = 0;
+    long baud_rate = ulcd->baud_rate;
+
+    ck_assert_int_eq(0, ulcd_async_begin(ulcd, 8, count_replies, &completed));
+
+    /* A refused rate change leaves the recorded rate alone */
+    ck_assert_int_eq(ERRASYNC, ulcd_set_baud_rate(ulcd, baud_rate == 9600 ? 19200 : 9600));
+    ck_assert_int_eq(baud_rate, ulcd->baud_rate);
+
+    while (queued < 32) {
+        if (ulcd_gfx_circle(ulcd, &p1, 50, 0xffff) == ERROK) {
+            ++queued;
+        } else {
+            ck_assert_int_eq(ERRBUSY, ulcd->error);
+            ck_assert_int_eq(0, ulcd_io_wait(ulcd));
+        }
+    }
+    while (ulcd_io_wants(ulcd)) {
+        ck_assert_int_eq(0, ulcd_io_wait(ulcd));
+    }
+    ck_assert_int_eq(0, ulcd_async_end(ulcd));
+    ck_assert_int_eq(32, completed);
+}
+END_TEST
+
+static struct ulcd_t *group_removed;
+static int group_removing;
+
+/**
+ * Removes the other display of a group of two, the first time a reply comes in
+ */
+static void
+remove_other(struct ulcd_t *ulcd, unsigned long seq, param_t opcode, int error, param_t value, void *arg)
+{
+    struct ulcd_group_t *group = arg;
+
+    if (group_removing) {
+        return;
+    }
+    group_removing = 1;
+    group_removed = ulcd_group_remove(group, ulcd_group_get(group, 0) == ulcd ? 1 : 0);
+}
+
+START_TEST (test_group_draw)
+{
+    struct ulcd_group_t *group;
+    struct group_stats_t stats;
+    struct point_t p1 = { 100, 100 };
+    int i;
+
+    group = ulcd_group_new();
+    ck_assert_ptr_ne(NULL, group);
+    ck_assert_int_eq(0, ulcd_group_add(group, ulcd, 8, NULL, NULL));
+
+    for (i = 0; i < 32; i++) {
+        while (ulcd_gfx_circle(ulcd, &p1, 50, 0xffff) == ERRBUSY) {
+            ulcd_group_process(group, 1000);
+        }
+    }
+    while (ulcd->pipeline.count > 0) {
+        ck_assert_int_ge(ulcd_group_process(group, 1000), 0);
+    }
+
+    ck_assert_int_eq(0, ulcd_group_stats(group, 0, &stats));
+    ck_assert_int_eq(0, stats.queued);
+    ck_assert_int_eq(32, stats.completed);
+    ck_assert_int_eq(0, stats.errors);
+
+    /* The group owns the display until it is removed */
+    ck_assert_ptr_eq(ulcd, ulcd_group_remove(group, 0));
+    ulcd_group_free(group);
+}
+END_TEST
+
+START_TEST (test_group_remove_in_callback)
+{
+    struct ulcd_group_t *group;
+    struct ulcd_emu_t *emu2;
+    struct ulcd_t *ulcd2;
+    struct point_t p1 = { 100, 100 };
+
+    if (emu == NULL) {
+        return;
+    }
+
+    emu2 = ulcd_emu_new();
+    ck_assert_int_eq(0, ulcd_emu_start(emu2));
+    ulcd2 = ulcd_new();
+    ulcd_set_baud_rate(ulcd2, 115200);
+    strcpy(ulcd2->device, emu2->device);
+    ck_assert_int_eq(0, ulcd_open_serial_device(ulcd2));
+    ulcd_set_serial_parameters(ulcd2);
+
+    group = ulcd_group_new();
+    group_removed = NULL;
+    group_removing = 0;
+    ck_assert_int_eq(0, ulcd_group_add(group, ulcd, 8, remove_other, group));
+    ck_assert_int_eq(1, ulcd_group_add(group, ulcd2, 8, remove_other, group));
+
+    /* Both replies arrive before either display is serviced, so the first
+     * callback removes a display that is still in the batch of events */
+    ck_assert_int_eq(0, ulcd_gfx_circle(ulcd, &p1, 50, 0xffff));
+    ck_assert_int_eq(0, ulcd_gfx_circle(ulcd2, &p1, 50, 0xffff));
+    ck_assert_int_ge(ulcd_group_process(group, 0), 0);
+    usleep(100000);
+    while (group_removed == NULL) {
+        ck_assert_int_ge(ulcd_group_process(group, 1000), 0);
+    }
+
+    ck_assert_int_eq(1, group->num);
+    ck_assert_ptr_eq(NULL, group->removed);
+    ck_assert_int_eq(0, group_removed->pipeline.count);
+    ck_assert_ptr_ne(NULL, ulcd_group_remove(group, 0));
+    ulcd_group_free(group);
+    ulcd_free(ulcd2);
+    ulcd_emu_free(emu2);
+}
+END_TEST
+
 
 /**
  * Gfx test case
@@ -193,6 +574,41 @@ START_TEST (test_set_baud_rate)
 }
 END_TEST
 
+START_TEST (test_negotiate_baud_rate)
+{
+    if (emu == NULL) {
+        return;
+    }
+
+    /* Replies are garbled above 300 kbaud, so 375000 must be rolled back */
+    emu->max_baud_rate = 320000;
+    ck_assert_int_eq(0, ulcd_negotiate_baud_rate(ulcd, 600000));
+    ck_assert_int_eq(300000, ulcd->baud_rate);
+    ck_assert_int_eq(0, ulcd_get_spe_version(ulcd));
+
+    emu->max_baud_rate = 0;
+    ck_assert_int_eq(0, ulcd_negotiate_baud_rate(ulcd, 600000));
+    ck_assert_int_eq(600000, ulcd->baud_rate);
+    ck_assert_int_eq(0, ulcd_get_spe_version(ulcd));
+
+    ck_assert_int_eq(0, ulcd_set_baud_rate(ulcd, 115200));
+    ck_assert_int_eq(0, ulcd_get_spe_version(ulcd));
+
+    /* Probes are answered before they are checked, even when pipelining,
+     * so a stale version is not taken for the reply */
+    emu->max_baud_rate = 320000;
+    ck_assert_int_eq(0, ulcd_pipeline_begin(ulcd, PIPELINE_DEPTH_MAX, NULL, NULL));
+    ulcd->spe_version = 0xffff;
+    ck_assert_int_eq(0, ulcd_negotiate_baud_rate(ulcd, 600000));
+    ck_assert_int_eq(0, ulcd_pipeline_end(ulcd));
+    ck_assert_int_eq(300000, ulcd->baud_rate);
+    ck_assert_int_eq(0, ulcd_get_spe_version(ulcd));
+
+    emu->max_baud_rate = 0;
+    ck_assert_int_eq(0, ulcd_set_baud_rate(ulcd, 115200));
+}
+END_TEST
+
 
 /**
  * Touch test case
@@ -290,7 +706,7 @@ START_TEST (test_txt_set_color_fg)
     color_t chk;
     ck_assert_int_eq(0, ulcd_txt_set_color_fg(ulcd, c1, &chk));
     ck_assert_int_eq(0, ulcd_txt_set_color_fg(ulcd, c2, &chk));
-    ck_assert_int_eq(chk, c2);
+    ck_assert_int_eq(chk, c1);
 }
 END_TEST
 
@@ -301,7 +717,7 @@ START_TEST (test_txt_set_color_bg)
     color_t chk;
     ck_assert_int_eq(0, ulcd_txt_set_color_bg(ulcd, c1, &chk));
     ck_assert_int_eq(0, ulcd_txt_set_color_bg(ulcd, c2, &chk));
-    ck_assert_int_eq(chk, c2);
+    ck_assert_int_eq(chk, c1);
 }
 END_TEST
 
@@ -415,6 +831,807 @@ START_TEST (test_txt_set_attributes)
 }
 END_TEST
 
+/**
+ * Emulator test case
+ */
+
+START_TEST (test_emu_framebuffer)
+{
+    struct point_t p1 = { 10, 10 };
+    struct point_t p2 = { 19, 19 };
+    const char pixels[8] = { 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0 };
+
+    if (emu == NULL) {
+        return;
+    }
+
+    ck_assert_int_eq(0, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0xf800));
+    ck_assert_int_eq(0xf800, ulcd_emu_pixel(emu, 0, 10, 10));
+    ck_assert_int_eq(0xf800, ulcd_emu_pixel(emu, 0, 19, 19));
+    ck_assert_int_eq(0x0000, ulcd_emu_pixel(emu, 0, 20, 20));
+
+    ck_assert_int_eq(0, ulcd_image_bitblt(ulcd, &p1, 2, 2, pixels));
+    ck_assert_int_eq(0x1234, ulcd_emu_pixel(emu, 0, 10, 10));
+    ck_assert_int_eq(0x5678, ulcd_emu_pixel(emu, 0, 11, 10));
+    ck_assert_int_eq(0xdef0, ulcd_emu_pixel(emu, 0, 11, 11));
+}
+END_TEST
+
+START_TEST (test_emu_touch)
+{
+    struct touch_event_t ev;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    ulcd_emu_touch(emu, TOUCH_STATUS_PRESS, 123, 45);
+    ck_assert_int_eq(0, ulcd_touch_get_event(ulcd, &ev));
+    ck_assert_int_eq(TOUCH_STATUS_PRESS, ev.status);
+    ck_assert_int_eq(123, ev.point.x);
+    ck_assert_int_eq(45, ev.point.y);
+
+    ulcd_emu_touch(emu, TOUCH_STATUS_NOTOUCH, 0, 0);
+}
+END_TEST
+
+START_TEST (test_emu_nak)
+{
+    char cmd[4];
+    int s = pack_uints(cmd, 2, CONTRAST, 16);
+
+    if (emu == NULL) {
+        return;
+    }
+
+    ck_assert_int_eq(ERRNAK, ulcd_send_recv_ack_word(ulcd, cmd, s, NULL));
+}
+END_TEST
+
+
+
+/**
+ * Deadline test case
+ */
+
+START_TEST (test_deadline_scaled)
+{
+    struct point_t p = {0, 0};
+    char *pixels;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* 19200 bytes take 1.7 seconds at 115200 baud */
+    pixels = calloc(120 * 80, 2);
+    emu->baud_rate = 115200;
+    ck_assert_int_eq(ERROK, ulcd_image_bitblt(ulcd, &p, 120, 80, pixels));
+    emu->baud_rate = 0;
+    free(pixels);
+}
+END_TEST
+
+START_TEST (test_deadline_override)
+{
+    struct point_t p = {100, 100};
+
+    if (emu == NULL) {
+        return;
+    }
+
+    emu->cmd_cost = 500000;
+    ulcd_set_call_timeout(ulcd, 2000000);
+    ck_assert_int_eq(ERROK, ulcd_gfx_circle(ulcd, &p, 10, 0xffff));
+    emu->cmd_cost = 0;
+}
+END_TEST
+
+START_TEST (test_deadline_override_touch_service)
+{
+    struct point_t p = {100, 100};
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* A poll that goes first must not use up the command's timeout */
+    ulcd_emu_touch(emu, TOUCH_STATUS_NOTOUCH, 0, 0);
+    ck_assert_int_eq(ERROK, ulcd_touch_service_start(ulcd, 0, 0));
+    emu->cmd_cost = 500000;
+    ulcd_set_call_timeout(ulcd, 2000000);
+    ck_assert_int_eq(ERROK, ulcd_gfx_circle(ulcd, &p, 10, 0xffff));
+    ck_assert_int_eq(1, ulcd->touch->polls);
+    ck_assert_int_eq(0, ulcd->call_timeout);
+    emu->cmd_cost = 0;
+    ck_assert_int_eq(ERROK, ulcd_touch_service_stop(ulcd));
+}
+END_TEST
+
+START_TEST (test_deadline_stall)
+{
+    struct point_t p = {100, 100};
+    unsigned long long start;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* The reply will come far too late */
+    emu->cmd_cost = 2000000;
+    start = ulcd_now();
+    ck_assert_int_eq(ERRTIMEOUT, ulcd_gfx_circle(ulcd, &p, 10, 0xffff));
+    ck_assert(ulcd_now() - start < 500000);
+}
+END_TEST
+
+static int
+stream_source(struct ulcd_t *ulcd, char *buffer, int size, void *arg)
+{
+    unsigned long *offset = arg;
+    int i;
+
+    /* Every pixel holds its index in the image */
+    for (i = 0; i < size; i += 2) {
+        pack_uint(buffer + i, (*offset + i) / 2);
+    }
+    *offset += size;
+
+    return size;
+}
+
+static int
+stream_cancel(struct ulcd_t *ulcd, unsigned long done, unsigned long total, void *arg)
+{
+    return 1;
+}
+
+START_TEST (test_emu_bitblt_stream)
+{
+    struct point_t p = { 0, 0 };
+    unsigned long offset = 0;
+    char pixels[480 * 2 * 10];
+    int fds[2];
+    int i;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* 480 pixel rows go in bands of 8, so 20 rows make three commands */
+    ck_assert_int_eq(ERROK, ulcd_image_bitblt_stream(ulcd, &p, 480, 20, stream_source, NULL, &offset));
+    ck_assert_int_eq(480 * 20 * 2, offset);
+    ck_assert_int_eq(0, ulcd_emu_pixel(emu, 0, 0, 0));
+    ck_assert_int_eq(480 * 9 + 5, ulcd_emu_pixel(emu, 0, 5, 9));
+    ck_assert_int_eq(480 * 19 + 479, ulcd_emu_pixel(emu, 0, 479, 19));
+
+    /* Cancelled after the first band */
+    offset = 0;
+    p.y = 100;
+    ck_assert_int_eq(ERRCANCELED, ulcd_image_bitblt_stream(ulcd, &p, 480, 20, stream_source, stream_cancel, &offset));
+    ck_assert_int_eq(480 * 8 * 2, offset);
+    ck_assert_int_eq(480 * 7, ulcd_emu_pixel(emu, 0, 0, 107));
+    ck_assert_int_eq(0, ulcd_emu_pixel(emu, 0, 0, 108));
+
+    /* From a pipe that ends early */
+    for (i = 0; i < (int)sizeof(pixels); i += 2) {
+        pack_uint(pixels + i, 0x1234);
+    }
+    ck_assert_int_eq(0, pipe(fds));
+    ck_assert_int_eq(sizeof(pixels), write(fds[1], pixels, sizeof(pixels)));
+    close(fds[1]);
+    p.y = 200;
+    ck_assert_int_eq(ERRREAD, ulcd_image_bitblt_fd(ulcd, &p, 480, 12, fds[0], NULL, NULL));
+    close(fds[0]);
+    ck_assert_int_eq(0x1234, ulcd_emu_pixel(emu, 0, 0, 200));
+    ck_assert_int_eq(0, ulcd_emu_pixel(emu, 0, 0, 208));
+}
+END_TEST
+
+START_TEST (test_emu_asset_blit)
+{
+    char path[] = "/tmp/check_ulcd_asset_XXXXXX";
+    struct point_t p = { 100, 100 };
+    struct asset_t *asset;
+    unsigned long writes;
+    char row[64 * 2];
+    int fd, x, y;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* A 64x40 image where every pixel holds its index */
+    fd = mkstemp(path);
+    ck_assert(fd != -1);
+    for (y = 0; y < 40; y++) {
+        for (x = 0; x < 64; x++) {
+            pack_uint(row + x * 2, y * 64 + x);
+        }
+        ck_assert_int_eq(sizeof(row), write(fd, row, sizeof(row)));
+    }
+    close(fd);
+
+    asset = ulcd_asset_open(path, 64);
+    unlink(path);
+    ck_assert(asset != NULL);
+    ck_assert_int_eq(40, asset->height);
+
+    /* The header and all twelve rows go out in one write */
+    writes = ulcd->write_calls;
+    ck_assert_int_eq(ERROK, ulcd_asset_blit(ulcd, &p, asset, 10, 5, 20, 12));
+    ck_assert_int_eq(1, ulcd->write_calls - writes);
+    ck_assert_int_eq(5 * 64 + 10, ulcd_emu_pixel(emu, 0, 100, 100));
+    ck_assert_int_eq(16 * 64 + 29, ulcd_emu_pixel(emu, 0, 119, 111));
+    ck_assert_int_eq(0, ulcd_emu_pixel(emu, 0, 120, 111));
+
+    /* Full rows are contiguous */
+    p.y = 200;
+    ck_assert_int_eq(ERROK, ulcd_asset_blit(ulcd, &p, asset, 0, 30, 64, 10));
+    ck_assert_int_eq(39 * 64 + 63, ulcd_emu_pixel(emu, 0, 163, 209));
+
+    ck_assert_int_eq(ERRRANGE, ulcd_asset_blit(ulcd, &p, asset, 50, 0, 20, 1));
+    ck_assert_int_eq(ERRRANGE, ulcd_asset_blit(ulcd, &p, asset, 0, 35, 1, 10));
+
+    ulcd_asset_close(asset);
+}
+END_TEST
+
+static void
+fill_frame(char *frame, int x0, int y0, int w, int h, param_t color)
+{
+    int x, y;
+
+    for (y = y0; y < y0 + h; y++) {
+        for (x = x0; x < x0 + w; x++) {
+            pack_uint(frame + (y * 480 + x) * 2, color);
+        }
+    }
+}
+
+START_TEST (test_emu_shadow)
+{
+    struct shadow_t *shadow;
+    char *frame;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    shadow = ulcd_shadow_new(480, 272);
+    frame = malloc(480 * 272 * 2);
+    fill_frame(frame, 0, 0, 480, 272, 0x001f);
+
+    /* The first update sends everything, here as one filled rectangle */
+    ck_assert_int_eq(ERROK, ulcd_shadow_update(ulcd, shadow, frame));
+    ck_assert_int_eq(12, shadow->bytes);
+    ck_assert_int_eq(0x001f, ulcd_emu_pixel(emu, 0, 479, 271));
+
+    ck_assert_int_eq(ERROK, ulcd_shadow_update(ulcd, shadow, frame));
+    ck_assert_int_eq(0, shadow->rects);
+
+    /* Two widgets far apart are sent on their own */
+    fill_frame(frame, 10, 10, 20, 10, 0xf800);
+    fill_frame(frame, 300, 200, 30, 8, 0x07e0);
+    ck_assert_int_eq(ERROK, ulcd_shadow_update(ulcd, shadow, frame));
+    ck_assert_int_eq(2, shadow->rects);
+    ck_assert_int_eq(2 * 12, shadow->bytes);
+    ck_assert_int_eq(0xf800, ulcd_emu_pixel(emu, 0, 29, 19));
+    ck_assert_int_eq(0x001f, ulcd_emu_pixel(emu, 0, 30, 19));
+    ck_assert_int_eq(0x07e0, ulcd_emu_pixel(emu, 0, 300, 207));
+
+    /* Changes a few pixels apart, across a tile boundary, go in one command */
+    fill_frame(frame, 14, 100, 1, 1, 0xffff);
+    fill_frame(frame, 18, 101, 1, 1, 0xffff);
+    ck_assert_int_eq(ERROK, ulcd_shadow_update(ulcd, shadow, frame));
+    ck_assert_int_eq(1, shadow->rects);
+    ck_assert_int_eq(10 + 5 * 2 * 2, shadow->bytes);
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 18, 101));
+
+    free(frame);
+    ulcd_shadow_free(shadow);
+}
+END_TEST
+
+START_TEST (test_emu_encode)
+{
+    struct point_t p = { 200, 150 };
+    unsigned long long sent;
+    char *frame;
+    int x, y;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* A flat background with a small detailed patch */
+    frame = malloc(480 * 272 * 2);
+    fill_frame(frame, 0, 0, 64, 48, 0x001f);
+    for (y = 20; y < 24; y++) {
+        for (x = 20; x < 24; x++) {
+            fill_frame(frame, x, y, 1, 1, x * 64 + y);
+        }
+    }
+
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_image_encode(ulcd, &p, frame, 480 * 2, 0, 0, 64, 48));
+    ck_assert(ulcd->tx_bytes - sent < 100);
+
+    for (y = 0; y < 48; y++) {
+        for (x = 0; x < 64; x++) {
+            ck_assert_int_eq(x >= 20 && x < 24 && y >= 20 && y < 24 ? x * 64 + y : 0x001f,
+                             ulcd_emu_pixel(emu, 0, 200 + x, 150 + y));
+        }
+    }
+
+    free(frame);
+}
+END_TEST
+
+START_TEST (test_emu_frame)
+{
+    struct point_t p1 = { 10, 10 }, p2 = { 19, 19 };
+
+    if (emu == NULL) {
+        return;
+    }
+
+    ck_assert_int_eq(ERROK, ulcd_gfx_set_page_display(ulcd, 0));
+    ck_assert_int_eq(ERROK, ulcd_gfx_set_page_write(ulcd, 0));
+
+    /* The first frame is drawn on the hidden page and shown at the end */
+    ck_assert_int_eq(ERROK, ulcd_frame_begin(ulcd));
+    ck_assert_int_eq(ERROK, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0xf800));
+    ck_assert_int_eq(0, emu->page_display);
+    ck_assert_int_eq(1, emu->page_write);
+    ck_assert_int_eq(0xf800, ulcd_emu_pixel(emu, 1, 15, 15));
+    ck_assert_int_eq(ERROK, ulcd_frame_end(ulcd));
+    ck_assert_int_eq(1, emu->page_display);
+
+    /* The next one goes to the page that was shown before */
+    ck_assert_int_eq(ERROK, ulcd_frame_begin(ulcd));
+    ck_assert_int_eq(0, emu->page_write);
+    ck_assert_int_eq(ERROK, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0x07e0));
+    ck_assert_int_eq(0xf800, ulcd_emu_pixel(emu, 1, 15, 15));
+    ck_assert_int_eq(ERROK, ulcd_frame_end(ulcd));
+    ck_assert_int_eq(0, emu->page_display);
+    ck_assert_int_eq(0x07e0, ulcd_emu_pixel(emu, 0, 15, 15));
+
+    /* Outside of a frame, drawing goes to the page that is shown */
+    ck_assert_int_eq(0, ulcd->page_write);
+}
+END_TEST
+
+START_TEST (test_emu_sprite)
+{
+    struct sprite_cache_t *cache;
+    struct point_t p;
+    unsigned long long sent;
+    char *icons;
+    int i, x, y;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* Three 16x16 icons side by side, in a cache with room for two */
+    icons = malloc(48 * 16 * 2);
+    for (y = 0; y < 16; y++) {
+        for (x = 0; x < 48; x++) {
+            icons[(y * 48 + x) * 2] = (x / 16 + 1) << 3;
+            icons[(y * 48 + x) * 2 + 1] = y;
+        }
+    }
+    cache = ulcd_sprite_cache_new(2, 1, 16, 32);
+
+    p.x = 100;
+    p.y = 100;
+    ck_assert_int_eq(ERROK, ulcd_sprite_draw(ulcd, cache, &p, icons, 48 * 2, 16, 16));
+    ck_assert_int_eq(1, cache->misses);
+    ck_assert_int_eq(0x0805, ulcd_emu_pixel(emu, 0, 105, 105));
+
+    /* Drawing it again only copies it on the display */
+    p.x = 200;
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_sprite_draw(ulcd, cache, &p, icons, 48 * 2, 16, 16));
+    ck_assert_int_eq(14, ulcd->tx_bytes - sent);
+    ck_assert_int_eq(1, cache->hits);
+    ck_assert_int_eq(0x0805, ulcd_emu_pixel(emu, 0, 205, 105));
+
+    ck_assert_int_eq(ERROK, ulcd_sprite_draw(ulcd, cache, &p, icons + 32, 48 * 2, 16, 16));
+    ck_assert_int_eq(ERROK, ulcd_sprite_draw(ulcd, cache, &p, icons, 48 * 2, 16, 16));
+    ck_assert_int_eq(0, cache->evictions);
+
+    /* The third icon evicts the second, which was used least recently */
+    ck_assert_int_eq(ERROK, ulcd_sprite_draw(ulcd, cache, &p, icons + 64, 48 * 2, 16, 16));
+    ck_assert_int_eq(1, cache->evictions);
+    ck_assert_int_eq(0x1805, ulcd_emu_pixel(emu, 0, 205, 105));
+    ck_assert_int_eq(ERROK, ulcd_sprite_draw(ulcd, cache, &p, icons, 48 * 2, 16, 16));
+    ck_assert_int_eq(3, cache->hits);
+    ck_assert_int_eq(ERROK, ulcd_sprite_draw(ulcd, cache, &p, icons + 32, 48 * 2, 16, 16));
+    ck_assert_int_eq(4, cache->misses);
+    ck_assert_int_eq(0x1005, ulcd_emu_pixel(emu, 0, 205, 105));
+
+    /* Uploads leave the write page alone */
+    ck_assert_int_eq(0, emu->page_write);
+
+    for (i = 0; i < 16; i++) {
+        ck_assert_int_eq(0x1000 + i, ulcd_emu_pixel(emu, 0, 200 + i, 100 + i));
+    }
+
+    ulcd_sprite_cache_free(cache);
+    free(icons);
+}
+END_TEST
+
+START_TEST (test_emu_scroll)
+{
+    struct point_t p1, p2;
+    int y;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* One colour per row, with a border around the region */
+    p1.x = 19;
+    p1.y = 49;
+    p2.x = 60;
+    p2.y = 80;
+    ck_assert_int_eq(ERROK, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0xffff));
+    for (y = 50; y < 80; y++) {
+        p1.x = 20;
+        p2.x = 59;
+        p1.y = p2.y = y;
+        ck_assert_int_eq(ERROK, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, y));
+    }
+
+    /* Clipping is suspended while scrolling */
+    p1.x = p1.y = 0;
+    p2.x = p2.y = 10;
+    ck_assert_int_eq(ERROK, ulcd_gfx_clip_window(ulcd, &p1, &p2));
+    ck_assert_int_eq(ERROK, ulcd_gfx_clipping(ulcd, 1));
+
+    p1.x = 20;
+    p1.y = 50;
+    p2.x = 59;
+    p2.y = 79;
+    ck_assert_int_eq(ERROK, ulcd_gfx_scroll(ulcd, &p1, &p2, 4, 0x0001));
+    for (y = 50; y < 80; y++) {
+        ck_assert_int_eq(y < 76 ? y + 4 : 0x0001, ulcd_emu_pixel(emu, 0, 30, y));
+    }
+
+    ck_assert_int_eq(ERROK, ulcd_gfx_scroll(ulcd, &p1, &p2, -7, 0x0002));
+    for (y = 50; y < 80; y++) {
+        ck_assert_int_eq(y < 57 ? 0x0002 : y - 3, ulcd_emu_pixel(emu, 0, 30, y));
+        ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 19, y));
+        ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 60, y));
+    }
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 30, 49));
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 30, 80));
+
+    ck_assert_int_eq(1, emu->clipping);
+    ck_assert_int_eq(ERROK, ulcd_gfx_clipping(ulcd, 0));
+}
+END_TEST
+
+START_TEST (test_emu_txt_cache)
+{
+    unsigned long long sent;
+    param_t prev;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    ck_assert_int_eq(ERROK, ulcd_txt_reset(ulcd));
+
+    /* Settings that do not change are not sent */
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_set_color_fg(ulcd, 0xffff, &prev));
+    ck_assert_int_eq(0xffff, prev);
+    ck_assert_int_eq(ERROK, ulcd_txt_set_font(ulcd, 0, NULL));
+    ck_assert_int_eq(ERROK, ulcd_txt_set_bold(ulcd, 0, &prev));
+    ck_assert_int_eq(0, prev);
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+
+    ck_assert_int_eq(ERROK, ulcd_txt_set_bold(ulcd, 1, NULL));
+    ck_assert_int_eq(ERROK, ulcd_txt_set_width(ulcd, 2, NULL));
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_set_attributes(ulcd, TXT_ATTRIBUTE_BOLD, &prev));
+    ck_assert_int_eq(TXT_ATTRIBUTE_BOLD, prev);
+    ck_assert_int_eq(ERROK, ulcd_txt_set_width(ulcd, 2, NULL));
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+
+    /* Clearing the screen resets the width on the display */
+    ck_assert_int_eq(ERROK, ulcd_gfx_cls(ulcd));
+    ck_assert_int_eq(1, emu->regs[TXT_WIDTH & 0xff]);
+    ck_assert_int_eq(ERROK, ulcd_txt_set_width(ulcd, 2, &prev));
+    ck_assert_int_eq(1, prev);
+    ck_assert_int_eq(2, emu->regs[TXT_WIDTH & 0xff]);
+
+    /* Resetting sends everything */
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_reset(ulcd));
+    ck_assert_int_eq(8 * 4, ulcd->tx_bytes - sent);
+}
+END_TEST
+
+START_TEST (test_emu_metrics)
+{
+    char path[] = "/tmp/check_ulcd_metrics.XXXXXX";
+    unsigned long long sent;
+    param_t w, h;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    ck_assert_int_eq(ERROK, ulcd_txt_reset(ulcd));
+    ck_assert_int_eq(ERROK, ulcd_txt_metrics_probe(ulcd));
+
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_measure(ulcd, "Hello", &w, &h));
+    ck_assert_int_eq(5 * 7, w);
+    ck_assert_int_eq(8, h);
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+
+    /* Other sizes are measured as they are used */
+    ck_assert_int_eq(ERROK, ulcd_txt_set_width(ulcd, 2, NULL));
+    ck_assert_int_eq(ERROK, ulcd_txt_set_xgap(ulcd, 3, NULL));
+    ck_assert_int_eq(ERROK, ulcd_txt_measure(ulcd, "abba", &w, &h));
+    ck_assert_int_eq(4 * 14 + 3 * 3, w);
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_charwidth(ulcd, 'b', &w));
+    ck_assert_int_eq(14, w);
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+
+    /* Saved metrics are used without asking the display */
+    close(mkstemp(path));
+    ck_assert_int_eq(ERROK, ulcd_txt_metrics_save(ulcd, path));
+    ulcd_txt_metrics_clear(ulcd);
+    ck_assert_int_eq(ERROK, ulcd_txt_metrics_load(ulcd, path));
+    unlink(path);
+
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_measure(ulcd, "ab", &w, &h));
+    ck_assert_int_eq(2 * 14 + 3, w);
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+    ck_assert_int_eq(ERROK, ulcd_txt_set_width(ulcd, 1, NULL));
+    ck_assert_int_eq(ERROK, ulcd_txt_set_xgap(ulcd, 0, NULL));
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_measure(ulcd, "Hello", &w, &h));
+    ck_assert_int_eq(5 * 7, w);
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+}
+END_TEST
+
+START_TEST (test_emu_layout)
+{
+    struct point_t p1 = { 10, 10 }, p2 = { 79, 200 };
+    char text[601];
+    param_t h;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* Ten characters of the default font fit on a line */
+    ck_assert_int_eq(ERROK, ulcd_txt_reset(ulcd));
+    ck_assert_int_eq(ERROK, ulcd_txt_set_ygap(ulcd, 2, NULL));
+
+    ck_assert_int_eq(ERROK, ulcd_txt_layout(ulcd, &p1, &p2, "hello world foo", TXT_LAYOUT_WRAP, &h));
+    ck_assert_int_eq(8 + 2 + 8, h);
+    ck_assert_int_eq(10 + 9 * 7, emu->origin[0]);
+    ck_assert_int_eq(20, emu->origin[1]);
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 13, 24));
+
+    ck_assert_int_eq(ERROK, ulcd_txt_layout(ulcd, &p1, &p2, "abc", TXT_LAYOUT_RIGHT, &h));
+    ck_assert_int_eq(80, emu->origin[0]);
+    ck_assert_int_eq(ERROK, ulcd_txt_layout(ulcd, &p1, &p2, "abc\n\nd", TXT_LAYOUT_CENTER, &h));
+    ck_assert_int_eq(3 * 8 + 2 * 2, h);
+    ck_assert_int_eq(10 + 31 + 7, emu->origin[0]);
+    ck_assert_int_eq(30, emu->origin[1]);
+
+    /* Clipped on the right, and at the bottom */
+    ck_assert_int_eq(ERROK, ulcd_txt_layout(ulcd, &p1, &p2, "aaaaaaaaaaaaaaaaaaaa", TXT_LAYOUT_CLIP, &h));
+    ck_assert_int_eq(80, emu->origin[0]);
+    p2.y = 25;
+    ck_assert_int_eq(ERROK, ulcd_txt_layout(ulcd, &p1, &p2, "hello world foo",
+                                            TXT_LAYOUT_WRAP | TXT_LAYOUT_CLIP, &h));
+    ck_assert_int_eq(8, h);
+    ck_assert_int_eq(10 + 5 * 7, emu->origin[0]);
+
+    /* Long lines take several commands */
+    memset(text, 'x', 600);
+    text[600] = '\0';
+    ck_assert_int_eq(ERROK, ulcd_txt_layout(ulcd, &p1, &p2, text, TXT_LAYOUT_LEFT, &h));
+    ck_assert_int_eq(10 + 600 * 7, emu->origin[0]);
+
+    ck_assert_int_eq(ERROK, ulcd_txt_set_ygap(ulcd, 0, NULL));
+}
+END_TEST
+
+START_TEST (test_emu_txt_stream)
+{
+    struct point_t origin = { 0, 100 };
+    unsigned long long sent;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    ck_assert_int_eq(ERROK, ulcd_txt_reset(ulcd));
+    ck_assert_int_eq(ERROK, ulcd_gfx_move_to(ulcd, &origin));
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_begin(ulcd, 16, 0));
+
+    /* Collected until another command is sent, which goes after them */
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_write(ulcd, "ab", 2));
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+    ck_assert_int_eq(ERROK, ulcd_txt_set_color_fg(ulcd, 0xf800, NULL));
+    ck_assert_int_eq(2 + 2 + 1 + 4, ulcd->tx_bytes - sent);
+    ck_assert_int_eq(14, emu->origin[0]);
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_putch(ulcd, 'c'));
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_flush(ulcd));
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 3, 103));
+    ck_assert_int_eq(0xf800, ulcd_emu_pixel(emu, 0, 17, 103));
+
+    /* Sent at a newline, and at the threshold */
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_write(ulcd, "d\n", 2));
+    ck_assert_int_eq(0, emu->origin[0]);
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_write(ulcd, "0123456789abcdefg", 17));
+    ck_assert_int_eq(2 + 16 + 1, ulcd->tx_bytes - sent);
+    ck_assert_int_eq(16 * 7, emu->origin[0]);
+
+    /* And when the first character is due */
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_end(ulcd));
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_begin(ulcd, 0, 1000));
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_putch(ulcd, 'h'));
+    ck_assert(ulcd_txt_stream_timeout(ulcd) >= 0);
+    usleep(2000);
+    ck_assert_int_eq(0, ulcd_txt_stream_timeout(ulcd));
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_poll(ulcd));
+    ck_assert_int_eq(-1, ulcd_txt_stream_timeout(ulcd));
+    ck_assert_int_eq(18 * 7, emu->origin[0]);
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_end(ulcd));
+}
+END_TEST
+
+START_TEST (test_emu_term)
+{
+    struct point_t origin = { 0, 150 };
+    const char *text = "hello\n\033[31mred\033[0m";
+    const char *lines = "a\nb\nc\n";
+    const char *edit = "\033[2;1H\033[K\033[1;3HD";
+    struct term_t *term;
+    unsigned long long sent;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* 7x8 cells of the default font */
+    ck_assert_int_eq(ERROK, ulcd_txt_reset(ulcd));
+    term = ulcd_term_new(&origin, 20, 4);
+
+    ulcd_term_write(term, text, strlen(text));
+    ck_assert_int_eq(ERROK, ulcd_term_refresh(ulcd, term));
+    ck_assert_int_eq(7, term->cell_width);
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 3, 153));
+    ck_assert_int_eq(0xa800, ulcd_emu_pixel(emu, 0, 3, 161));
+
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_term_refresh(ulcd, term));
+    ck_assert_int_eq(0, ulcd->tx_bytes - sent);
+
+    /* Scrolled lines are moved by the display; only the "a" is drawn */
+    ulcd_term_write(term, lines, strlen(lines));
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_term_refresh(ulcd, term));
+    ck_assert(ulcd->tx_bytes - sent < 64);
+    ck_assert_int_eq(0xa800, ulcd_emu_pixel(emu, 0, 3, 153));
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 24, 153));
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 3, 161));
+
+    /* Only the cells that change are drawn */
+    ulcd_term_write(term, edit, strlen(edit));
+    sent = ulcd->tx_bytes;
+    ck_assert_int_eq(ERROK, ulcd_term_refresh(ulcd, term));
+    ck_assert(ulcd->tx_bytes - sent < 30);
+    ck_assert_int_eq(0x0000, ulcd_emu_pixel(emu, 0, 3, 161));
+    ck_assert_int_eq(0xffff, ulcd_emu_pixel(emu, 0, 17, 153));
+    ck_assert_int_eq(0xa800, ulcd_emu_pixel(emu, 0, 10, 153));
+
+    ulcd_term_free(term);
+}
+END_TEST
+
+START_TEST (test_emu_touch_service)
+{
+    struct point_t p1 = { 0, 0 }, p2 = { 9, 9 };
+    struct touch_event_t ev;
+    struct pollfd pfd;
+    int i;
+
+    if (emu == NULL) {
+        return;
+    }
+
+    /* Without a thread, polls go ahead of commands when due */
+    ck_assert_int_eq(ERROK, ulcd_touch_service_start(ulcd, 0, 0));
+    ck_assert_int_eq(-1, ulcd_touch_service_fd(ulcd));
+    ulcd_emu_touch(emu, TOUCH_STATUS_PRESS, 10, 20);
+    ck_assert_int_eq(0, ulcd_touch_service_read(ulcd, &ev));
+    ck_assert_int_eq(ERROK, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0x001f));
+    ck_assert_int_eq(1, ulcd_touch_service_read(ulcd, &ev));
+    ck_assert_int_eq(TOUCH_STATUS_PRESS, ev.status);
+    ck_assert_int_eq(10, ev.point.x);
+    ck_assert_int_eq(20, ev.point.y);
+    ck_assert_int_eq(0, ulcd_touch_service_read(ulcd, &ev));
+
+    /* Pipelined, polls are queued among the commands */
+    ulcd_emu_touch(emu, TOUCH_STATUS_RELEASE, 11, 21);
+    ulcd_pipeline_begin(ulcd, 8, NULL, NULL);
+    for (i = 0; i < 4; i++) {
+        ck_assert_int_eq(ERROK, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0x001f));
+    }
+    ck_assert_int_eq(ERROK, ulcd_pipeline_end(ulcd));
+    ck_assert_int_eq(1, ulcd_touch_service_read(ulcd, &ev));
+    ck_assert_int_eq(TOUCH_STATUS_RELEASE, ev.status);
+    ck_assert_int_eq(11, ev.point.x);
+    ck_assert_int_eq(0, ulcd_touch_service_read(ulcd, &ev));
+    ck_assert_int_eq(0, ulcd->touch->polling);
+    ck_assert_int_eq(ERROK, ulcd_touch_service_stop(ulcd));
+    ck_assert(ulcd->touch == NULL);
+
+    /* With a thread, touches arrive while nothing is drawn */
+    ck_assert_int_eq(ERROK, ulcd_touch_service_start(ulcd, 1000, TOUCH_SERVICE_THREAD | TOUCH_SERVICE_EVENTFD));
+    pfd.fd = ulcd_touch_service_fd(ulcd);
+    pfd.events = POLLIN;
+    ck_assert(pfd.fd != -1);
+    ulcd_emu_touch(emu, TOUCH_STATUS_PRESS, 30, 40);
+    ck_assert_int_eq(1, poll(&pfd, 1, 1000));
+    ck_assert_int_eq(1, ulcd_touch_service_read(ulcd, &ev));
+    ck_assert_int_eq(TOUCH_STATUS_PRESS, ev.status);
+    ck_assert_int_eq(30, ev.point.x);
+    ck_assert_int_eq(40, ev.point.y);
+
+    /* and keep being polled while drawing */
+    ulcd_emu_touch(emu, TOUCH_STATUS_NOTOUCH, 0, 0);
+    for (i = 0; i < 200; i++) {
+        ck_assert_int_eq(ERROK, ulcd_gfx_filled_rectangle(ulcd, &p1, &p2, 0x001f));
+    }
+    ck_assert(ulcd->touch->polls > 1);
+    ck_assert(ulcd->touch->max_gap < 50000);
+
+    while (ulcd_touch_service_read(ulcd, &ev));
+    pfd.revents = 0;
+    ck_assert_int_eq(0, poll(&pfd, 1, 0));
+    ck_assert_int_eq(ERROK, ulcd_touch_service_stop(ulcd));
+}
+END_TEST
+
+START_TEST (test_emu_touch_service_stream)
+{
+    if (emu == NULL) {
+        return;
+    }
+
+    /* The service thread leaves collected characters to the application */
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_begin(ulcd, 0, 0));
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_write(ulcd, "ab", 2));
+    ck_assert_int_eq(ERROK, ulcd_touch_service_start(ulcd, 1000, TOUCH_SERVICE_THREAD));
+    usleep(20000);
+    ck_assert(ulcd->touch->polls > 0);
+    ck_assert_int_eq(2, ulcd->stream.len);
+    ck_assert_int_eq(ERROK, ulcd_touch_service_stop(ulcd));
+    ck_assert_int_eq(ERROK, ulcd_txt_stream_end(ulcd));
+    ck_assert_int_eq(0, ulcd->stream.len);
+}
+END_TEST
+
 /**
  * Image Control test case
  */
@@ -442,8 +1659,32 @@ ulcd_suite(void)
     tcase_add_test(tc_util, test_error);
     tcase_add_test(tc_util, test_make_polygon);
     tcase_add_test(tc_util, test_pack_polygon);
+    tcase_add_test(tc_util, test_trace);
+    tcase_add_test(tc_util, test_rx_readahead);
+    tcase_add_test(tc_util, test_stats);
+    tcase_add_test(tc_util, test_pixels_convert);
     suite_add_tcase(s, tc_util);
 
+    /* Pipeline test case */
+    TCase *tc_pipeline = tcase_create("pipeline");
+    tcase_add_unchecked_fixture(tc_pipeline, setup, teardown);
+    tcase_add_test(tc_pipeline, test_pipeline_draw);
+    tcase_add_test(tc_pipeline, test_pipeline_word);
+    tcase_add_test(tc_pipeline, test_pipeline_touch_event);
+    tcase_add_test(tc_pipeline, test_async_draw);
+    tcase_add_test(tc_pipeline, test_group_draw);
+    tcase_add_test(tc_pipeline, test_group_remove_in_callback);
+    suite_add_tcase(s, tc_pipeline);
+
+    /* Deadline test case */
+    TCase *tc_deadline = tcase_create("deadline");
+    tcase_add_unchecked_fixture(tc_deadline, setup, teardown);
+    tcase_add_test(tc_deadline, test_deadline_scaled);
+    tcase_add_test(tc_deadline, test_deadline_override);
+    tcase_add_test(tc_deadline, test_deadline_override_touch_service);
+    tcase_add_test(tc_deadline, test_deadline_stall);
+    suite_add_tcase(s, tc_deadline);
+
     /* Gfx test case */
     TCase *tc_gfx = tcase_create("gfx");
     tcase_add_unchecked_fixture(tc_gfx, setup, teardown);
@@ -462,6 +1703,7 @@ ulcd_suite(void)
     TCase *tc_serial = tcase_create("serial");
     tcase_add_unchecked_fixture(tc_serial, setup, teardown);
     tcase_add_test(tc_serial, test_set_baud_rate);
+    tcase_add_test(tc_serial, test_negotiate_baud_rate);
     suite_add_tcase(s, tc_serial);
 
     /* Touch test case */
@@ -496,6 +1738,28 @@ ulcd_suite(void)
     tcase_add_test(tc_text, test_txt_set_attributes);
     suite_add_tcase(s, tc_text);
 
+    /* Emulator test case */
+    TCase *tc_emu = tcase_create("emulator");
+    tcase_add_unchecked_fixture(tc_emu, setup, teardown);
+    tcase_add_test(tc_emu, test_emu_framebuffer);
+    tcase_add_test(tc_emu, test_emu_touch);
+    tcase_add_test(tc_emu, test_emu_nak);
+    tcase_add_test(tc_emu, test_emu_bitblt_stream);
+    tcase_add_test(tc_emu, test_emu_asset_blit);
+    tcase_add_test(tc_emu, test_emu_shadow);
+    tcase_add_test(tc_emu, test_emu_encode);
+    tcase_add_test(tc_emu, test_emu_frame);
+    tcase_add_test(tc_emu, test_emu_sprite);
+    tcase_add_test(tc_emu, test_emu_scroll);
+    tcase_add_test(tc_emu, test_emu_txt_cache);
+    tcase_add_test(tc_emu, test_emu_metrics);
+    tcase_add_test(tc_emu, test_emu_layout);
+    tcase_add_test(tc_emu, test_emu_txt_stream);
+    tcase_add_test(tc_emu, test_emu_term);
+    tcase_add_test(tc_emu, test_emu_touch_service);
+    tcase_add_test(tc_emu, test_emu_touch_service_stream);
+    suite_add_tcase(s, tc_emu);
+
     /* Image test case */
     /*
     TCase *tc_image = tcase_create("Image");